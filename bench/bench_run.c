@@ -0,0 +1,589 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file bench_run.c
+ *
+ * \brief Benchmarks.
+ *
+ * Every benchmark runs in batches for BENCH_ROUNDS rounds, each
+ * batch in a region of its own, so the cost of collecting what it
+ * allocated is part of its time. The fastest round is kept, as the
+ * slower ones mostly measure the rest of the machine. The whole suite
+ * is run BENCH_PASSES times over, so that a spell in which the
+ * machine is busy slows down one pass of a benchmark rather than all
+ * of them, and the median of the passes is reported. One line is
+ * printed per benchmark:
+ *
+ * \code
+ * name ns/op allocs/op peak-rss-kB
+ * \endcode
+ *
+ * An allocation is a cons cell or an atom. The peak resident set
+ * is that of the whole process so far. For parse and print an op is
+ * a byte of text. The Lisp files named on the command line are run
+ * as end to end benchmarks, each in a context of its own: the forms
+ * before the last are run once, and an op is one evaluation of the
+ * last.
+ *
+ * With --compare=FILE the results are compared with those in FILE,
+ * written by an earlier run, and the exit status is 1 if anything
+ * took more than BENCH_SLOWER times as long. A benchmark that does
+ * gets up to BENCH_RETRIES more passes, after the others, and only
+ * counts as slower if the median of all its passes stays slower.
+ */
+
+#include "cons_impl.h"
+#include "constants.h"
+#include "eval.h"
+#include "parser.h"
+#include "reader.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+
+/*! \internal
+ * \brief Seconds each pass of a benchmark runs for at least.
+ */
+#define BENCH_TIME 0.5
+
+
+/*! \internal
+ * \brief Rounds BENCH_TIME is split into, the fastest is kept.
+ */
+#define BENCH_ROUNDS 5
+
+
+/*! \internal
+ * \brief Passes over the whole suite, the median is reported.
+ */
+#define BENCH_PASSES 3
+
+
+/*! \internal
+ * \brief Ratio to the baseline that counts as a regression.
+ */
+#define BENCH_SLOWER 1.25
+
+
+/*! \internal
+ * \brief Extra passes for a benchmark slower than the baseline.
+ */
+#define BENCH_RETRIES 3
+
+
+/*! \internal
+ * \brief Number of names for the symbol benchmarks.
+ */
+#define NAMES 4096
+
+
+/*! \internal
+ * \brief The results of an earlier run, see --compare.
+ */
+static struct {
+    char (*name)[64];
+    double* ns;
+    size_t n;
+    bool slower;
+} baseline;
+
+
+/*! \internal
+ * \brief A benchmark, and its results so far.
+ */
+struct bench {
+    char what[64];
+    /*! Does some ops and returns how many. */
+    size_t (*batch)(size_t n);
+    /*! The number of ops to ask \c batch for. */
+    size_t n;
+    /*! For a Lisp file, its context and the form it times. */
+    struct lisp_ctx* ctx;
+    sexp query;
+    /*! The fastest round of each pass. */
+    double ns[BENCH_PASSES + BENCH_RETRIES];
+    int passes;
+    double allocs;
+};
+
+
+/*! \internal
+ * \brief The benchmarks, in the order they run.
+ */
+static struct {
+    struct bench* v;
+    size_t n;
+    size_t cap;
+} suite;
+
+
+/*! \internal
+ * \brief Data the benchmarks work on, made by setup().
+ */
+static sexp list;
+static sexp alist;
+static sexp tree;
+static char name[NAMES][8];
+static const char* text;
+
+
+/*! \internal
+ * \brief Monotonic time in seconds.
+ */
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+
+/*! \internal
+ * \brief Keeps results the compiler would otherwise drop.
+ */
+static volatile sexp sink;
+
+
+/*! \internal
+ * \brief Get the time of \a what in the baseline, 0 if none.
+ */
+static double baseline_ns(const char* what) {
+    size_t i = 0;
+    for (i = 0; i < baseline.n; ++i) {
+        if (0 == strcmp(baseline.name[i], what)) {
+            return baseline.ns[i];
+        }
+    }
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Print a result, and compare it with the baseline.
+ */
+static void report(const char* what, double ns, double allocs) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-16s %12.2f %10.2f %8ld", what, ns, allocs, usage.ru_maxrss);
+    double base = baseline_ns(what);
+    if (base) {
+        double ratio = ns / base;
+        printf("   %12.2f %6.2fx", base, ratio);
+        if (ratio > BENCH_SLOWER) {
+            printf(" slower");
+            baseline.slower = true;
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+/*! \internal
+ * \brief Run \a batch for BENCH_ROUNDS rounds.
+ *
+ * \param batch Does some ops and returns how many.
+ * \param n The number of ops to ask \a batch for.
+ * \param allocs Receives the allocations per op.
+ * \return The time per op of the fastest round.
+ */
+static double measure(size_t (*batch)(size_t n), size_t n, double* allocs) {
+    struct gc_stats before;
+    struct gc_stats after;
+    size_t total = 0;
+    size_t atoms = 0;
+    double best = 0;
+
+    /* warm up */
+    region_begin();
+    batch(n);
+    region_end(ATOM_NIL());
+
+    gc_stats(&before);
+    int round = 0;
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        size_t ops = 0;
+        double start = now();
+        do {
+            region_begin();
+            ops += batch(n);
+            gc_stats(&after);
+            atoms += after.atoms - before.atoms;
+            region_end(ATOM_NIL());
+        } while (now() - start < BENCH_TIME / BENCH_ROUNDS);
+        double ns = 1e9 * (now() - start) / ops;
+        if (!round || ns < best) {
+            best = ns;
+        }
+        total += ops;
+    }
+    gc_stats(&after);
+    *allocs = (double)(after.conses - before.conses + atoms) / total;
+    return best;
+}
+
+
+/*! \internal
+ * \brief Add a benchmark to the suite.
+ */
+static void add(const char* what, size_t (*batch)(size_t n), size_t n,
+                struct lisp_ctx* c, sexp query) {
+    if (suite.n == suite.cap) {
+        suite.cap = suite.cap ? 2 * suite.cap : 16;
+        suite.v = realloc(suite.v, suite.cap * sizeof *suite.v);
+    }
+    struct bench* b = &suite.v[suite.n++];
+    memset(b, 0, sizeof *b);
+    snprintf(b->what, sizeof b->what, "%s", what);
+    b->batch = batch;
+    b->n = n;
+    b->ctx = c;
+    b->query = query;
+}
+
+
+/*! \internal
+ * \brief The form timed by b_workload().
+ */
+static sexp query;
+
+
+/*! \internal
+ * \brief Run one pass of \a b.
+ */
+static void pass(struct bench* b) {
+    lisp_ctx_enter(b->ctx);
+    query = b->query;
+    b->ns[b->passes++] = measure(b->batch, b->n, &b->allocs);
+    /* a collection may have moved it */
+    b->query = query;
+    query = 0;
+    lisp_ctx_enter(0);
+}
+
+
+/*! \internal
+ * \brief The median time of the passes of \a b.
+ */
+static double median(const struct bench* b) {
+    double v[BENCH_PASSES + BENCH_RETRIES];
+    int n = b->passes;
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        int j = i;
+        for (; j > 0 && v[j - 1] > b->ns[i]; --j) {
+            v[j] = v[j - 1];
+        }
+        v[j] = b->ns[i];
+    }
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+static size_t b_cons(size_t n) {
+    sexp a = symbol("a", 1);
+    sexp l = ATOM_NIL();
+    size_t i = 0;
+    for (i = 0; i < n; ++i) {
+        l = cons(a, l);
+    }
+    sink = l;
+    return n;
+}
+
+
+static size_t b_car(size_t n) {
+    size_t ops = 0;
+    while (ops < n) {
+        sexp p = list;
+        for (; !c_bool(atom(p)); p = cdr(p), ++ops) {
+            sink = car(p);
+        }
+    }
+    return ops;
+}
+
+
+static size_t b_eq(size_t n) {
+    sexp a = symbol("a", 1);
+    size_t ops = 0;
+    while (ops < n) {
+        sexp p = list;
+        for (; !c_bool(atom(p)); p = cdr(p), ++ops) {
+            sink = eq(car(p), a);
+        }
+    }
+    return ops;
+}
+
+
+static size_t b_assoc(size_t n) {
+    size_t ops = 0;
+    while (ops < n) {
+        sexp p = alist;
+        for (; !c_bool(atom(p)); p = cdr(p), ++ops) {
+            sink = assoc(car(car(p)), alist);
+        }
+    }
+    return ops;
+}
+
+
+static size_t b_symbol(size_t n) {
+    size_t i = 0;
+    for (i = 0; i < n; ++i) {
+        sink = symbol(name[i % 64], strlen(name[i % 64]));
+    }
+    return n;
+}
+
+
+static size_t b_symbol_new(size_t n) {
+    size_t i = 0;
+    for (i = 64; i < 64 + n && i < NAMES; ++i) {
+        sink = symbol(name[i], strlen(name[i]));
+    }
+    return i - 64;
+}
+
+
+static size_t b_parse(size_t n) {
+    const char* p = text;
+    (void)n;
+    sink = parse(&p);
+    return strlen(text);
+}
+
+
+static size_t b_print(size_t n) {
+    struct sink s;
+    (void)n;
+    sink_buffer(&s);
+    print_list(&s, tree);
+    size_t len = s.len;
+    sink_close(&s);
+    return len;
+}
+
+
+/*! \internal
+ * \brief A complete tree of the given depth, with varied leaves.
+ */
+static sexp make_tree(int depth, unsigned* leaf) {
+    if (!depth) {
+        const char* s = name[(*leaf)++ % 64];
+        return symbol(s, strlen(s));
+    }
+    sexp l = make_tree(depth - 1, leaf);
+    return cons(l, make_tree(depth - 1, leaf));
+}
+
+
+/*! \internal
+ * \brief Build the data of the micro benchmarks.
+ */
+static void setup() {
+    size_t i = 0;
+    for (i = 0; i < NAMES; ++i) {
+        sprintf(name[i], "n%zu", i);
+    }
+    gc_root(&list);
+    gc_root(&alist);
+    gc_root(&tree);
+    list = ATOM_NIL();
+    alist = ATOM_NIL();
+    for (i = 0; i < 1000; ++i) {
+        list = cons(i % 2 ? symbol("a", 1) : symbol("b", 1), list);
+    }
+    for (i = 0; i < 64; ++i) {
+        sexp key = symbol(name[i], strlen(name[i]));
+        alist = cons(cons(key, symbol("v", 1)), alist);
+    }
+    unsigned leaf = 0;
+    tree = make_tree(16, &leaf);
+    struct sink s;
+    sink_buffer(&s);
+    print_list(&s, tree);
+    sink_write(&s, "", 1);
+    text = s.buf;
+    gc_sexp(ATOM_NIL());
+}
+
+
+static size_t b_workload(size_t n) {
+    (void)n;
+    sink = eval_top(eval, query, ATOM_NIL());
+    return 1;
+}
+
+
+/*! \internal
+ * \brief Add the Lisp file \a path to the suite.
+ *
+ * It keeps a context of its own, with the definitions made by the
+ * forms before the last.
+ *
+ * \return \c false if it cannot be read.
+ */
+static bool workload(const char* path) {
+    struct reader in;
+    if (!reader_map(&in, path)) {
+        return false;
+    }
+    struct lisp_ctx* c = lisp_ctx_new();
+    lisp_ctx_enter(c);
+    gc_root(&query);
+    query = 0;
+    for (;;) {
+        region_begin();
+        sexp e = reader_next(&in);
+        if (!e) {
+            region_end(ATOM_NIL());
+            break;
+        }
+        if (query) {
+            eval_top(eval, query, ATOM_NIL());
+        }
+        query = e;
+        region_end(ATOM_NIL());
+    }
+    reader_close(&in);
+
+    /* name it after the file */
+    char what[64];
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(what, sizeof what, "lisp/%s", base);
+    char* dot = strrchr(what, '.');
+    if (dot) {
+        *dot = 0;
+    }
+    if (query) {
+        add(what, b_workload, 1, c, query);
+    }
+    query = 0;
+    lisp_ctx_enter(0);
+    return true;
+}
+
+
+/*! \internal
+ * \brief Read the results in \a path into the baseline.
+ */
+static bool load_baseline(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char line[256];
+    size_t cap = 0;
+    while (fgets(line, sizeof line, f)) {
+        char what[64];
+        double ns = 0;
+        if (line[0] == '#' || 2 != sscanf(line, "%63s %lf", what, &ns)) {
+            continue;
+        }
+        if (baseline.n == cap) {
+            cap = cap ? 2 * cap : 32;
+            baseline.name = realloc(baseline.name, cap * sizeof *baseline.name);
+            baseline.ns = realloc(baseline.ns, cap * sizeof *baseline.ns);
+        }
+        strcpy(baseline.name[baseline.n], what);
+        baseline.ns[baseline.n++] = ns;
+    }
+    fclose(f);
+    return true;
+}
+
+
+/*!
+ * \brief Run the benchmarks.
+ *
+ * \code
+ * ./bench_run [--compare=FILE] [file.lisp...]
+ * \endcode
+ *
+ * \param argc Argument count.
+ * \param argv Vector of argument strings.
+ * \return Process error code.
+ */
+int main(int argc, char* argv[]) {
+    int i = 0;
+    for (i = 1; i < argc; ++i) {
+        if (0 == strncmp(argv[i], "--compare=", 10)) {
+            if (!load_baseline(argv[i] + 10)) {
+                fprintf(stderr, "%s: cannot read %s\n", argv[0],
+                    argv[i] + 10);
+                return 1;
+            }
+        } else if (0 == strncmp(argv[i], "--", 2)) {
+            fprintf(stderr, "usage: %s [--compare=FILE] [file.lisp...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+
+    printf("# %-14s %12s %10s %8s", "name", "ns/op", "allocs/op", "rss-kB");
+    if (baseline.n) {
+        printf("   %12s %7s", "base-ns/op", "ratio");
+    }
+    printf("\n");
+
+    setup();
+    add("cons", b_cons, 100000, 0, 0);
+    add("car", b_car, 100000, 0, 0);
+    add("eq", b_eq, 100000, 0, 0);
+    add("assoc", b_assoc, 10000, 0, 0);
+    add("symbol", b_symbol, 100000, 0, 0);
+    add("symbol/new", b_symbol_new, NAMES - 64, 0, 0);
+    add("parse", b_parse, 1, 0, 0);
+    add("print", b_print, 1, 0, 0);
+    for (i = 1; i < argc; ++i) {
+        if (0 == strncmp(argv[i], "--", 2)) {
+            continue;
+        }
+        if (!workload(argv[i])) {
+            fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    size_t j = 0;
+    int k = 0;
+    for (k = 0; k < BENCH_PASSES; ++k) {
+        for (j = 0; j < suite.n; ++j) {
+            pass(&suite.v[j]);
+        }
+    }
+    for (k = 0; k < BENCH_RETRIES; ++k) {
+        for (j = 0; j < suite.n; ++j) {
+            double base = baseline_ns(suite.v[j].what);
+            if (base && median(&suite.v[j]) > BENCH_SLOWER * base) {
+                pass(&suite.v[j]);
+            }
+        }
+    }
+    for (j = 0; j < suite.n; ++j) {
+        report(suite.v[j].what, median(&suite.v[j]), suite.v[j].allocs);
+    }
+    return baseline.slower ? 1 : 0;
+}
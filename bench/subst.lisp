@@ -0,0 +1,8 @@
+(define grow (lambda (l)
+  (cond ((atom l) 'a)
+        ('t (cons (grow (cdr l)) (grow (cdr l)))))))
+(define subst (lambda (x y z)
+  (cond ((atom z) (cond ((eq z y) x) ('t z)))
+        ('t (cons (subst x y (car z)) (subst x y (cdr z)))))))
+(define tree (grow '(1 2 3 4 5 6 7 8 9 10 11 12 13 14)))
+(subst 'm 'a tree)
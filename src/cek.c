@@ -0,0 +1,302 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file cek.c
+ *
+ * \brief Lisp interpreter with an explicit stack.
+ *
+ * eval() recurses in C to evaluate the arguments of a call, the
+ * operands of the built-in functions and the tests of a cond, so
+ * the depth of non-tail recursion in lisp is limited by the C
+ * stack. This interpreter implements the same language as a
+ * machine in the style of Felleisen's CEK machine: the Control is
+ * the expression being evaluated, the Environment is the bindings
+ * in env.c, and the Kontinuation, what to do with the value, is
+ * kept in a stack on the heap. Recursion is only limited by memory.
+ *
+ * The two interpreters agree on every expression, including where
+ * TRoL leaves the result undefined, and calls in tail position take
+ * no space in either. See eval_tail().
+ */
+
+#include "cek.h"
+
+#include "closure.h"
+#include "cons_impl.h"
+#include "constants.h"
+#include "env.h"
+#include "resolve.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief What to do with a value.
+ */
+enum kind {
+    K_ATOM,     /*!< return atom(value) */
+    K_CAR,      /*!< return car(value) */
+    K_CDR,      /*!< return cdr(value) */
+    K_EQ,       /*!< evaluate the second operand of eq */
+    K_EQ2,      /*!< return eq(first, value) */
+    K_CONS,     /*!< evaluate the second operand of cons */
+    K_CONS2,    /*!< return cons(first, value) */
+    K_COND,     /*!< take this clause or try the next one */
+    K_ARG       /*!< push an argument, evaluate the next or call */
+};
+
+
+/*! \internal
+ * \brief A continuation.
+ */
+struct kont {
+    enum kind kind;
+    /*! The operand, the remaining clauses or remaining arguments. */
+    sexp expr;
+    /*! The first operand's value, or the lambda being called. */
+    sexp value;
+    /*! The first argument slot of a call. */
+    size_t top;
+    /*! The activation to return to. */
+    struct activation act;
+};
+
+
+/*! \internal
+ * \brief The continuation stack.
+ *
+ * Each thread has its own, so forms can be run on several at once.
+ */
+static _Thread_local struct {
+    struct kont* k;
+    size_t sp;
+    size_t cap;
+} ks;
+
+
+/*! \internal
+ * \brief Push a continuation and start a new activation in \a act.
+ *
+ * The expression evaluated next is not in tail position, whatever
+ * it binds is undone before the continuation gets its value.
+ */
+static void push(enum kind kind, sexp expr, sexp value, size_t top,
+                 struct activation* act) {
+    if (ks.sp == ks.cap) {
+        ks.cap = ks.cap ? 2 * ks.cap : 256;
+        ks.k = realloc(ks.k, ks.cap * sizeof *ks.k);
+    }
+    struct kont* k = &ks.k[ks.sp++];
+    k->kind = kind;
+    k->expr = expr;
+    k->value = value;
+    k->top = top;
+    k->act = *act;
+    act_begin(act);
+    STAT_ADD(STAT_EVALS, 1);
+    STAT_REACH(ks.sp);
+}
+
+
+/*! \internal
+ * \brief Call \a lambda with the arguments pushed since \a top.
+ *
+ * \return Null, with the body in \a expr. \c 'nil if \a lambda is
+ * malformed.
+ */
+static sexp enter(struct activation* act, size_t top, sexp lambda,
+                  sexp* expr) {
+    const struct closure* f = closure_of(lambda);
+    if (!f) {
+        act_enter(act, top, 0, 0);
+        return ATOM_NIL();
+    }
+    act_enter(act, top, f->params, f->arity);
+    *expr = f->body;
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Run the machine until \a expr has a value.
+ */
+static sexp run(sexp expr) {
+    size_t bottom = ks.sp;
+    struct activation act;
+    act_begin(&act);
+    /* the value returned to the continuation, null while evaluating */
+    sexp v = 0;
+    for (;;) {
+        if (!v) {
+            if (SEXP_TYPE(expr) == REF) {
+                STAT_ADD(STAT_FORMS + OP_NONE, 1);
+                v = frame_ref(expr);
+                continue;
+            }
+            if (c_bool(atom(expr))) {
+                STAT_ADD(STAT_FORMS + OP_NONE, 1);
+                v = lookup(expr);
+                continue;
+            }
+            sexp fn = lookup_fn(car(expr));
+            sexp args = cdr(expr);
+            if (!fn) {
+                v = ATOM_NIL();
+                continue;
+            }
+            if (c_bool(atom(fn))) {
+                STAT_ADD(STAT_FORMS + atom_opcode(fn), 1);
+                switch (atom_opcode(fn)) {
+                case OP_QUOTE:
+                    v = car(args);
+                    break;
+                case OP_ATOM:
+                    push(K_ATOM, 0, 0, 0, &act);
+                    expr = car(args);
+                    break;
+                case OP_EQ:
+                    push(K_EQ, car(cdr(args)), 0, 0, &act);
+                    expr = car(args);
+                    break;
+                case OP_CAR:
+                    push(K_CAR, 0, 0, 0, &act);
+                    expr = car(args);
+                    break;
+                case OP_CDR:
+                    push(K_CDR, 0, 0, 0, &act);
+                    expr = car(args);
+                    break;
+                case OP_CONS:
+                    push(K_CONS, car(cdr(args)), 0, 0, &act);
+                    expr = car(args);
+                    break;
+                case OP_COND:
+                    if (c_bool(null(args))) {
+                        v = ATOM_NIL();
+                        break;
+                    }
+                    push(K_COND, args, 0, 0, &act);
+                    expr = car(car(args));
+                    break;
+                default:
+                    v = ATOM_NIL();
+                    break;
+                }
+                continue;
+            }
+            switch (atom_opcode(car(fn))) {
+            case OP_LABEL:
+                STAT_ADD(STAT_FORMS + OP_LABEL, 1);
+                /* see eval_tail() */
+                rebind(act.mark, car(cdr(fn)), car(cdr(cdr(fn))));
+                act_enter(&act, frame_mark(), 0, 0);
+                expr = cons(car(cdr(cdr(fn))), args);
+                break;
+            case OP_LAMBDA:
+                STAT_ADD(STAT_FORMS + OP_LAMBDA, 1);
+                if (c_bool(atom(args))) {
+                    v = enter(&act, frame_mark(), fn, &expr);
+                    break;
+                }
+                push(K_ARG, cdr(args), fn, frame_mark(), &act);
+                expr = car(args);
+                break;
+            default:
+                v = ATOM_NIL();
+                break;
+            }
+            continue;
+        }
+
+        /* return v to the innermost continuation */
+        act_end(&act);
+        if (ks.sp == bottom) {
+            return v;
+        }
+        struct kont k = ks.k[--ks.sp];
+        act = k.act;
+        sexp r = v;
+        v = 0;
+        switch (k.kind) {
+        case K_ATOM:
+            v = atom(r);
+            break;
+        case K_CAR:
+            v = car(r);
+            break;
+        case K_CDR:
+            v = cdr(r);
+            break;
+        case K_EQ:
+            push(K_EQ2, 0, r, 0, &act);
+            expr = k.expr;
+            break;
+        case K_EQ2:
+            v = eq(k.value, r);
+            break;
+        case K_CONS:
+            push(K_CONS2, 0, r, 0, &act);
+            expr = k.expr;
+            break;
+        case K_CONS2:
+            v = cons(k.value, r);
+            break;
+        case K_COND:
+            if (c_bool(eq(ATOM_T(), r))) {
+                /* the branch is in tail position */
+                expr = car(cdr(car(k.expr)));
+            } else if (c_bool(null(cdr(k.expr)))) {
+                v = ATOM_NIL();
+            } else {
+                push(K_COND, cdr(k.expr), 0, 0, &act);
+                expr = car(car(cdr(k.expr)));
+            }
+            break;
+        case K_ARG:
+            frame_arg(r);
+            if (c_bool(atom(k.expr))) {
+                v = enter(&act, k.top, k.value, &expr);
+            } else {
+                push(K_ARG, cdr(k.expr), k.value, k.top, &act);
+                expr = car(k.expr);
+            }
+            break;
+        }
+    }
+}
+
+
+/*! \brief Interpret a lisp expression without using the C stack.
+ *
+ * Same as eval(), but the depth of recursion in \a expr is only
+ * limited by memory.
+ *
+ * \param expr Lisp expression.
+ * \param env Dictionary of variables in scope.
+ * \return Result of evaluation.
+ */
+sexp eval_cek(sexp expr, sexp env) {
+    size_t mark = bind_mark();
+    bind_alist(env);
+    struct frame prev = frame_enter(frame_mark(), 0, 0, mark);
+    sexp r = run(resolve(expr));
+    unbind(mark);
+    frame_leave(prev);
+    return r;
+}
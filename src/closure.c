@@ -0,0 +1,320 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file closure.c
+ *
+ * \brief Analysed lambdas.
+ *
+ * To call a lambda its parameters and body have to be found in the
+ * (lambda params body) list, and the parameters counted and bound
+ * one by one. This module does that once per lambda, the first time
+ * it is called, and keeps the result in a table keyed by the
+ * lambda's cons cell. It also resolves the body, so a lambda that
+ * was built or quoted, rather than written as the head of a call,
+ * fetches its parameters from the frame too.
+ *
+ * The analysis also finds out whether a call of the lambda can
+ * depend on anything but its arguments, see struct closure.
+ *
+ * Cells are immutable, so an entry stays valid as long as its cell
+ * does. Each thread has a table of its own, which it empties once a
+ * collection has happened, since cells move, when it switches to
+ * another context, and when it gets large.
+ */
+
+#include "closure.h"
+
+#include "cons_impl.h"
+#include "constants.h"
+#include "resolve.h"
+
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief Number of entries at which the table is emptied.
+ */
+#define CLOSURE_MAX 4096
+
+
+/*! \internal
+ * \brief Open addressing hash table keyed by lambda.
+ *
+ * epoch is the gc_count() the entries were made in, and ctx the
+ * context they were made in.
+ */
+static _Thread_local struct {
+    struct closure** slot;
+    size_t n;
+    size_t cap;
+    unsigned long epoch;
+    struct lisp_ctx* ctx;
+} closures;
+
+
+/*! \internal
+ * \brief Home slot of \a lambda.
+ */
+static size_t closure_hash(sexp lambda) {
+    return ((uintptr_t)lambda >> 4) & (closures.cap - 1);
+}
+
+
+/*! \internal
+ * \brief Forget every entry.
+ */
+static void closure_clear() {
+    size_t i = 0;
+    for (i = 0; i < closures.cap; ++i) {
+        free(closures.slot[i]);
+        closures.slot[i] = 0;
+    }
+    closures.n = 0;
+}
+
+
+/*! \internal
+ * \brief Make room for another entry.
+ */
+static void closure_reserve() {
+    if (2 * (closures.n + 1) <= closures.cap) {
+        return;
+    }
+    if (closures.n >= CLOSURE_MAX) {
+        closure_clear();
+        return;
+    }
+    struct closure** old = closures.slot;
+    size_t cap = closures.cap;
+    closures.cap = cap ? 2 * cap : 64;
+    closures.slot = calloc(closures.cap, sizeof *closures.slot);
+    size_t i = 0;
+    for (i = 0; i < cap; ++i) {
+        if (old[i]) {
+            size_t j = closure_hash(old[i]->lambda);
+            while (closures.slot[j]) {
+                j = (j + 1) & (closures.cap - 1);
+            }
+            closures.slot[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/*! \internal
+ * \brief Names bound around an expression, innermost last.
+ */
+struct scope {
+    struct {
+        sexp name;
+        /*! A lambda parameter rather than a label name. */
+        bool param;
+    }* v;
+    size_t n;
+    size_t cap;
+};
+
+
+/*! \internal
+ * \brief Bind \a name in \a s.
+ */
+static void scope_push(struct scope* s, sexp name, bool param) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 16;
+        s->v = realloc(s->v, s->cap * sizeof *s->v);
+    }
+    s->v[s->n].name = REF_STRIP(name);
+    s->v[s->n].param = param;
+    ++s->n;
+}
+
+
+/*! \internal
+ * \brief Find the innermost binding of \a name in \a s.
+ *
+ * \return Its index plus one, 0 if \a name is not bound.
+ */
+static size_t scope_find(const struct scope* s, sexp name) {
+    size_t i = s->n;
+    name = REF_STRIP(name);
+    for (; i > 0; --i) {
+        if (s->v[i - 1].name == name) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Note a reference to \a name, which is not bound in the
+ * body. Only one such name is allowed.
+ */
+static bool pure_free(sexp name, sexp* self) {
+    name = REF_STRIP(name);
+    if (!*self) {
+        *self = name;
+    }
+    return *self == name;
+}
+
+
+static bool pure_expr(sexp expr, struct scope* s, sexp* self) ;
+
+
+/*! \internal
+ * \brief pure_expr() of every element of \a list.
+ */
+static bool pure_list(sexp list, struct scope* s, sexp* self) {
+    for (; !c_bool(atom(list)); list = cdr(list)) {
+        if (!pure_expr(car(list), s, self)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*! \internal
+ * \brief pure_expr() of the body of \a lambda, with its parameters
+ * bound.
+ */
+static bool pure_lambda(sexp lambda, struct scope* s, sexp* self) {
+    size_t n = s->n;
+    sexp p = car(cdr(lambda));
+    for (; !c_bool(atom(p)); p = cdr(p)) {
+        scope_push(s, car(p), true);
+    }
+    bool r = pure_expr(car(cdr(cdr(lambda))), s, self);
+    s->n = n;
+    return r;
+}
+
+
+/*! \internal
+ * \brief Test for a well formed (lambda params body) expression.
+ */
+static bool is_lambda(sexp expr) {
+    return !c_bool(atom(expr)) && atom_opcode(car(expr)) == OP_LAMBDA
+        && !c_bool(atom(cdr(expr))) && !c_bool(atom(cdr(cdr(expr))));
+}
+
+
+/*! \internal
+ * \brief Test whether \a expr only refers to names bound in \a s,
+ * and to at most one other, *\a self.
+ *
+ * A call of a variable that holds a parameter is not pure, since
+ * the function it gets may refer to anything.
+ */
+static bool pure_expr(sexp expr, struct scope* s, sexp* self) {
+    if (c_bool(atom(expr))) {
+        return scope_find(s, expr) || pure_free(expr, self);
+    }
+    sexp head = car(expr);
+    sexp args = cdr(expr);
+    if (c_bool(atom(head))) {
+        switch (atom_opcode(head)) {
+        case OP_QUOTE:
+            return true;
+        case OP_ATOM:
+        case OP_EQ:
+        case OP_CAR:
+        case OP_CDR:
+        case OP_CONS:
+            return pure_list(args, s, self);
+        case OP_COND:
+            for (; !c_bool(atom(args)); args = cdr(args)) {
+                if (!pure_list(car(args), s, self)) {
+                    return false;
+                }
+            }
+            return true;
+        default: {
+            size_t i = scope_find(s, head);
+            if (i ? s->v[i - 1].param : !pure_free(head, self)) {
+                return false;
+            }
+            return pure_list(args, s, self);
+        }
+        }
+    }
+    if (is_lambda(head)) {
+        return pure_lambda(head, s, self) && pure_list(args, s, self);
+    }
+    if (atom_opcode(car(head)) == OP_LABEL
+            && !c_bool(atom(cdr(head))) && !c_bool(atom(cdr(cdr(head))))
+            && is_lambda(car(cdr(cdr(head))))) {
+        size_t n = s->n;
+        scope_push(s, car(cdr(head)), false);
+        bool r = pure_lambda(car(cdr(cdr(head))), s, self)
+            && pure_list(args, s, self);
+        s->n = n;
+        return r;
+    }
+    /* a malformed lambda or label, or a call eval() makes nil of */
+    return atom_opcode(car(head)) != OP_LABEL && pure_list(args, s, self);
+}
+
+
+/*! \brief Get the analysis of a lambda.
+ *
+ * \param lambda Arbitrary lisp, normally a lambda expression.
+ * \return The closure of \a lambda, valid until the next call.
+ * Null if \a lambda is not a (lambda params body) list.
+ */
+const struct closure* closure_of(sexp lambda) {
+    if (closures.epoch != gc_count()
+            || closures.ctx != lisp_ctx_current()) {
+        closure_clear();
+        closures.epoch = gc_count();
+        closures.ctx = lisp_ctx_current();
+    }
+    closure_reserve();
+    size_t j = closure_hash(lambda);
+    while (closures.slot[j]) {
+        if (closures.slot[j]->lambda == lambda) {
+            return closures.slot[j];
+        }
+        j = (j + 1) & (closures.cap - 1);
+    }
+
+    if (!is_lambda(lambda)) {
+        return 0;
+    }
+    sexp params = car(cdr(lambda));
+    unsigned arity = 0;
+    sexp p = params;
+    for (; !c_bool(atom(p)); p = cdr(p)) {
+        ++arity;
+    }
+    struct closure* c = malloc(sizeof *c + arity * sizeof(sexp));
+    c->lambda = lambda;
+    c->body = resolve_body(params, car(cdr(cdr(lambda))));
+    c->arity = arity;
+    for (arity = 0, p = params; !c_bool(atom(p)); p = cdr(p)) {
+        c->params[arity++] = car(p);
+    }
+    struct scope s = { 0, 0, 0 };
+    c->self = 0;
+    c->pure = pure_lambda(lambda, &s, &c->self);
+    free(s.v);
+    closures.slot[j] = c;
+    ++closures.n;
+    return c;
+}
@@ -0,0 +1,55 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+/*! \file closure.h
+ */
+
+#include "cons.h"
+
+/*! \brief A lambda, analysed for calling.
+ *
+ * See closure_of().
+ */
+struct closure {
+    /*! The (lambda params body) expression. */
+    sexp lambda;
+    /*! The body, passed through resolve_body(). */
+    sexp body;
+    /*! Whether the result depends only on the arguments.
+     *
+     * True if every variable the body refers to is a parameter, or
+     * is bound inside the body, or is #self. See memo.c.
+     */
+    bool pure;
+    /*! The one variable the body refers to that it does not bind.
+     *
+     * Normally the name of the label the lambda is bound to. Null
+     * if there is none.
+     */
+    sexp self;
+    /*! The number of parameters. */
+    unsigned arity;
+    /*! The parameters. */
+    sexp params[];
+};
+
+const struct closure* closure_of(sexp lambda) ;
+
+#endif
@@ -31,14 +31,18 @@
  * can be used to tell them apart. Sexp's are immutable.
  *
  * \note This typedef is a facade, if you need access to the
- * underlying structure, include cons_impl.h.
+ * underlying structure, include cons_impl.h. struct sexp_impl is
+ * never defined; a sexp is a tagged word.
  */
 typedef const struct sexp_impl* sexp;
 
 
 sexp symbol(const char* str, int strlen);
 sexp cons(sexp car, sexp cdr);
-void gc_sexp(sexp expr);
+sexp gc_sexp(sexp expr);
+void gc_root(sexp* ref);
+void region_begin();
+sexp region_end(sexp keep);
 sexp car(sexp cons);
 sexp cdr(sexp cons);
 sexp atom(sexp expr);
@@ -26,15 +26,28 @@
  * do not evaluate their arguments. (atom (quote a)) is not the same
  * as atom(cons(ATOM_QUOTE(), cons(symbol("a", 1), ATOM_NIL()))).
  * Instead, it is (atom '(quote a)).
+ *
+ * The heap and the intern table belong to a context, see
+ * lisp_ctx_new(). Every thread works in the context it last
+ * entered, so the functions here take no context argument.
  */
 
 #include "cons_impl.h"
 
 #include "constants.h"
+#include "stats.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 
 /*! \internal
@@ -54,7 +67,7 @@
  * \return \c true if \a expr is \c 't, \c false otherwise.
  */
 bool c_bool(sexp expr) {
-    return expr && (expr->t == ATOM) && !strcmp((char*)(expr->v), "t");
+    return REF_STRIP(expr) == ATOM_T();
 }
 
 
@@ -66,7 +79,8 @@ bool c_bool(sexp expr) {
  * \return '\\0' terminated C string.
  */
 const char* c_str(sexp atom) {
-    return atom->t == ATOM ? (char*)(atom->v) : 0;
+    atom = REF_STRIP(atom);
+    return SEXP_TYPE(atom) == ATOM ? ATOM_OF(atom)->name : 0;
 }
 
 
@@ -76,7 +90,7 @@ const char* c_str(sexp atom) {
  * \return \c 't if \a expr is an atom, \c 'nil otherwise.
  */
 sexp atom(sexp expr) {
-    return (expr && expr->t == ATOM) ? ATOM_T() : ATOM_NIL();
+    return (expr && SEXP_TYPE(expr) != CONS) ? ATOM_T() : ATOM_NIL();
 }
 
 
@@ -88,15 +102,11 @@ sexp atom(sexp expr) {
  * \c 'nil otherwise.
  */
 sexp eq(sexp expr_a, sexp expr_b) {
-    if(c_bool(atom(expr_a)) && c_bool(atom(expr_b))){
-        if(expr_a == expr_b) {        /* optimisation heuristic */
-            return ATOM_T();
-        }
-        if(!strcmp(c_str(expr_a), c_str(expr_b))) {
-            return ATOM_T();
-        }
-    }
-    return ATOM_NIL();
+    /* atoms are interned, see symbol() */
+    expr_a = REF_STRIP(expr_a);
+    expr_b = REF_STRIP(expr_b);
+    return (expr_a == expr_b && c_bool(atom(expr_a)))
+        ? ATOM_T() : ATOM_NIL();
 }
 
 
@@ -111,7 +121,7 @@ sexp eq(sexp expr_a, sexp expr_b) {
  * \return The first part of the pair.
  */
 sexp car(sexp cons) {
-    return ((struct cons_impl*)(cons->v))->l;
+    return CONS_OF(cons)->l;
 }
 
 
@@ -125,7 +135,377 @@ sexp car(sexp cons) {
  * \return The second part of the pair, often the tail of a list.
  */
 sexp cdr(sexp cons) {
-    return ((struct cons_impl*)(cons->v))->r;
+    return CONS_OF(cons)->r;
+}
+
+
+/*! \internal
+ * \brief Size of a string pool chunk in bytes.
+ */
+#define POOL_CHUNK 65536
+
+
+/*! \internal
+ * \brief A block of the string pool.
+ *
+ * Atoms are bump allocated out of the current chunk. Names too long
+ * for a regular chunk get a chunk of their own. The chunks form a
+ * stack so that a region can be released by popping it.
+ */
+struct pool_chunk {
+    struct pool_chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+
+/*! \internal
+ * \brief The intern table.
+ *
+ * Open addressing with linear probing. The capacity is a power of
+ * two and the table is kept at most half full.
+ */
+struct intern {
+    struct atom_impl** slot;
+    size_t mask;
+    size_t count;
+    struct pool_chunk* pool;
+};
+
+
+/*! \internal
+ * \brief Where a surviving region atom is referenced from.
+ */
+struct fixup {
+    sexp* slot;
+    size_t index;
+};
+
+
+/*! \internal
+ * \brief The current region, see region_begin().
+ */
+struct region {
+    bool active;
+    /*! Pool position at region_begin(). */
+    struct pool_chunk* chunk;
+    size_t used;
+    /*! Atoms interned in the region, oldest first. */
+    struct atom_impl** log;
+    size_t logged;
+    size_t log_cap;
+    /*! Region atoms reachable at region_end(). */
+    struct atom_impl** kept;
+    size_t kepts;
+    size_t kept_cap;
+    struct fixup* fixup;
+    size_t fixups;
+    size_t fixup_cap;
+};
+
+
+/*! \internal
+ * \brief Size and alignment of a heap chunk in bytes.
+ *
+ * Chunks are aligned to their size so the chunk holding a cell can
+ * be found by masking the cell's address.
+ */
+#define CHUNK_SIZE (256*1024)
+
+
+/*! \internal
+ * \brief Threshold in bytes below which the old space is never
+ * collected.
+ */
+#define MAJOR_MIN (4*1024*1024)
+
+
+/*! \internal
+ * \brief Find the chunk holding the cell at \a p.
+ */
+#define CHUNK_OF(p) \
+    ((struct chunk*)((uintptr_t)(p) & ~(uintptr_t)(CHUNK_SIZE-1)))
+
+
+/*! \internal
+ * \brief Tag of a moved cell.
+ *
+ * While the collector runs, a cell that has been copied has its car
+ * replaced by the address of the copy plus FORWARD.
+ */
+#define FORWARD ((uintptr_t)3)
+
+
+/*! \internal
+ * \brief A block of heap cells.
+ *
+ * Cells are bump allocated from \c top up to the end of the chunk.
+ */
+struct chunk {
+    struct chunk* next;
+    char* top;
+    /*! \c true for nursery chunks. */
+    bool young;
+};
+
+
+/*! \internal
+ * \brief A list of chunks making up one generation.
+ */
+struct space {
+    struct chunk* chunks;
+    size_t bytes;
+};
+
+
+/*! \internal
+ * \brief The heap.
+ *
+ * New cells are allocated in the nursery. Collection copies the live
+ * nursery cells into the old space. Because cells are immutable, an
+ * old cell can never point at a younger one, so the nursery can be
+ * collected by tracing from the roots alone.
+ */
+struct heap {
+    struct space nursery;
+    struct space old;
+    /*! Old space size that triggers a full collection. */
+    size_t major_at;
+    /*! Registered roots, see gc_root(). */
+    sexp** root;
+    size_t roots;
+    size_t root_cap;
+    /*! Called before each collection, see gc_hook(). */
+    void (**hook)(void);
+    size_t hooks;
+    /*! Nurseries of other threads, see gc_thread(). */
+    struct space** nurseries;
+    size_t threads;
+    /*! Work list of slots still to be copied. */
+    sexp** stack;
+    size_t sp;
+    size_t stack_cap;
+    struct gc_stats stats;
+};
+
+
+/*! \internal
+ * \brief The hash-cons table, see hash_cons().
+ *
+ * Open addressing with linear probing, like the intern table, and
+ * likewise at most half full. A cell is hashed by the addresses of
+ * its car and cdr. The table is weak: the collector drops the cells
+ * that die and moves the rest, which changes their hashes, so the
+ * table is marked stale and rehashed by the next cons().
+ */
+struct pairs {
+    bool on;
+    bool stale;
+    struct cons_impl** slot;
+    size_t mask;
+    size_t count;
+};
+
+
+/*! \brief An interpreter.
+ *
+ * Everything a lisp_ctx_new() context owns: its atoms, its cells,
+ * its tables, and the state of the layers above, see
+ * lisp_ctx_data(). Contexts share nothing but the symbolic
+ * constants, which are the same in all of them.
+ */
+struct lisp_ctx {
+    struct intern atoms;
+    struct region region;
+    struct heap heap;
+    struct pairs pairs;
+    void* data[CTX_DATA];
+    /*! Called by lisp_ctx_free(), see lisp_ctx_hook(). */
+    void (**hook)(void);
+    size_t hooks;
+};
+
+
+/*! \internal
+ * \brief The context of threads that never call lisp_ctx_enter().
+ */
+static struct lisp_ctx root = { { 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { { 0, 0 }, { 0, 0 }, MAJOR_MIN, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      { 0, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { 0, 0, 0, 0, 0 }, { 0 }, 0, 0 };
+
+
+/*! \internal
+ * \brief The context of the calling thread.
+ */
+static _Thread_local struct lisp_ctx* ctx = &root;
+
+
+/*! \internal
+ * \brief The nursery of the calling thread.
+ */
+static _Thread_local struct space* nursery = &root.heap.nursery;
+
+
+/*! \internal
+ * \brief FNV-1a hash of \a len characters of \a str.
+ */
+static unsigned hash_str(const char* str, int len) {
+    unsigned h = 2166136261u;
+    int i = 0;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)(str[i])) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+
+/*! \internal
+ * \brief Allocate \a size bytes from the string pool.
+ */
+static void* pool_alloc(size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    struct pool_chunk* c = ctx->atoms.pool;
+    if (!c || c->size - c->used < size) {
+        size_t n = size > POOL_CHUNK ? size : POOL_CHUNK;
+        c = malloc(sizeof *c + n);
+        c->used = 0;
+        c->size = n;
+        c->next = ctx->atoms.pool;
+        ctx->atoms.pool = c;
+    }
+    void* r = c->data + c->used;
+    c->used += size;
+    return r;
+}
+
+
+/*! \internal
+ * \brief Find the slot for \a len characters of \a str.
+ *
+ * \return The slot holding the matching atom, or the empty slot
+ * where it belongs.
+ */
+static struct atom_impl** intern_slot(const char* str, int len,
+        unsigned hash) {
+    size_t i = hash & ctx->atoms.mask;
+    while (ctx->atoms.slot[i]) {
+        const struct atom_impl* a = ctx->atoms.slot[i];
+        if (a->hash == hash && a->len == (unsigned)len
+                && !memcmp(a->name, str, len)) {
+            break;
+        }
+        i = (i + 1) & ctx->atoms.mask;
+    }
+    return &ctx->atoms.slot[i];
+}
+
+
+/*! \internal
+ * \brief Enter \a a into the intern table.
+ *
+ * The caller guarantees \a a is not already present.
+ */
+static void intern_insert(struct atom_impl* a) {
+    if (2 * (ctx->atoms.count + 1) > ctx->atoms.mask + 1) {
+        struct atom_impl** old = ctx->atoms.slot;
+        size_t n = ctx->atoms.mask + 1;
+        size_t i = 0;
+        ctx->atoms.mask = 2 * n - 1;
+        ctx->atoms.slot = calloc(2 * n, sizeof *ctx->atoms.slot);
+        for (i = 0; i < n; ++i) {
+            if (old[i]) {
+                *intern_slot(old[i]->name, old[i]->len, old[i]->hash)
+                    = old[i];
+            }
+        }
+        free(old);
+    }
+    if (!a->hash) {
+        a->hash = hash_str(a->name, a->len);
+    }
+    *intern_slot(a->name, a->len, a->hash) = a;
+    if (a->id != ctx->atoms.count) {
+        a->id = ctx->atoms.count;
+    }
+    ++ctx->atoms.count;
+}
+
+
+/*! \internal
+ * \brief Take \a a out of the intern table.
+ *
+ * Later entries of the probe sequence are shifted back over the gap
+ * so that lookups never stop short. Only the most recently interned
+ * atom may be removed, so that atom ids stay dense.
+ */
+static void intern_remove(struct atom_impl* a) {
+    size_t i = a->hash & ctx->atoms.mask;
+    while (ctx->atoms.slot[i] != a) {
+        i = (i + 1) & ctx->atoms.mask;
+    }
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & ctx->atoms.mask;
+        if (!ctx->atoms.slot[j]) {
+            break;
+        }
+        size_t k = ctx->atoms.slot[j]->hash & ctx->atoms.mask;
+        /* move the entry unless its home lies cyclically in (i,j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            ctx->atoms.slot[i] = ctx->atoms.slot[j];
+            i = j;
+        }
+    }
+    ctx->atoms.slot[i] = 0;
+    --ctx->atoms.count;
+}
+
+
+/*! \internal
+ * \brief The symbolic constants, in the order they are interned.
+ */
+static sexp (*const constants[])() = {
+    ATOM_T, ATOM_NIL, ATOM_QUOTE, ATOM_DOT, ATOM_ATOM, ATOM_EQ,
+    ATOM_CAR, ATOM_CDR, ATOM_CONS, ATOM_COND, ATOM_LAMBDA, ATOM_LABEL,
+    ATOM_DEFINE, ATOM_TIME
+};
+
+
+/*! \internal
+ * \brief Give the symbolic constants their hashes and ids.
+ *
+ * The constants are shared by every context and interned first in
+ * each, so they get the same ids everywhere. Setting them once up
+ * front means intern_insert() never writes to them after.
+ */
+static void constants_init() {
+    size_t i = 0;
+    for (i = 0; i < sizeof constants / sizeof *constants; ++i) {
+        struct atom_impl* a = ATOM_OF(constants[i]());
+        a->hash = hash_str(a->name, a->len);
+        a->id = i;
+    }
+}
+
+
+/*! \internal
+ * \brief Create the intern table.
+ *
+ * The symbolic constants are entered first so that symbol() returns
+ * them rather than creating duplicates.
+ */
+static void intern_init() {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, constants_init);
+    ctx->atoms.mask = 63;
+    ctx->atoms.slot = calloc(ctx->atoms.mask + 1, sizeof *ctx->atoms.slot);
+    size_t i = 0;
+    for (i = 0; i < sizeof constants / sizeof *constants; ++i) {
+        intern_insert(ATOM_OF(constants[i]()));
+    }
 }
 
 
@@ -138,6 +518,11 @@ sexp cdr(sexp cons) {
  * character buffers. Admittedly, it is a bit annoying when
  * you have a null terminated \a str.
  *
+ * Atoms are interned: every call with the same string returns the
+ * same atom, and the symbolic constants in constants.c are the
+ * canonical atoms for their strings. This makes eq() a pointer
+ * comparison.
+ *
  * \param str A character string buffer.
  * \param len Length of \a str in characters.
  * \return The atom representing \a str.
@@ -146,16 +531,266 @@ sexp cdr(sexp cons) {
  * but I was already using it for the predicate.
  */
 sexp symbol(const char* str, int len) {
-    struct sexp_impl* r = malloc(sizeof *r);
-    CONST_CAST(int, r->t) = ATOM;
-    char* sym = malloc(len+1);
-    strncpy(sym, str, len);
+    if (!ctx->atoms.slot) {
+        intern_init();
+    }
+    unsigned hash = hash_str(str, len);
+    struct atom_impl** slot = intern_slot(str, len, hash);
+    if (*slot) {
+        return ATOM_SEXP(*slot);
+    }
+    struct atom_impl* r = pool_alloc(sizeof *r + len + 1);
+    char* sym = (char*)(r + 1);
+    memcpy(sym, str, len);
     sym[len] = 0;
-    CONST_CAST(char*, r->v) = sym;
+    CONST_CAST(char*, r->name) = sym;
+    CONST_CAST(unsigned, r->len) = len;
+    CONST_CAST(unsigned, r->op) = OP_NONE;
+    r->hash = hash;
+    r->region = 0;
+    intern_insert(r);
+    STAT_ADD(STAT_SYMBOLS, 1);
+    STAT_ADD(STAT_SYMBOL_BYTES, sizeof *r + len + 1);
+    if (ctx->region.active) {
+        if (ctx->region.logged == ctx->region.log_cap) {
+            ctx->region.log_cap = ctx->region.log_cap ? 2 * ctx->region.log_cap : 256;
+            ctx->region.log = realloc(ctx->region.log,
+                ctx->region.log_cap * sizeof *ctx->region.log);
+        }
+        ctx->region.log[ctx->region.logged++] = r;
+        r->region = 1;
+    }
+    return ATOM_SEXP(r);
+}
+
+
+/*! \internal
+ * \brief Allocate a cell in space \a s.
+ */
+static struct cons_impl* space_alloc(struct space* s, bool young) {
+    struct chunk* c = s->chunks;
+    if (!c || (char*)c + CHUNK_SIZE - c->top
+            < (long)sizeof(struct cons_impl)) {
+        c = aligned_alloc(CHUNK_SIZE, CHUNK_SIZE);
+        c->next = s->chunks;
+        c->top = (char*)c + ((sizeof *c + sizeof(struct cons_impl) - 1)
+            / sizeof(struct cons_impl)) * sizeof(struct cons_impl);
+        c->young = young;
+        s->chunks = c;
+    }
+    struct cons_impl* r = (struct cons_impl*)(c->top);
+    c->top += sizeof *r;
+    s->bytes += sizeof *r;
     return r;
 }
 
 
+/*! \internal
+ * \brief Push \a ref onto the collector's work list.
+ */
+static void gc_push(sexp* ref) {
+    if (ctx->heap.sp == ctx->heap.stack_cap) {
+        ctx->heap.stack_cap = ctx->heap.stack_cap ? 2 * ctx->heap.stack_cap : 1024;
+        ctx->heap.stack = realloc(ctx->heap.stack,
+            ctx->heap.stack_cap * sizeof *ctx->heap.stack);
+    }
+    ctx->heap.stack[ctx->heap.sp++] = ref;
+}
+
+
+/*! \internal
+ * \brief Note that the region atom in \a slot is still in use.
+ *
+ * The atom's \c region field is reused to number the survivors: 1
+ * means not seen yet, n > 1 means survivor n - 2.
+ */
+static void region_keep(sexp* slot) {
+    struct atom_impl* a = ATOM_OF(*slot);
+    if (a->region == 1) {
+        if (ctx->region.kepts == ctx->region.kept_cap) {
+            ctx->region.kept_cap = ctx->region.kept_cap ? 2 * ctx->region.kept_cap : 64;
+            ctx->region.kept = realloc(ctx->region.kept,
+                ctx->region.kept_cap * sizeof *ctx->region.kept);
+        }
+        a->region = ctx->region.kepts + 2;
+        ctx->region.kept[ctx->region.kepts++] = a;
+    }
+    if (ctx->region.fixups == ctx->region.fixup_cap) {
+        ctx->region.fixup_cap = ctx->region.fixup_cap ? 2 * ctx->region.fixup_cap : 64;
+        ctx->region.fixup = realloc(ctx->region.fixup,
+            ctx->region.fixup_cap * sizeof *ctx->region.fixup);
+    }
+    ctx->region.fixup[ctx->region.fixups].slot = slot;
+    ctx->region.fixup[ctx->region.fixups].index = a->region - 2;
+    ++ctx->region.fixups;
+}
+
+
+/*! \internal
+ * \brief Copy the nursery cells reachable from \a ref to the old space.
+ *
+ * Cells are copied depth first, car before cdr, so a list spine and
+ * the elements hanging off it end up next to each other. Slots are
+ * updated to point at the copies.
+ */
+static void gc_copy(sexp* ref) {
+    gc_push(ref);
+    while (ctx->heap.sp) {
+        sexp* slot = ctx->heap.stack[--ctx->heap.sp];
+        sexp p = *slot;
+        if (SEXP_TYPE(p) == ATOM) {
+            if (ATOM_OF(p)->region) {
+                region_keep(slot);
+            }
+            continue;
+        }
+        /* a REF is a heap cell too, it keeps its tag when moved */
+        uintptr_t tag = (uintptr_t)SEXP_TYPE(p);
+        struct cons_impl* from = (struct cons_impl*)((uintptr_t)p - tag);
+        if (!p || !CHUNK_OF(from)->young) {
+            continue;
+        }
+        if (((uintptr_t)(from->l) & TAG_MASK) == FORWARD) {
+            *slot = (sexp)((uintptr_t)(from->l) - FORWARD + tag);
+            continue;
+        }
+        struct cons_impl* to = space_alloc(&ctx->heap.old, false);
+        CONST_CAST(sexp, to->l) = from->l;
+        CONST_CAST(sexp, to->r) = from->r;
+        CONST_CAST(sexp, from->l) = (sexp)((uintptr_t)to + FORWARD);
+        *slot = (sexp)((uintptr_t)to + tag);
+        if (tag == CONS) {
+            /* the cdr of a REF is its slot number */
+            gc_push(&CONST_CAST(sexp, to->r));
+        }
+        gc_push(&CONST_CAST(sexp, to->l));
+    }
+}
+
+
+/*! \internal
+ * \brief Free every chunk of \a s but one, which is emptied for reuse.
+ */
+static void space_reset(struct space* s) {
+    struct chunk* c = s->chunks;
+    if (!c) { return; }
+    while (c->next) {
+        struct chunk* n = c->next->next;
+        free(c->next);
+        c->next = n;
+    }
+    c->top = (char*)c + ((sizeof *c + sizeof(struct cons_impl) - 1)
+        / sizeof(struct cons_impl)) * sizeof(struct cons_impl);
+    c->young = true;
+    s->bytes = 0;
+}
+
+
+/*! \internal
+ * \brief Hash of a pair of \a l and \a r.
+ */
+static size_t pair_hash(sexp l, sexp r) {
+    size_t h = (uintptr_t)l * 0x9e3779b97f4a7c15u;
+    h ^= (uintptr_t)r + (h >> 17);
+    return h ^ (h >> 29);
+}
+
+
+/*! \internal
+ * \brief Find the slot for the pair of \a l and \a r.
+ *
+ * \return The slot holding the matching cell, or the empty slot
+ * where it belongs.
+ */
+static struct cons_impl** pairs_slot(sexp l, sexp r) {
+    size_t i = pair_hash(l, r) & ctx->pairs.mask;
+    while (ctx->pairs.slot[i]) {
+        if (ctx->pairs.slot[i]->l == l && ctx->pairs.slot[i]->r == r) {
+            break;
+        }
+        i = (i + 1) & ctx->pairs.mask;
+    }
+    return &ctx->pairs.slot[i];
+}
+
+
+/*! \internal
+ * \brief Enter every cell of the table again, in a table with room
+ * for at least \a n more.
+ */
+static void pairs_rehash(size_t n) {
+    struct cons_impl** old = ctx->pairs.slot;
+    size_t size = old ? ctx->pairs.mask + 1 : 0;
+    size_t cap = 1024;
+    size_t i = 0;
+    while (cap < 2 * (ctx->pairs.count + n)) {
+        cap *= 2;
+    }
+    ctx->pairs.slot = calloc(cap, sizeof *ctx->pairs.slot);
+    ctx->pairs.mask = cap - 1;
+    ctx->pairs.count = 0;
+    for (i = 0; i < size; ++i) {
+        if (old[i]) {
+            struct cons_impl** slot = pairs_slot(old[i]->l, old[i]->r);
+            if (!*slot) {
+                *slot = old[i];
+                ++ctx->pairs.count;
+            }
+        }
+    }
+    free(old);
+    ctx->pairs.stale = false;
+}
+
+
+/*! \internal
+ * \brief Update the table for a collection.
+ *
+ * Called once the live cells have been copied, while the nursery
+ * still holds the forwarding addresses.
+ */
+static void pairs_sweep() {
+    size_t i = 0;
+    for (i = 0; ctx->pairs.slot && i <= ctx->pairs.mask; ++i) {
+        struct cons_impl* c = ctx->pairs.slot[i];
+        if (!c || !CHUNK_OF(c)->young) {
+            continue;
+        }
+        if (((uintptr_t)(c->l) & TAG_MASK) == FORWARD) {
+            ctx->pairs.slot[i] = (struct cons_impl*)((uintptr_t)(c->l) - FORWARD);
+        } else {
+            ctx->pairs.slot[i] = 0;
+            --ctx->pairs.count;
+        }
+    }
+    ctx->pairs.stale = true;
+}
+
+
+/*! \brief Turn hash-consing on or off.
+ *
+ * While it is on, cons() returns the existing cell when one holds
+ * the same car and cdr, so structurally equal expressions built by
+ * cons() are the same cell. equal() can then answer on the first
+ * pointer compare, and repeated subtrees take no extra memory.
+ *
+ * Cells made while it is off are never shared, so turn it on before
+ * the data of interest is built, for example at start up.
+ *
+ * \param on \c true to share cells.
+ */
+void hash_cons(bool on) {
+    ctx->pairs.on = on;
+    if (!on) {
+        free(ctx->pairs.slot);
+        ctx->pairs.slot = 0;
+        ctx->pairs.mask = 0;
+        ctx->pairs.count = 0;
+        ctx->pairs.stale = false;
+    }
+}
+
+
 /*! \brief Create a cons pair.
  *
  * Because cons's may contain other cons's, they can be used to build
@@ -164,32 +799,875 @@ sexp symbol(const char* str, int len) {
  * first element of a cons, the car, is an atom, the second element
  * of a cons, the cdr, is the next cons.
  *
+ * The cons is bump allocated in the nursery. See gc_sexp(). With
+ * hash_cons() on, an existing cell with the same car and cdr is
+ * returned instead.
+ *
  * \param expr_a Arbitrary lisp.
  * \param expr_b arbitrary lisp.
  * \return The newly constructed cons.
  */
 sexp cons(sexp expr_a, sexp expr_b) {
-    struct sexp_impl* r = malloc(sizeof *r);
-    CONST_CAST(int, r->t) = CONS;
-    struct cons_impl* pcons = malloc(sizeof *pcons);
-    CONST_CAST(struct sexp_impl*, pcons->l)
-        = CONST_CAST(struct sexp_impl*, expr_a);
-    CONST_CAST(struct sexp_impl*, pcons->r)
-        = CONST_CAST(struct sexp_impl*, expr_b);
-    CONST_CAST(struct cons_impl*,r->v) = pcons;
-    return r;
+    struct cons_impl** slot = 0;
+    if (ctx->pairs.on) {
+        if (ctx->pairs.stale || 2 * (ctx->pairs.count + 1) > ctx->pairs.mask + 1) {
+            pairs_rehash(1);
+        }
+        slot = pairs_slot(expr_a, expr_b);
+        if (*slot) {
+            ++ctx->heap.stats.shared;
+            return (sexp)*slot;
+        }
+    }
+    struct cons_impl* r = space_alloc(nursery, true);
+    STAT_ADD(STAT_CONSES, 1);
+    STAT_ADD(STAT_CONS_BYTES, sizeof *r);
+    CONST_CAST(sexp, r->l) = expr_a;
+    CONST_CAST(sexp, r->r) = expr_b;
+    if (slot) {
+        *slot = r;
+        ++ctx->pairs.count;
+    }
+    return (sexp)r;
+}
+
+
+/*! \brief Tie an atom to a frame slot.
+ *
+ * Used by resolve(). The result is a REF, which behaves as \a atom
+ * everywhere but in eval().
+ *
+ * \param atom An atom.
+ * \param slot Index of \a atom in the parameters of its lambda.
+ * \return A REF.
+ */
+sexp ref(sexp atom, unsigned slot) {
+    struct cons_impl* r = space_alloc(nursery, true);
+    CONST_CAST(sexp, r->l) = REF_STRIP(atom);
+    CONST_CAST(sexp, r->r) = (sexp)(uintptr_t)slot;
+    return (sexp)((uintptr_t)r + REF);
 }
 
 
+/*! \brief Register a root for the garbage collector.
+ *
+ * Whatever \a ref points at when gc_sexp() runs is kept alive, and
+ * \a ref is updated if it moves. Use this for long lived globals.
+ *
+ * \param ref Address of a variable holding lisp.
+ */
+void gc_root(sexp* ref) {
+    if (ctx->heap.roots == ctx->heap.root_cap) {
+        ctx->heap.root_cap = ctx->heap.root_cap ? 2 * ctx->heap.root_cap : 16;
+        ctx->heap.root = realloc(ctx->heap.root, ctx->heap.root_cap * sizeof *ctx->heap.root);
+    }
+    ctx->heap.root[ctx->heap.roots++] = ref;
+}
+
+
+/*! \brief Register a function to call before each collection.
+ *
+ * Cells move when they are collected, so a table keyed by the
+ * address of a cell must forget its entries then. The hook is
+ * called before anything has moved, and must not allocate.
+ *
+ * \param hook The function.
+ */
+void gc_hook(void (*hook)(void)) {
+    ctx->heap.hook = realloc(ctx->heap.hook, (ctx->heap.hooks + 1) * sizeof *ctx->heap.hook);
+    ctx->heap.hook[ctx->heap.hooks++] = hook;
+}
+
+
+/*! \brief Count the collections so far.
+ *
+ * A table keyed by the address of a cell that cannot use gc_hook(),
+ * because it belongs to another thread, can compare this instead.
+ *
+ * \return The number of collections.
+ */
+unsigned long gc_count() {
+    return ctx->heap.stats.minors + ctx->heap.stats.majors;
+}
+
+
+/*! \brief Give the calling thread a nursery of its own.
+ *
+ * cons() allocates from the nursery of the calling thread, so
+ * threads can allocate at the same time. The collector takes every
+ * nursery, so it must only run while the other threads are idle.
+ * Calls must not overlap.
+ */
+void gc_thread() {
+    ctx->heap.nurseries = realloc(ctx->heap.nurseries,
+        (ctx->heap.threads + 1) * sizeof *ctx->heap.nurseries);
+    nursery = calloc(1, sizeof *nursery);
+    ctx->heap.nurseries[ctx->heap.threads++] = nursery;
+}
+
+
+/*! \internal
+ * \brief Collect everything not reachable from \a root or the
+ * registered roots.
+ */
+static void collect(sexp* root) {
+    clock_t start = clock();
+    size_t i = 0;
+    for (i = 0; i < ctx->heap.hooks; ++i) {
+        ctx->heap.hook[i]();
+    }
+    /* the nurseries of other threads are collected with this one */
+    for (i = 0; i < ctx->heap.threads; ++i) {
+        struct space* s = ctx->heap.nurseries[i];
+        while (s->chunks) {
+            struct chunk* c = s->chunks;
+            s->chunks = c->next;
+            c->next = ctx->heap.nursery.chunks;
+            ctx->heap.nursery.chunks = c;
+        }
+        ctx->heap.nursery.bytes += s->bytes;
+        s->bytes = 0;
+    }
+    ctx->heap.stats.conses += ctx->heap.nursery.bytes / sizeof(struct cons_impl);
+    bool major = ctx->heap.old.bytes > ctx->heap.major_at;
+    if (major) {
+        /* collect the old space along with the nursery */
+        struct chunk* c = ctx->heap.old.chunks;
+        while (c) {
+            struct chunk* n = c->next;
+            c->young = true;
+            c->next = ctx->heap.nursery.chunks;
+            ctx->heap.nursery.chunks = c;
+            c = n;
+        }
+        ctx->heap.old.chunks = 0;
+        ctx->heap.old.bytes = 0;
+    }
+
+    gc_copy(root);
+    for (i = 0; i < ctx->heap.roots; ++i) {
+        gc_copy(ctx->heap.root[i]);
+    }
+    pairs_sweep();
+    space_reset(&ctx->heap.nursery);
+
+    if (major) {
+        ctx->heap.major_at = 2 * ctx->heap.old.bytes > MAJOR_MIN
+            ? 2 * ctx->heap.old.bytes : MAJOR_MIN;
+        ++ctx->heap.stats.majors;
+    } else {
+        ++ctx->heap.stats.minors;
+    }
+    double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+    ctx->heap.stats.pause_total += pause;
+    if (pause > ctx->heap.stats.pause_max) {
+        ctx->heap.stats.pause_max = pause;
+    }
+    ctx->heap.stats.old = ctx->heap.old.bytes;
+}
+
+
+
+
 /*! \brief Garbage collect memory.
  *
- * If \a expr is a cons, then the car and cdr will be recursively
- * deleted as well if they are no longer needed.
+ * Everything that is not reachable from \a expr or from a root
+ * registered with gc_root() is freed. Surviving cells are moved, so
+ * any other pointer into the heap held by the caller is invalid
+ * afterwards.
+ *
+ * The collector is generational. Live nursery cells are promoted to
+ * the old space on every call, which costs time in proportion to the
+ * survivors rather than the garbage. The old space is collected as
+ * well once it has doubled since it was last collected.
+ *
+ * The collector does not know about the C stack, so it must only
+ * be called when no other lisp is live, for example between top
+ * level forms in a read-eval-print loop. It must not be called
+ * inside a region, use region_end() instead.
+ *
+ * \param expr The expression to keep.
+ * \return \a expr at its new location.
+ */
+sexp gc_sexp(sexp expr) {
+    collect(&expr);
+    return expr;
+}
+
+
+/*! \brief Start a region.
+ *
+ * Everything allocated from now until region_end() belongs to the
+ * region. That includes atoms, which otherwise stay interned
+ * forever.
+ */
+void region_begin() {
+    if (!ctx->atoms.slot) {
+        intern_init();
+    }
+    ctx->region.active = true;
+    ctx->region.chunk = ctx->atoms.pool;
+    ctx->region.used = ctx->atoms.pool ? ctx->atoms.pool->used : 0;
+    ctx->region.logged = 0;
+}
+
+
+/*! \brief Release a region.
+ *
+ * Frees everything allocated since region_begin() that is not
+ * reachable from \a keep or from a root registered with gc_root().
+ * Cells are released as by gc_sexp(). Atoms interned in the region
+ * are dropped from the intern table and their pool space is
+ * reclaimed in one step; the few that are still reachable are
+ * interned again afterwards and every reference to them is updated.
+ *
+ * The same restrictions as for gc_sexp() apply.
+ *
+ * \param keep The expression to keep.
+ * \return \a keep at its new location.
+ */
+sexp region_end(sexp keep) {
+    size_t i = 0;
+    ctx->region.kepts = 0;
+    ctx->region.fixups = 0;
+    collect(&keep);
+    ctx->region.active = false;
+
+    /* save the names of the survivors */
+    size_t bytes = 0;
+    for (i = 0; i < ctx->region.kepts; ++i) {
+        bytes += ctx->region.kept[i]->len + 1;
+    }
+    char* names = malloc(bytes + 1);
+    char* n = names;
+    for (i = 0; i < ctx->region.kepts; ++i) {
+        memcpy(n, ctx->region.kept[i]->name, ctx->region.kept[i]->len + 1);
+        n += ctx->region.kept[i]->len + 1;
+    }
+
+    /* forget the region's atoms, newest first */
+    for (i = ctx->region.logged; i > 0; --i) {
+        intern_remove(ctx->region.log[i-1]);
+    }
+    while (ctx->atoms.pool != ctx->region.chunk) {
+        struct pool_chunk* c = ctx->atoms.pool;
+        ctx->atoms.pool = c->next;
+        free(c);
+    }
+    if (ctx->atoms.pool) {
+        ctx->atoms.pool->used = ctx->region.used;
+    }
+
+    /* intern the survivors again and point their references at them */
+    n = names;
+    for (i = 0; i < ctx->region.kepts; ++i) {
+        size_t len = strlen(n);
+        ctx->region.kept[i] = ATOM_OF(symbol(n, len));
+        n += len + 1;
+    }
+    for (i = 0; i < ctx->region.fixups; ++i) {
+        *ctx->region.fixup[i].slot = ATOM_SEXP(ctx->region.kept[ctx->region.fixup[i].index]);
+    }
+    free(names);
+    return keep;
+}
+
+
+/*! \brief Get garbage collector statistics.
+ *
+ * \param stats Receives a snapshot of the counters.
+ */
+void gc_stats(struct gc_stats* stats) {
+    size_t i = 0;
+    *stats = ctx->heap.stats;
+    stats->conses += ctx->heap.nursery.bytes / sizeof(struct cons_impl);
+    for (i = 0; i < ctx->heap.threads; ++i) {
+        stats->conses += ctx->heap.nurseries[i]->bytes / sizeof(struct cons_impl);
+    }
+    stats->atoms = ctx->atoms.count;
+    stats->pairs = ctx->pairs.count;
+}
+
+
+/*! \brief Create an interpreter context.
+ *
+ * A context has atoms, cells and tables of its own, so threads
+ * that each enter a different one with lisp_ctx_enter() run
+ * interpreters that are independent of each other, and take no
+ * locks. Lisp from one context must never be used in another.
+ *
+ * The pool of pool.c belongs to the default context, so a thread
+ * in any other evaluates on its own, see eval_fork().
  *
- * \param expr The expression to free.
+ * \return The new context.
+ */
+struct lisp_ctx* lisp_ctx_new() {
+    struct lisp_ctx* c = calloc(1, sizeof *c);
+    c->heap.major_at = MAJOR_MIN;
+    return c;
+}
+
+
+/*! \internal
+ * \brief Free the chunks of \a s.
+ */
+static void space_free(struct space* s) {
+    while (s->chunks) {
+        struct chunk* c = s->chunks;
+        s->chunks = c->next;
+        free(c);
+    }
+}
+
+
+/*! \brief Destroy an interpreter context.
  *
- * \todo Implement garbage collection.
+ * Everything the context allocated is freed at once, chunk by
+ * chunk, without looking at the cells and atoms in them. The
+ * functions registered with lisp_ctx_hook() are called first, with
+ * \a c the current context.
+ *
+ * \param c A context from lisp_ctx_new(), current on no thread.
  */
-void gc_sexp(sexp expr) {
-    /* not implemented */
+void lisp_ctx_free(struct lisp_ctx* c) {
+    size_t i = 0;
+    struct lisp_ctx* prev = lisp_ctx_enter(c);
+    for (i = 0; i < c->hooks; ++i) {
+        c->hook[i]();
+    }
+    lisp_ctx_enter(prev);
+
+    space_free(&c->heap.nursery);
+    space_free(&c->heap.old);
+    for (i = 0; i < c->heap.threads; ++i) {
+        space_free(c->heap.nurseries[i]);
+        free(c->heap.nurseries[i]);
+    }
+    while (c->atoms.pool) {
+        struct pool_chunk* p = c->atoms.pool;
+        c->atoms.pool = p->next;
+        free(p);
+    }
+    free(c->atoms.slot);
+    free(c->region.log);
+    free(c->region.kept);
+    free(c->region.fixup);
+    free(c->heap.root);
+    free(c->heap.hook);
+    free(c->heap.nurseries);
+    free(c->heap.stack);
+    free(c->pairs.slot);
+    free(c->hook);
+    free(c);
+}
+
+
+/*! \brief Make \a c the context of the calling thread.
+ *
+ * Every function of the interpreter works on the context of the
+ * thread that calls it. Switch only between evaluations, never
+ * inside a region. The threads of the pool must not switch.
+ *
+ * \param c A context from lisp_ctx_new(), or null for the default
+ * context every thread starts in.
+ * \return The context the thread was in.
+ */
+struct lisp_ctx* lisp_ctx_enter(struct lisp_ctx* c) {
+    struct lisp_ctx* prev = ctx;
+    ctx = c ? c : &root;
+    nursery = &ctx->heap.nursery;
+    return prev == &root ? 0 : prev;
+}
+
+
+/*! \brief Get the context of the calling thread.
+ *
+ * \return The context, null for the default context.
+ */
+struct lisp_ctx* lisp_ctx_current() {
+    return ctx == &root ? 0 : ctx;
+}
+
+
+/*! \brief Get a slot for the state of a higher layer.
+ *
+ * Modules above this one keep their tables here rather than in
+ * static variables, so that each context has its own.
+ *
+ * \param key Which slot, a ::ctx_data.
+ * \return The slot in the current context, null until set.
+ */
+void** lisp_ctx_data(unsigned key) {
+    return &ctx->data[key];
+}
+
+
+/*! \brief Register a function to call when the current context is
+ * destroyed.
+ *
+ * The default context is never destroyed. Higher layers use this to
+ * free what they keep in lisp_ctx_data().
+ *
+ * \param hook The function.
+ */
+void lisp_ctx_hook(void (*hook)(void)) {
+    ctx->hook = realloc(ctx->hook, (ctx->hooks + 1) * sizeof *ctx->hook);
+    ctx->hook[ctx->hooks++] = hook;
+}
+
+
+/*! \internal
+ * \brief Identifies a heap image file, see image_dump().
+ */
+#define IMAGE_MAGIC "trolimg"
+
+/*! \internal
+ * \brief Version of the image layout.
+ */
+#define IMAGE_VERSION 1
+
+
+/*! \internal
+ * \brief Offset of the first cell of a chunk.
+ */
+#define CHUNK_CELLS ((sizeof(struct chunk) + sizeof(struct cons_impl) - 1) \
+    / sizeof(struct cons_impl) * sizeof(struct cons_impl))
+
+
+/*! \internal
+ * \brief Number of cells that fit in a chunk.
+ */
+#define CHUNK_CAPACITY ((CHUNK_SIZE - CHUNK_CELLS) / sizeof(struct cons_impl))
+
+
+/*! \internal
+ * \brief Start of a heap image.
+ *
+ * The image is laid out as it is used once mapped. The header and
+ * the atoms fill the first chunks, and the cells fill whole chunks
+ * from \c chunk_at on, with a struct chunk at the start of each, so
+ * the collector sees them as old cells and leaves them alone.
+ *
+ * Addresses in the image are offsets from its start. The cdr or car
+ * of a cell holding an atom holds the atom's index in the table at
+ * \c atom_at, tagged #ATOM, since the atom may already be interned
+ * when the image is loaded.
+ */
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t cell_size;
+    uint64_t chunk_size;
+    /*! Number of atoms, and the offset of their offsets. */
+    uint64_t atoms;
+    uint64_t atom_at;
+    /*! Number of cells, and the offset of the first chunk. */
+    uint64_t cells;
+    uint64_t chunk_at;
+    /*! The expression, coded as a cell field. */
+    uint64_t root;
+};
+
+
+/*! \internal
+ * \brief Numbers for the cells and atoms to be put in an image.
+ *
+ * Open addressing with linear probing, keyed by address.
+ */
+struct image_index {
+    uintptr_t* key;
+    size_t* value;
+    size_t mask;
+    size_t count;
+};
+
+
+/*! \internal
+ * \brief Find the slot of \a key in \a t.
+ */
+static size_t image_slot(const struct image_index* t, uintptr_t key) {
+    size_t i = (key * 0x9e3779b97f4a7c15u >> 7) & t->mask;
+    while (t->key[i] && t->key[i] != key) {
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+
+/*! \internal
+ * \brief Number \a key, if it has no number yet.
+ *
+ * \return \c true if \a key is new.
+ */
+static bool image_number(struct image_index* t, uintptr_t key) {
+    if (2 * (t->count + 1) > t->mask + 1) {
+        struct image_index old = *t;
+        size_t i = 0;
+        t->mask = old.key ? 2 * old.mask + 1 : 1023;
+        t->key = calloc(t->mask + 1, sizeof *t->key);
+        t->value = malloc((t->mask + 1) * sizeof *t->value);
+        for (i = 0; old.key && i <= old.mask; ++i) {
+            if (old.key[i]) {
+                size_t j = image_slot(t, old.key[i]);
+                t->key[j] = old.key[i];
+                t->value[j] = old.value[i];
+            }
+        }
+        free(old.key);
+        free(old.value);
+    }
+    size_t i = image_slot(t, key);
+    if (t->key[i]) {
+        return false;
+    }
+    t->key[i] = key;
+    t->value[i] = t->count++;
+    return true;
+}
+
+
+/*! \internal
+ * \brief Offset in an image of cell number \a i.
+ */
+static uint64_t image_cell_at(const struct image_header* h, size_t i) {
+    return h->chunk_at + i / CHUNK_CAPACITY * CHUNK_SIZE + CHUNK_CELLS
+        + i % CHUNK_CAPACITY * sizeof(struct cons_impl);
+}
+
+
+/*! \internal
+ * \brief Code \a expr as a cell field of an image.
+ *
+ * A REF is written as its atom, as resolve() would find it again.
+ */
+static uint64_t image_code(const struct image_header* h,
+        struct image_index* cells, struct image_index* names, sexp expr) {
+    expr = REF_STRIP(expr);
+    if (!expr) {
+        return 0;
+    }
+    if (SEXP_TYPE(expr) == ATOM) {
+        return names->value[image_slot(names, (uintptr_t)expr)] << 2
+            | ATOM;
+    }
+    return image_cell_at(h,
+        cells->value[image_slot(cells, (uintptr_t)expr)]);
+}
+
+
+/*! \brief Write \a expr to a heap image file.
+ *
+ * The cells and atoms reachable from \a expr are written in a form
+ * that image_load() can map back into memory in one step, without
+ * parsing. Shared structure stays shared.
+ *
+ * \param path The file.
+ * \param expr The expression.
+ * \return \c false if the file could not be written.
+ */
+bool image_dump(const char* path, sexp expr) {
+    struct image_index cells = { 0, 0, 0, 0 };
+    struct image_index names = { 0, 0, 0, 0 };
+    sexp* order = 0;
+    size_t order_cap = 0;
+    struct atom_impl** sym = 0;
+    size_t sym_cap = 0;
+    size_t i = 0;
+
+    /* number the cells depth first, car before cdr, as the collector
+     * would lay them out */
+    gc_push(&expr);
+    while (ctx->heap.sp) {
+        sexp p = *ctx->heap.stack[--ctx->heap.sp];
+        p = REF_STRIP(p);
+        if (!p) {
+            continue;
+        }
+        if (SEXP_TYPE(p) == ATOM) {
+            if (image_number(&names, (uintptr_t)p)) {
+                if (names.count > sym_cap) {
+                    sym_cap = sym_cap ? 2 * sym_cap : 256;
+                    sym = realloc(sym, sym_cap * sizeof *sym);
+                }
+                sym[names.count - 1] = ATOM_OF(p);
+            }
+            continue;
+        }
+        if (!image_number(&cells, (uintptr_t)p)) {
+            continue;
+        }
+        if (cells.count > order_cap) {
+            order_cap = order_cap ? 2 * order_cap : 1024;
+            order = realloc(order, order_cap * sizeof *order);
+        }
+        order[cells.count - 1] = p;
+        gc_push(&CONST_CAST(sexp, CONS_OF(p)->r));
+        gc_push(&CONST_CAST(sexp, CONS_OF(p)->l));
+    }
+
+    struct image_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+    h.version = IMAGE_VERSION;
+    h.cell_size = sizeof(struct cons_impl);
+    h.chunk_size = CHUNK_SIZE;
+    h.atoms = names.count;
+    h.atom_at = sizeof h;
+    h.cells = cells.count;
+    uint64_t at = h.atom_at + names.count * sizeof(uint64_t);
+    for (i = 0; i < names.count; ++i) {
+        at += (sizeof(struct atom_impl) + sym[i]->len + 1 + 7) & ~7u;
+    }
+    h.chunk_at = (at + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    h.root = image_code(&h, &cells, &names, expr);
+
+    FILE* f = fopen(path, "wb");
+    bool ok = f != 0;
+    if (ok) {
+        fwrite(&h, sizeof h, 1, f);
+        at = h.atom_at + names.count * sizeof(uint64_t);
+        for (i = 0; i < names.count; ++i) {
+            fwrite(&at, sizeof at, 1, f);
+            at += (sizeof(struct atom_impl) + sym[i]->len + 1 + 7) & ~7u;
+        }
+        for (i = 0; i < names.count; ++i) {
+            /* the record, its name pointer an offset, then the name */
+            struct atom_impl a;
+            size_t size = sizeof a + sym[i]->len + 1;
+            memcpy(&a, sym[i], sizeof a);
+            CONST_CAST(char*, a.name) = (char*)(uintptr_t)
+                (ftell(f) + sizeof a);
+            CONST_CAST(unsigned, a.op) = OP_NONE;
+            a.id = 0;
+            a.region = 0;
+            fwrite(&a, sizeof a, 1, f);
+            fwrite(sym[i]->name, 1, sym[i]->len + 1, f);
+            fwrite("\0\0\0\0\0\0\0", 1, ((size + 7) & ~7u) - size, f);
+        }
+        for (i = 0; i < cells.count; ++i) {
+            if (i % CHUNK_CAPACITY == 0) {
+                /* a chunk header, its end an offset */
+                struct chunk c;
+                size_t n = cells.count - i < CHUNK_CAPACITY
+                    ? cells.count - i : CHUNK_CAPACITY;
+                memset(&c, 0, sizeof c);
+                c.top = (char*)(uintptr_t)(image_cell_at(&h, i)
+                    + n * sizeof(struct cons_impl));
+                c.young = false;
+                fseek(f, h.chunk_at + i / CHUNK_CAPACITY * CHUNK_SIZE,
+                    SEEK_SET);
+                fwrite(&c, sizeof c, 1, f);
+                fseek(f, image_cell_at(&h, i), SEEK_SET);
+            }
+            uint64_t field[2];
+            field[0] = image_code(&h, &cells, &names, CONS_OF(order[i])->l);
+            field[1] = image_code(&h, &cells, &names, CONS_OF(order[i])->r);
+            fwrite(field, sizeof field, 1, f);
+        }
+        ok = !ferror(f);
+        ok = 0 == fclose(f) && ok;
+    }
+
+    free(cells.key);
+    free(cells.value);
+    free(names.key);
+    free(names.value);
+    free(order);
+    free(sym);
+    return ok;
+}
+
+
+/*! \internal
+ * \brief Check that the cell field \a code of an image is sound.
+ *
+ * It must be null, name one of the atoms, or be the offset of one of
+ * the cells.
+ */
+static bool image_code_ok(const struct image_header* h, uint64_t code) {
+    if (!code) {
+        return true;
+    }
+    if ((code & TAG_MASK) == ATOM) {
+        return code >> 2 < h->atoms;
+    }
+    if (code < h->chunk_at || code >= image_cell_at(h, h->cells)) {
+        return false;
+    }
+    uint64_t at = (code - h->chunk_at) % CHUNK_SIZE;
+    return at >= CHUNK_CELLS && at < CHUNK_CELLS
+            + CHUNK_CAPACITY * sizeof(struct cons_impl)
+        && (at - CHUNK_CELLS) % sizeof(struct cons_impl) == 0;
+}
+
+
+/*! \internal
+ * \brief Check the atoms and cells of an image before it is used.
+ *
+ * \param h The header, already checked against the file length.
+ * \param base Where the image is mapped.
+ * \param len The length of the file.
+ * \return \c false if an offset or a code points outside the image,
+ * or an atom's hash does not match its name.
+ */
+static bool image_ok(const struct image_header* h, const char* base,
+        size_t len) {
+    /* the atoms lie between the header and the cells */
+    uint64_t end = h->chunk_at < len ? h->chunk_at : len;
+    const uint64_t* atom_at = (const uint64_t*)(base + h->atom_at);
+    size_t i = 0;
+    for (i = 0; i < h->atoms; ++i) {
+        if (atom_at[i] % 8 || atom_at[i] < h->atom_at
+                || atom_at[i] > end - sizeof(struct atom_impl)) {
+            return false;
+        }
+        const struct atom_impl* a =
+            (const struct atom_impl*)(base + atom_at[i]);
+        uint64_t name = (uintptr_t)a->name;
+        if (a->op != OP_NONE || name < atom_at[i] + sizeof *a || name >= end
+                || a->len >= end - name || base[name + a->len]) {
+            return false;
+        }
+        /* a wrong hash would intern a second atom of the same name */
+        if (a->hash != hash_str(base + name, a->len)) {
+            return false;
+        }
+    }
+    for (i = 0; i < h->cells; ++i) {
+        const uint64_t* field = (const uint64_t*)(base
+            + image_cell_at(h, i));
+        if (!image_code_ok(h, field[0]) || !image_code_ok(h, field[1])) {
+            return false;
+        }
+    }
+    return image_code_ok(h, h->root);
+}
+
+
+/*! \brief Map a heap image written by image_dump().
+ *
+ * The file is mapped copy-on-write and used where it lies: nothing
+ * is parsed and no cells are allocated. Its addresses are adjusted
+ * to where it was mapped, in one pass over the cells, and its atoms
+ * are interned, or replaced by atoms of the same name that already
+ * are. Processes forked after the load share the pages.
+ *
+ * The mapping is private and writable, and is relocated in place:
+ * every page that holds a cell or an atom is written, so it becomes
+ * a private copy rather than a page of the file's cache. Loading at
+ * a fixed base would not avoid that, since the atoms get their ids
+ * when they are interned.
+ *
+ * An image whose offsets point outside the file, or whose atoms'
+ * hashes do not match their names, is rejected before anything in it
+ * is used.
+ *
+ * The cells are never collected. Like gc_sexp(), this must not be
+ * called inside a region.
+ *
+ * \param path The file.
+ * \return The expression, or null if the file is not a heap image
+ * written by this build.
+ */
+sexp image_load(const char* path) {
+    struct image_header h;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof h
+            || pread(fd, &h, sizeof h, 0) != (ssize_t)sizeof h
+            || memcmp(h.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC)
+            || h.version != IMAGE_VERSION
+            || h.cell_size != sizeof(struct cons_impl)
+            || h.chunk_size != CHUNK_SIZE
+            || h.atom_at != sizeof h
+            || h.chunk_at % CHUNK_SIZE
+            || h.atoms > (uint64_t)st.st_size / sizeof(uint64_t)
+            || h.atom_at + h.atoms * sizeof(uint64_t) > h.chunk_at
+            || h.atom_at + h.atoms * sizeof(uint64_t) > (uint64_t)st.st_size
+            || h.cells > (uint64_t)st.st_size / sizeof(struct cons_impl)
+            || (h.cells && image_cell_at(&h, h.cells) > (uint64_t)st.st_size)) {
+        close(fd);
+        return 0;
+    }
+
+    /* map the file on a chunk boundary, so CHUNK_OF() finds the chunk
+     * headers */
+    size_t len = st.st_size;
+    char* area = mmap(0, len + CHUNK_SIZE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    char* base = (char*)(((uintptr_t)area + CHUNK_SIZE - 1)
+        & ~(uintptr_t)(CHUNK_SIZE - 1));
+    if (mmap(base, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+            fd, 0) == MAP_FAILED) {
+        munmap(area, len + CHUNK_SIZE);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    if (base > area) {
+        munmap(area, base - area);
+    }
+    /* the file mapping covers whole pages */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped = (len + page - 1) / page * page;
+    if (area + len + CHUNK_SIZE > base + mapped) {
+        munmap(base + mapped, area + len + CHUNK_SIZE - (base + mapped));
+    }
+    if (!image_ok(&h, base, len)) {
+        munmap(base, len);
+        return 0;
+    }
+
+    if (!ctx->atoms.slot) {
+        intern_init();
+    }
+    sexp* sym = malloc((h.atoms ? h.atoms : 1) * sizeof *sym);
+    const uint64_t* atom_at = (const uint64_t*)(base + h.atom_at);
+    size_t i = 0;
+    for (i = 0; i < h.atoms; ++i) {
+        struct atom_impl* a = (struct atom_impl*)(base + atom_at[i]);
+        CONST_CAST(char*, a->name) = base + (uintptr_t)a->name;
+        struct atom_impl** slot = intern_slot(a->name, a->len, a->hash);
+        if (*slot) {
+            sym[i] = ATOM_SEXP(*slot);
+        } else {
+            intern_insert(a);
+            sym[i] = ATOM_SEXP(a);
+        }
+    }
+
+#define IMAGE_FIELD(code) \
+    (!(code) ? (sexp)0 : ((code) & TAG_MASK) == ATOM \
+        ? sym[(code) >> 2] : (sexp)(base + (code)))
+
+    for (i = 0; i < h.cells; ++i) {
+        if (i % CHUNK_CAPACITY == 0) {
+            /* the end of the chunk, from the cell count */
+            struct chunk* c = (struct chunk*)(base + h.chunk_at
+                + i / CHUNK_CAPACITY * CHUNK_SIZE);
+            size_t n = h.cells - i < CHUNK_CAPACITY
+                ? h.cells - i : CHUNK_CAPACITY;
+            c->next = 0;
+            c->top = base + image_cell_at(&h, i)
+                + n * sizeof(struct cons_impl);
+            c->young = false;
+        }
+        struct cons_impl* c = (struct cons_impl*)(base
+            + image_cell_at(&h, i));
+        CONST_CAST(sexp, c->l) = IMAGE_FIELD((uintptr_t)c->l);
+        CONST_CAST(sexp, c->r) = IMAGE_FIELD((uintptr_t)c->r);
+    }
+    sexp r = IMAGE_FIELD(h.root);
+
+#undef IMAGE_FIELD
+
+    free(sym);
+    return r;
 }
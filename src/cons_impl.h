@@ -32,6 +32,9 @@
 
 #include "cons.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 
 /*! \brief Symbolic expression types.
  *
@@ -43,27 +46,97 @@
  * A cons cell may contain another cons pair, or an atom.
  *
  * An atom is a character string.
+ *
+ * A REF is an atom that resolve() has tied to a slot of the frame of
+ * the lambda that binds it. It behaves as its atom everywhere except
+ * in eval(), which can fetch its value from the frame.
+ *
+ * The values double as the tag in the low bits of a ::sexp, see
+ * SEXP_TYPE().
  */
-typedef enum { CONS, ATOM } expr_type;
+typedef enum { CONS, ATOM, REF } expr_type;
+
+
+/*! \brief Mask for the tag bits of a ::sexp.
+ *
+ * A ::sexp is a tagged word rather than a pointer to a type header.
+ * Cons pairs and atom records are at least 8-byte aligned, which
+ * leaves the low bits free. A cons is an untagged pointer to its
+ * struct ::cons_impl. An atom is a pointer to its struct ::atom_impl
+ * plus #ATOM. A REF is a heap cell holding the atom and the slot
+ * number, plus #REF. The null pointer is still used for
+ * "no expression".
+ */
+#define TAG_MASK ((uintptr_t)3)
+
+/*! \brief Type of \a expr, CONS, ATOM or REF. */
+#define SEXP_TYPE(expr) ((expr_type)((uintptr_t)(expr) & TAG_MASK))
+
+/*! \brief The cons pair of a CONS \a expr. */
+#define CONS_OF(expr) ((const struct cons_impl*)(expr))
 
+/*! \brief The atom record of an ATOM \a expr. */
+#define ATOM_OF(expr) ((struct atom_impl*)((uintptr_t)(expr) - ATOM))
 
-/*! \brief Symbolic expression.
+/*! \brief The ::sexp for the atom record at \a a. */
+#define ATOM_SEXP(a) ((sexp)((uintptr_t)(a) + ATOM))
+
+/*! \brief The heap cell of a REF \a expr. */
+#define REF_CELL(expr) ((const struct cons_impl*)((uintptr_t)(expr) - REF))
+
+/*! \brief The atom of a REF \a expr. */
+#define REF_ATOM(expr) (REF_CELL(expr)->l)
+
+/*! \brief The frame slot of a REF \a expr. */
+#define REF_SLOT(expr) ((unsigned)(uintptr_t)(REF_CELL(expr)->r))
+
+/*! \brief \a expr with a REF replaced by its atom. */
+#define REF_STRIP(expr) \
+    (SEXP_TYPE(expr) == REF ? REF_ATOM(expr) : (expr))
+
+
+/*! \brief Interned atom.
+ *
+ * Every atom is interned: symbol() hands out exactly one atom_impl
+ * per distinct string, so two atoms are eq() iff they are the same
+ * ::sexp. The record and its characters live in the string pool
+ * owned by cons_impl.c, except for the symbolic constants which are
+ * statically allocated by constants.c and seeded into the table.
  *
- * This is a run-time type information (RTTI) container. The members
- * are const because expressions are immutable once constructed.
+ * \note Short names are not packed into the ::sexp itself because
+ * c_str() promises a stable '\\0' terminated string.
  */
-struct sexp_impl {
-    /*! Type ID for #v.
+struct atom_impl {
+    /*! \brief The '\\0' terminated name.
+     */
+    const char* const name;
+    /*! \brief Cached hash of the name.
      *
-     * CONS or ATOM.
+     * Zero until the atom has been entered into the intern table.
      */
-    const expr_type t;
-    /*! Generic pointer to cons pair or atom.
+    unsigned hash;
+    /*! \brief Dense index of the atom.
      *
-     * Has type char* for atoms and struct ::cons_impl* for cons
-     * pairs.
+     * Atoms are numbered from zero in the order they were interned.
+     * Tables with an entry per atom, such as the variable bindings
+     * in env.c, are indexed by it.
+     */
+    unsigned id;
+    /*! \brief Length of the name in characters.
      */
-    const void* const v;
+    const unsigned len;
+    /*! \brief Special form implemented by this atom.
+     *
+     * An ::opcode, OP_NONE for all but the symbolic constants. See
+     * atom_opcode().
+     */
+    const unsigned op;
+    /*! \brief Region bookkeeping.
+     *
+     * Non-zero for atoms interned since region_begin(). See
+     * region_end().
+     */
+    unsigned region;
 };
 
 
@@ -74,6 +147,9 @@ struct sexp_impl {
  * rest. Pairs can be used to build arbitrary data structures,
  * simple examples are lists and trees. The members are const
  * because cons pairs are immutable once constructed.
+ *
+ * A pair is a single 16 byte allocation on the heap; there is no
+ * separate header.
  */
 struct cons_impl {
     /*! \brief Car or first.
@@ -88,4 +164,60 @@ struct cons_impl {
     const sexp r;
 };
 
-#endif
\ No newline at end of file
+
+/*! \brief Garbage collector statistics.
+ *
+ * See gc_stats().
+ */
+struct gc_stats {
+    /*! Number of nursery only collections. */
+    unsigned long minors;
+    /*! Number of collections that included the old space. */
+    unsigned long majors;
+    /*! Cons cells allocated since start up. */
+    unsigned long conses;
+    /*! Bytes in the old space after the last collection. */
+    size_t old;
+    /*! Number of atoms in the intern table. */
+    size_t atoms;
+    /*! Calls of cons() answered by an existing cell. */
+    unsigned long shared;
+    /*! Number of cells in the hash-cons table. */
+    size_t pairs;
+    /*! Total time spent collecting, in seconds. */
+    double pause_total;
+    /*! Longest single collection, in seconds. */
+    double pause_max;
+};
+
+
+/*! \brief Slots of lisp_ctx_data().
+ */
+enum ctx_data {
+    /*! The global table of env.c. */
+    CTX_GLOBALS,
+    /*! The memo table of memo.c. */
+    CTX_MEMO,
+    /*! Number of slots. */
+    CTX_DATA
+};
+
+
+struct lisp_ctx;
+
+struct lisp_ctx* lisp_ctx_new();
+void lisp_ctx_free(struct lisp_ctx* c);
+struct lisp_ctx* lisp_ctx_enter(struct lisp_ctx* c);
+struct lisp_ctx* lisp_ctx_current();
+void** lisp_ctx_data(unsigned key);
+void lisp_ctx_hook(void (*hook)(void));
+void gc_stats(struct gc_stats* stats);
+void gc_hook(void (*hook)(void));
+void gc_thread();
+unsigned long gc_count();
+void hash_cons(bool on);
+sexp ref(sexp atom, unsigned slot);
+bool image_dump(const char* path, sexp expr);
+sexp image_load(const char* path);
+
+#endif
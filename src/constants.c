@@ -20,9 +20,10 @@
  * \brief Symbolic constants for common atoms.
  *
  * The following atoms have symbolic constants: t, nil, quote,
- * ., atom, eq, car, cdr, cons, cond, lambda and label. Strictly
- * speaking, dot (.) is not an atom. However, the parser treats it
- * as one while scanning the text before it filters it out.
+ * ., atom, eq, car, cdr, cons, cond, lambda, label, define and
+ * time. Strictly speaking, dot (.) is not an atom. However, the
+ * parser treats it as one while scanning the text before it filters
+ * it out.
  */
 
 #include "constants.h"
@@ -31,11 +32,14 @@
 
 /*! \internal
  * \brief Generate a factory function for symbolic constants.
+ *
+ * The atoms are statically allocated. symbol() seeds its intern table
+ * with them, so parsing "t" yields the very same atom as ATOM_T().
  */
-#define CONST_ATOM(f,str) \
+#define CONST_ATOM(f,str,op) \
     sexp f() { \
-        static struct sexp_impl r = { ATOM, str }; \
-        return &r; \
+        static struct atom_impl r = { str, 0, 0, sizeof(str)-1, op, 0 }; \
+        return ATOM_SEXP(&r); \
     }
 
 
@@ -77,17 +81,41 @@
  *
  * \fn sexp ATOM_LABEL()
  * \brief 'label
+ *
+ * \fn sexp ATOM_DEFINE()
+ * \brief 'define
+ * \note Only understood at the top level, see eval_top(). It is not
+ * a built-in, so below the top level it is an ordinary name.
+ *
+ * \fn sexp ATOM_TIME()
+ * \brief 'time
+ * \note Only understood at the top level, see eval_top(). Below it,
+ * an ordinary name, as define is.
  */
 
-CONST_ATOM(ATOM_T, "t");
-CONST_ATOM(ATOM_NIL, "nil");
-CONST_ATOM(ATOM_QUOTE, "quote");
-CONST_ATOM(ATOM_DOT, ".");
-CONST_ATOM(ATOM_ATOM, "atom");
-CONST_ATOM(ATOM_EQ, "eq");
-CONST_ATOM(ATOM_CAR, "car");
-CONST_ATOM(ATOM_CDR, "cdr");
-CONST_ATOM(ATOM_CONS, "cons");
-CONST_ATOM(ATOM_COND, "cond");
-CONST_ATOM(ATOM_LAMBDA, "lambda");
-CONST_ATOM(ATOM_LABEL, "label");
+CONST_ATOM(ATOM_T, "t", OP_NONE);
+CONST_ATOM(ATOM_NIL, "nil", OP_NONE);
+CONST_ATOM(ATOM_QUOTE, "quote", OP_QUOTE);
+CONST_ATOM(ATOM_DOT, ".", OP_NONE);
+CONST_ATOM(ATOM_ATOM, "atom", OP_ATOM);
+CONST_ATOM(ATOM_EQ, "eq", OP_EQ);
+CONST_ATOM(ATOM_CAR, "car", OP_CAR);
+CONST_ATOM(ATOM_CDR, "cdr", OP_CDR);
+CONST_ATOM(ATOM_CONS, "cons", OP_CONS);
+CONST_ATOM(ATOM_COND, "cond", OP_COND);
+CONST_ATOM(ATOM_LAMBDA, "lambda", OP_LAMBDA);
+CONST_ATOM(ATOM_LABEL, "label", OP_LABEL);
+CONST_ATOM(ATOM_DEFINE, "define", OP_NONE);
+CONST_ATOM(ATOM_TIME, "time", OP_NONE);
+
+
+/*! \brief Get the built-in function named by \a expr.
+ *
+ * \param expr Arbitrary lisp.
+ * \return The ::opcode of \a expr if it is one of the built-in
+ * atoms, \c OP_NONE otherwise.
+ */
+opcode atom_opcode(sexp expr) {
+    expr = REF_STRIP(expr);
+    return SEXP_TYPE(expr) == ATOM ? ATOM_OF(expr)->op : OP_NONE;
+}
@@ -36,5 +36,22 @@ sexp ATOM_CONS();
 sexp ATOM_COND();
 sexp ATOM_LAMBDA();
 sexp ATOM_LABEL();
+sexp ATOM_DEFINE();
+sexp ATOM_TIME();
+
+
+/*! \brief Built-in function named by an atom.
+ *
+ * eval() dispatches on these rather than comparing the head of a
+ * form with each built-in in turn.
+ */
+typedef enum {
+    OP_NONE, OP_QUOTE, OP_ATOM, OP_EQ, OP_CAR, OP_CDR, OP_CONS,
+    OP_COND, OP_LAMBDA, OP_LABEL,
+    /*! Number of opcodes. */
+    OP_COUNT
+} opcode;
+
+opcode atom_opcode(sexp expr);
 
 #endif
\ No newline at end of file
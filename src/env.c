@@ -0,0 +1,700 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file env.c
+ *
+ * \brief Variable bindings.
+ *
+ * TRoL keeps the environment in an association list, so finding a
+ * variable costs time in proportion to the number of bindings made
+ * since the program started. This module implements the same
+ * dynamic scoping with shallow binding instead: every atom has a
+ * value cell holding its current binding, and a stack remembers the
+ * values the cells had before, so they can be restored when the
+ * bindings go out of scope. Looking up a variable is a single load.
+ *
+ * On top of that each lambda call gets a frame: the values of its
+ * arguments in a stack of slots, in the order of its parameters. A
+ * variable that resolve() has tied to a parameter of the lambda it
+ * appears in is fetched from the frame with frame_ref().
+ *
+ * Each thread has bindings and frames of its own. A thread that
+ * steals work forked by another starts from the bindings the other
+ * had at the fork, see env_fork().
+ *
+ * Below all of that is the global table, which holds the top level
+ * definitions made with define(). lookup() only looks there when a
+ * variable has no binding, so a parameter shadows a global of the
+ * same name. The table belongs to the context, see lisp_ctx_data(),
+ * so it is shared by every thread of the pool, and must only be
+ * changed while eval() is not running.
+ *
+ * \note The bindings are not roots for gc_sexp(). Bindings only
+ * exist while eval() is running, and the collector must not run
+ * then anyway. The globals are roots.
+ */
+
+#include "env.h"
+
+#include "cons_impl.h"
+#include "constants.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*! \internal
+ * \brief A saved value cell.
+ */
+struct binding {
+    sexp key;
+    sexp value;
+    /*! On the binding stack, the value bound, for env_enter(). */
+    sexp bound;
+};
+
+
+/*! \internal
+ * \brief The value cells, the binding stack and the frame slots.
+ *
+ * value is indexed by atom id. A null entry means unbound. A slot
+ * holds a parameter and its argument; the current frame is the n
+ * slots from base.
+ *
+ * Threads that steal work read the bottom of the binding stack, see
+ * env_enter(), so it only moves under \c grow.
+ */
+struct env {
+    sexp* value;
+    size_t values;
+    struct binding* stack;
+    size_t sp;
+    size_t stack_cap;
+    struct binding* slot;
+    size_t slots;
+    size_t slot_cap;
+    struct frame frame;
+    pthread_mutex_t grow;
+    /*! Value cells that are all unbound, for env_enter(). */
+    sexp* clean;
+    size_t cleans;
+};
+
+static _Thread_local struct env env = { .grow = PTHREAD_MUTEX_INITIALIZER };
+
+
+/*! \internal
+ * \brief A top level definition.
+ *
+ * Both fields are registered with gc_root(), so the record must
+ * never move.
+ */
+struct global {
+    sexp key;
+    sexp value;
+    /*! The next definition made. */
+    struct global* next;
+};
+
+
+/*! \internal
+ * \brief The global table.
+ *
+ * Open addressing with linear probing, keyed by the hash of the
+ * name. The name is hashed rather than the atom's address or id,
+ * since those change when region_end() interns an atom again.
+ */
+struct globals {
+    struct global** slot;
+    size_t mask;
+    size_t n;
+    struct global* first;
+    struct global* last;
+};
+
+
+/*! \internal
+ * \brief Find the slot of atom \a key in global table \a t.
+ */
+static size_t global_slot(const struct globals* t, sexp key) {
+    size_t i = ATOM_OF(key)->hash & t->mask;
+    while (t->slot[i] && t->slot[i]->key != key) {
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+
+/*! \internal
+ * \brief Free the global table of the context being destroyed.
+ */
+static void globals_free() {
+    struct globals* t = *lisp_ctx_data(CTX_GLOBALS);
+    while (t->first) {
+        struct global* g = t->first;
+        t->first = g->next;
+        free(g);
+    }
+    free(t->slot);
+    free(t);
+}
+
+
+/*! \internal
+ * \brief Get the value cell of atom \a key.
+ */
+static sexp* cell(sexp key) {
+    key = REF_STRIP(key);
+    unsigned id = ATOM_OF(key)->id;
+    if (id >= env.values) {
+        size_t n = env.values ? env.values : 256;
+        while (n <= id) { n *= 2; }
+        env.value = realloc(env.value, n * sizeof *env.value);
+        while (env.values < n) { env.value[env.values++] = 0; }
+    }
+    return &env.value[id];
+}
+
+
+/*! \internal
+ * \brief Make room for \a n more bindings on the stack.
+ */
+static void reserve(size_t n) {
+    if (env.sp + n > env.stack_cap) {
+        while (env.sp + n > env.stack_cap) {
+            env.stack_cap = env.stack_cap ? 2 * env.stack_cap : 256;
+        }
+        pthread_mutex_lock(&env.grow);
+        env.stack = realloc(env.stack, env.stack_cap * sizeof *env.stack);
+        pthread_mutex_unlock(&env.grow);
+    }
+}
+
+
+/*! \brief Look up the value of a variable.
+ *
+ * \param key Arbitrary lisp, normally an atom.
+ * \return The innermost binding of \a key if there is one, \a key
+ * otherwise. This matches assoc().
+ */
+sexp lookup(sexp key) {
+    key = REF_STRIP(key);
+    if (SEXP_TYPE(key) == ATOM) {
+        unsigned id = ATOM_OF(key)->id;
+        if (id < env.values && env.value[id]) {
+            return env.value[id];
+        }
+        const struct globals* t = *lisp_ctx_data(CTX_GLOBALS);
+        if (t && t->n) {
+            struct global* g = t->slot[global_slot(t, key)];
+            if (g) {
+                return g->value;
+            }
+        }
+    }
+    return key;
+}
+
+
+/*! \brief Define a global variable.
+ *
+ * The definition replaces any earlier definition of \a key, and
+ * lasts until the process ends, across gc_sexp() and region_end().
+ * It is seen by lookup() wherever \a key is not bound.
+ *
+ * Must not be called while eval() is running.
+ *
+ * \param key An atom.
+ * \param value Arbitrary lisp.
+ */
+void define(sexp key, sexp value) {
+    key = REF_STRIP(key);
+    if (SEXP_TYPE(key) != ATOM) {
+        return;
+    }
+    struct globals** data = (struct globals**)lisp_ctx_data(CTX_GLOBALS);
+    struct globals* t = *data;
+    if (!t) {
+        t = *data = calloc(1, sizeof *t);
+        lisp_ctx_hook(globals_free);
+    }
+    if (2 * (t->n + 1) > t->mask + 1) {
+        struct global** old = t->slot;
+        size_t mask = t->mask;
+        size_t i = 0;
+        t->mask = old ? 2 * mask + 1 : 63;
+        t->slot = calloc(t->mask + 1, sizeof *t->slot);
+        for (i = 0; old && i <= mask; ++i) {
+            if (old[i]) {
+                t->slot[global_slot(t, old[i]->key)] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t i = global_slot(t, key);
+    if (t->slot[i]) {
+        t->slot[i]->value = value;
+        return;
+    }
+    struct global* g = malloc(sizeof *g);
+    g->key = key;
+    g->value = value;
+    g->next = 0;
+    gc_root(&g->key);
+    gc_root(&g->value);
+    if (t->last) {
+        t->last->next = g;
+    } else {
+        t->first = g;
+    }
+    t->last = g;
+    t->slot[i] = g;
+    ++t->n;
+}
+
+
+/*! \brief List the global variables.
+ *
+ * \return An association list of every definition made with
+ * define(), in the order they were first made.
+ */
+sexp globals_alist() {
+    const struct globals* t = *lisp_ctx_data(CTX_GLOBALS);
+    sexp r = ATOM_NIL();
+    struct global* g = t ? t->first : 0;
+    size_t n = t ? t->n : 0;
+    sexp* v = malloc((n ? n : 1) * sizeof *v);
+    size_t i = 0;
+    for (; g; g = g->next) {
+        v[i++] = cons(g->key, g->value);
+    }
+    while (i > 0) {
+        r = cons(v[--i], r);
+    }
+    free(v);
+    return r;
+}
+
+
+/*! \brief Remember the bindings at a fork.
+ *
+ * Nothing is copied. The bindings below the current depth of the
+ * binding stack stay as they are until the forked work is joined,
+ * so a thread that steals it can read them then, see env_enter().
+ *
+ * \param fork Receives where the bindings are.
+ */
+void env_fork(struct env_fork* fork) {
+    fork->env = &env;
+    fork->mark = env.sp;
+}
+
+
+/*! \brief Take on the bindings of a fork made by another thread.
+ *
+ * The current value cells are put aside for value cells holding
+ * only the bindings at the fork, until env_leave(). The caller must
+ * hide the current frame, as by frame_enter() with no keys, since it
+ * belongs to the other thread.
+ *
+ * \param fork From env_fork() on the other thread.
+ */
+void env_enter(struct env_fork* fork) {
+    struct env* from = fork->env;
+    sexp* value = env.value;
+    size_t values = env.values;
+    env.value = env.clean;
+    env.values = env.cleans;
+    /* a steal while this one runs gets cells of its own */
+    env.clean = 0;
+    env.cleans = 0;
+    fork->value = value;
+    fork->values = values;
+    fork->base = env.sp;
+    /* grow first, two thieves of each other must not wait on each other */
+    reserve(fork->mark);
+    pthread_mutex_lock(&from->grow);
+    size_t i = 0;
+    for (i = 0; i < fork->mark; ++i) {
+        bind(from->stack[i].key, from->stack[i].bound);
+    }
+    pthread_mutex_unlock(&from->grow);
+}
+
+
+/*! \brief Go back to the value cells put aside by env_enter().
+ *
+ * The bindings made in between must have been undone.
+ *
+ * \param fork As passed to env_enter().
+ */
+void env_leave(struct env_fork* fork) {
+    unbind(fork->base);
+    /* unbinding left every cell unbound again */
+    free(env.clean);
+    env.clean = env.value;
+    env.cleans = env.values;
+    env.value = fork->value;
+    env.values = fork->values;
+}
+
+
+/*! \brief Get the current depth of the binding stack.
+ *
+ * \return A mark to pass to unbind().
+ */
+size_t bind_mark() {
+    return env.sp;
+}
+
+
+/*! \brief Bind a variable.
+ *
+ * The binding shadows any existing binding of \a key until it is
+ * undone by unbind().
+ *
+ * \param key An atom.
+ * \param value Arbitrary lisp.
+ */
+void bind(sexp key, sexp value) {
+    if (!c_bool(atom(key))) {
+        return;
+    }
+    sexp* c = cell(key);
+    reserve(1);
+    env.stack[env.sp].key = REF_STRIP(key);
+    env.stack[env.sp].value = *c;
+    env.stack[env.sp].bound = value;
+    ++env.sp;
+    *c = value;
+}
+
+
+/*! \brief Bind a variable, replacing a binding made since \a mark.
+ *
+ * Same as bind(), except that if \a key was bound since \a mark
+ * that binding is overwritten instead of shadowed. Once nothing
+ * can look at the old value any more, this keeps the binding stack
+ * from growing, see eval_expr().
+ *
+ * \param mark A depth from bind_mark().
+ * \param key An atom.
+ * \param value Arbitrary lisp.
+ */
+void rebind(size_t mark, sexp key, sexp value) {
+    if (!c_bool(atom(key))) {
+        return;
+    }
+    key = REF_STRIP(key);
+    size_t i = env.sp;
+    while (i > mark) {
+        /* the innermost binding is the one in the cell */
+        if (env.stack[--i].key == key) {
+            env.stack[i].bound = value;
+            *cell(key) = value;
+            return;
+        }
+    }
+    bind(key, value);
+}
+
+
+/*! \internal
+ * \brief Bind the \a n bindings staged above the top of the stack.
+ *
+ * Each staged entry holds the key and its new value. The entries
+ * are bound bottom up, and each is left holding the value its key
+ * had before. Keys that are not atoms can never be looked up, they
+ * are dropped.
+ */
+static void bind_staged(size_t n) {
+    size_t i = 0;
+    size_t top = env.sp;
+    for (i = 0; i < n; ++i) {
+        struct binding b = env.stack[top + i];
+        if (c_bool(atom(b.key))) {
+            sexp* c = cell(b.key);
+            env.stack[env.sp].key = b.key;
+            env.stack[env.sp].value = *c;
+            env.stack[env.sp].bound = b.value;
+            ++env.sp;
+            *c = b.value;
+        }
+    }
+}
+
+
+/*! \brief Bind a list of variables.
+ *
+ * Has the same effect on lookup() as prepending
+ * pair(\a keys, \a values) to an association list: extra keys or
+ * values are ignored, and if a key appears twice the first wins.
+ *
+ * \param keys A list of atoms.
+ * \param values A list of values.
+ */
+void bind_pairs(sexp keys, sexp values) {
+    size_t n = 0;
+    sexp k = keys;
+    sexp v = values;
+    for (; !c_bool(atom(k)) && !c_bool(atom(v)); k = cdr(k), v = cdr(v)) {
+        ++n;
+    }
+    reserve(n);
+    /* stage from the last pair to the first, so the first wins */
+    size_t i = 0;
+    for (i = n; i > 0; --i, keys = cdr(keys), values = cdr(values)) {
+        env.stack[env.sp + i - 1].key = car(keys);
+        env.stack[env.sp + i - 1].value = car(values);
+    }
+    bind_staged(n);
+}
+
+
+/*! \brief Bind the variables of an association list.
+ *
+ * Afterwards lookup() agrees with assoc() on \a map for every key of
+ * \a map.
+ *
+ * \param map A dictionary in the form created by pair().
+ */
+void bind_alist(sexp map) {
+    size_t n = 0;
+    sexp m = map;
+    for (; !c_bool(atom(m)); m = cdr(m)) {
+        ++n;
+    }
+    reserve(n);
+    size_t i = 0;
+    for (i = n; i > 0; --i, map = cdr(map)) {
+        env.stack[env.sp + i - 1].key = car(car(map));
+        env.stack[env.sp + i - 1].value = cdr(car(map));
+    }
+    bind_staged(n);
+}
+
+
+/*! \brief Undo bindings.
+ *
+ * Restores every binding made since \a mark was taken.
+ *
+ * \param mark A depth from bind_mark().
+ */
+void unbind(size_t mark) {
+    while (env.sp > mark) {
+        --env.sp;
+        *cell(env.stack[env.sp].key) = env.stack[env.sp].value;
+    }
+}
+
+
+/*! \brief Get the top of the frame slots.
+ *
+ * \return The base to pass to frame_enter() once the arguments
+ * have been pushed with frame_arg().
+ */
+size_t frame_mark() {
+    return env.slots;
+}
+
+
+/*! \brief Push an argument for the next frame.
+ *
+ * \param value Arbitrary lisp.
+ */
+void frame_arg(sexp value) {
+    if (env.slots == env.slot_cap) {
+        env.slot_cap = env.slot_cap ? 2 * env.slot_cap : 256;
+        env.slot = realloc(env.slot, env.slot_cap * sizeof *env.slot);
+    }
+    env.slot[env.slots].key = 0;
+    env.slot[env.slots].value = value;
+    ++env.slots;
+}
+
+
+/*! \brief Get the value of a frame slot.
+ *
+ * \param i A slot below frame_mark().
+ * \return The argument pushed into slot \a i.
+ */
+sexp frame_value(size_t i) {
+    return env.slot[i].value;
+}
+
+
+/*! \brief Make the arguments pushed since \a base the current frame.
+ *
+ * The parameters are bound to the arguments as by bind_pairs(), so
+ * lookup() sees them too. Parameters already bound since \a mark
+ * are rebound in place, see rebind(). Call unbind() and
+ * frame_leave() when the body is done.
+ *
+ * \param base A mark from frame_mark().
+ * \param keys The lambda parameters, atoms.
+ * \param arity The number of \a keys.
+ * \param mark A depth from bind_mark().
+ * \return The previous frame.
+ */
+struct frame frame_enter(size_t base, const sexp* keys, size_t arity,
+                         size_t mark) {
+    size_t n = env.slots - base < arity ? env.slots - base : arity;
+    size_t i = 0;
+    for (i = 0; i < n; ++i) {
+        env.slot[base + i].key = keys[i];
+    }
+    /* bind from the last to the first, so the first wins */
+    for (i = n; i > 0; --i) {
+        rebind(mark, env.slot[base + i - 1].key,
+            env.slot[base + i - 1].value);
+    }
+    /* a slot that lookup() does not see can never be fetched */
+    for (i = 0; i < n; ++i) {
+        struct binding* b = &env.slot[base + i];
+        if (!c_bool(atom(b->key)) || *cell(b->key) != b->value) {
+            b->key = 0;
+        } else {
+            b->key = REF_STRIP(b->key);
+        }
+    }
+    struct frame prev = env.frame;
+    env.frame.base = base;
+    env.frame.n = n;
+    return prev;
+}
+
+
+/*! \brief Remove the slots from \a base up to \a top.
+ *
+ * The slots above \a top move down to \a base. Used to replace a
+ * frame that is no longer needed by the arguments pushed after it.
+ *
+ * \param base A mark from frame_mark().
+ * \param top A later mark from frame_mark().
+ */
+void frame_drop(size_t base, size_t top) {
+    if (top > base) {
+        memmove(&env.slot[base], &env.slot[top],
+            (env.slots - top) * sizeof *env.slot);
+        env.slots -= top - base;
+    }
+}
+
+
+/*! \brief Drop the current frame and its slots.
+ *
+ * \param prev The frame returned by frame_enter().
+ */
+void frame_leave(struct frame prev) {
+    env.slots = env.frame.base;
+    env.frame = prev;
+}
+
+
+/*! \brief Look up the value of a REF made by resolve().
+ *
+ * \param ref A REF.
+ * \return The same as lookup(), but the value is read from the
+ * current frame when the slot holds the REF's atom.
+ */
+sexp frame_ref(sexp ref) {
+    sexp key = REF_ATOM(ref);
+    unsigned i = REF_SLOT(ref);
+    if (i < env.frame.n && env.slot[env.frame.base + i].key == key) {
+        return env.slot[env.frame.base + i].value;
+    }
+    return lookup(key);
+}
+
+
+/*! \brief Start an activation.
+ *
+ * An activation collects the bindings and frames of one evaluation
+ * that calls in tail position, see act_enter(). Undo them all with
+ * act_end().
+ *
+ * \param act The activation.
+ */
+void act_begin(struct activation* act) {
+    act->mark = bind_mark();
+    act->base = frame_mark();
+    act->entered = false;
+}
+
+
+/*! \brief Make the arguments pushed since \a top the frame of \a act.
+ *
+ * The frame replaces any frame \a act has entered before, which is
+ * dead once its body has made a call in tail position. Parameters
+ * bound before in \a act are rebound in place, see rebind().
+ *
+ * \param act The activation.
+ * \param top A mark from frame_mark().
+ * \param keys The lambda parameters, atoms.
+ * \param arity The number of \a keys.
+ */
+void act_enter(struct activation* act, size_t top, const sexp* keys,
+               size_t arity) {
+    frame_drop(act->base, top);
+    struct frame prev = frame_enter(act->base, keys, arity, act->mark);
+    if (!act->entered) {
+        act->prev = prev;
+        act->entered = true;
+    }
+}
+
+
+/*! \brief Undo the bindings and frames of an activation.
+ *
+ * \param act The activation.
+ */
+void act_end(struct activation* act) {
+    unbind(act->mark);
+    if (act->entered) {
+        frame_leave(act->prev);
+    }
+}
+
+
+/*! \brief Find the function a call refers to.
+ *
+ * TRoL replaces a function name by its value and evaluates the call
+ * again. This follows the names without building the new call.
+ *
+ * \param fn The head of a call.
+ * \return A built-in atom or a lambda or label expression. Null if
+ * \a fn names nothing, where TRoL would recurse forever.
+ */
+sexp lookup_fn(sexp fn) {
+    while (c_bool(atom(fn))) {
+        switch (atom_opcode(fn)) {
+        case OP_NONE:
+        case OP_LAMBDA:
+        case OP_LABEL:
+            break;
+        default:
+            return fn;
+        }
+        sexp value = lookup(fn);
+        if (c_bool(eq(value, fn))) {
+            return 0;
+        }
+        fn = value;
+    }
+    return fn;
+}
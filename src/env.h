@@ -0,0 +1,90 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENV_H
+#define ENV_H
+
+/*! \file env.h
+ */
+
+#include "cons.h"
+
+#include <stddef.h>
+
+/*! \brief An activation frame, see frame_enter().
+ */
+struct frame {
+    /*! Index of the first slot. */
+    size_t base;
+    /*! Number of parameters bound. */
+    size_t n;
+};
+
+/*! \brief The bindings and frames of one evaluation, see act_begin().
+ */
+struct activation {
+    /*! Depth of the binding stack at the start. */
+    size_t mark;
+    /*! First frame slot of the activation. */
+    size_t base;
+    /*! The frame to return to. */
+    struct frame prev;
+    /*! Whether a frame has been entered. */
+    bool entered;
+};
+
+/*! \brief The bindings at a fork, see env_fork().
+ */
+struct env_fork {
+    /*! The bindings of the thread that forked. */
+    struct env* env;
+    /*! The depth of its binding stack at the fork. */
+    size_t mark;
+    /*! While entered, the value cells put aside, see env_enter(). */
+    sexp* value;
+    size_t values;
+    /*! While entered, the depth of the binding stack before. */
+    size_t base;
+};
+
+sexp lookup(sexp key) ;
+sexp lookup_fn(sexp fn) ;
+void define(sexp key, sexp value) ;
+sexp globals_alist() ;
+size_t bind_mark() ;
+void bind(sexp key, sexp value) ;
+void rebind(size_t mark, sexp key, sexp value) ;
+void bind_pairs(sexp keys, sexp values) ;
+void bind_alist(sexp map) ;
+void unbind(size_t mark) ;
+void env_fork(struct env_fork* fork) ;
+void env_enter(struct env_fork* fork) ;
+void env_leave(struct env_fork* fork) ;
+size_t frame_mark() ;
+void frame_arg(sexp value) ;
+sexp frame_value(size_t i) ;
+struct frame frame_enter(size_t base, const sexp* keys, size_t arity,
+                         size_t mark) ;
+void frame_drop(size_t base, size_t top) ;
+void frame_leave(struct frame prev) ;
+sexp frame_ref(sexp ref) ;
+void act_begin(struct activation* act) ;
+void act_enter(struct activation* act, size_t top, const sexp* keys,
+               size_t arity) ;
+void act_end(struct activation* act) ;
+
+#endif
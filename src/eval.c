@@ -25,8 +25,18 @@
 #include "eval.h"
 
 #include "constants.h"
+#include "closure.h"
+#include "cons_impl.h"
+#include "env.h"
+#include "memo.h"
+#include "pool.h"
+#include "resolve.h"
+#include "stats.h"
 #include "utils.h"
 
+#include <stdlib.h>
+#include <time.h>
+
 
 /*! \mainpage
  *
@@ -72,6 +82,10 @@
  *
  * See TRoL for a description.
  *
+ * A top level (define name expr) also gives name a value for every
+ * later form, and (time expr) reports what expr cost, see
+ * eval_top().
+ *
  * \section s4 Notation
  *
  * The interpreter can parse both dot notation and list notation. The
@@ -82,12 +96,23 @@
  *
  * \section s5 Known Issues
  *
- * There is no garbage collection. Therefore, it leaks like a sieve.
+ * Garbage is only collected between top level forms, see gc_sexp()
+ * and region_end(). Everything allocated while evaluating a form
+ * stays in memory until the form is finished.
  *
  * There is no detection of cyclic data structures. Therefore, some
  * functions may find themselves evaluating an infinite recursion.
  * This could easily happen to equal(), for example.
  *
+ * \section s6 Parallel Evaluation
+ *
+ * There are no side effects, so the arguments of a call can be
+ * evaluated in any order, or at once. When pool_start() has started
+ * more than one thread, eval() forks arguments that call functions
+ * onto the pool, as long as there are at least two of them, see
+ * eval_fork(). Forks stop below pool_depth(), so the tasks stay big
+ * enough to be worth the move.
+ *
  * \section s7 Further Reading
  *
  * There are many excellent free resources available for studying
@@ -105,40 +130,312 @@
  */
 
 
-static sexp eval_cond(sexp e, sexp env) ;
-static sexp eval_list(sexp m, sexp env) ; 
+
+
+/*! \internal
+ * \brief Most arguments evaluated by one eval_fork().
+ */
+#define FORK_MAX 8
+
+
+/*! \internal
+ * \brief Number of forks the calling thread is nested in.
+ */
+static _Thread_local unsigned forks;
+
+
+/*! \internal
+ * \brief An argument evaluated by the pool.
+ */
+struct arg_task {
+    struct task task;
+    sexp expr;
+    /*! The bindings at the fork, for a thief. */
+    struct env_fork fork;
+    unsigned forks;
+    sexp value;
+};
+
 
 /*! \internal
- * \brief Eval function arguments.
+ * \brief Run an arg_task.
  *
- * \return List of argument values.
+ * A thief evaluates the argument in the bindings it was forked in,
+ * with no frame, since the REFs in it are for the forking thread's.
  */
-static sexp eval_list(sexp m, sexp env) {
-    if (c_bool(null(m))) {
-        return ATOM_NIL();
+static void arg_run(struct task* task, bool stolen) {
+    struct arg_task* a = (struct arg_task*)task;
+    unsigned outer = forks;
+    forks = a->forks;
+    if (stolen) {
+        env_enter(&a->fork);
+        struct frame prev = frame_enter(frame_mark(), 0, 0, bind_mark());
+        a->value = eval_expr(a->expr);
+        frame_leave(prev);
+        env_leave(&a->fork);
+    } else {
+        a->value = eval_expr(a->expr);
+    }
+    forks = outer;
+}
+
+
+/*! \internal
+ * \brief Test for an expression that calls a function.
+ *
+ * Only calls can take long. Everything else is a variable, a
+ * constant or a built-in.
+ */
+static bool is_call(sexp expr) {
+    if (c_bool(atom(expr))) {
+        return false;
+    }
+    sexp fn = car(expr);
+    return !c_bool(atom(fn)) || atom_opcode(fn) == OP_NONE;
+}
+
+
+/*! \internal
+ * \brief Test whether the first \a max elements of \a list are
+ * worth evaluating in parallel.
+ */
+static bool forkable(sexp list, size_t max) {
+    /* the pool only serves the default context */
+    if (forks >= pool_depth() || lisp_ctx_current()) {
+        return false;
+    }
+    size_t calls = 0;
+    size_t i = 0;
+    for (; i < max && !c_bool(atom(list)); list = cdr(list), ++i) {
+        calls += is_call(car(list));
+    }
+    return calls >= 2;
+}
+
+
+/*! \internal
+ * \brief Eval up to \a max elements of \a list in parallel.
+ *
+ * Every call but the last is forked onto the pool. The rest are
+ * evaluated here, then the forks are joined.
+ *
+ * \param list Expressions.
+ * \param max At most FORK_MAX.
+ * \param value Receives the value of each.
+ * \return The number evaluated.
+ */
+static size_t eval_fork(sexp list, size_t max, sexp* value) {
+    struct arg_task task[FORK_MAX];
+    sexp e[FORK_MAX];
+    size_t n = 0;
+    size_t i = 0;
+    size_t last = 0;
+    for (; n < max && !c_bool(atom(list)); list = cdr(list), ++n) {
+        e[n] = car(list);
+        if (is_call(e[n])) {
+            last = n;
+        }
+    }
+    ++forks;
+    for (i = 0; i < n; ++i) {
+        task[i].task.run = 0;
+        if (i != last && is_call(e[i])) {
+            task[i].task.run = arg_run;
+            task[i].expr = e[i];
+            task[i].forks = forks;
+            env_fork(&task[i].fork);
+            pool_fork(&task[i].task);
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        if (!task[i].task.run) {
+            value[i] = eval_expr(e[i]);
+        }
+    }
+    for (i = n; i > 0; --i) {
+        if (task[i - 1].task.run) {
+            pool_join(&task[i - 1].task);
+            value[i - 1] = task[i - 1].value;
+        }
+    }
+    --forks;
+    return n;
+}
+
+
+/*! \internal
+ * \brief Eval function arguments into the next frame.
+ *
+ * \return The base of the frame, for frame_enter().
+ */
+static size_t eval_args(sexp m) {
+    size_t base = frame_mark();
+    while (forkable(m, FORK_MAX)) {
+        sexp value[FORK_MAX];
+        size_t n = eval_fork(m, FORK_MAX, value);
+        size_t i = 0;
+        for (i = 0; i < n; ++i, m = cdr(m)) {
+            frame_arg(value[i]);
+        }
+    }
+    for (; !c_bool(atom(m)); m = cdr(m)) {
+        frame_arg(eval_expr(car(m)));
+    }
+    return base;
+}
+
+
+/*! \internal
+ * \brief Eval the two operands of eq or cons.
+ */
+static void eval_two(sexp args, sexp* value) {
+    if (forkable(args, 2)) {
+        eval_fork(args, 2, value);
+    } else {
+        value[0] = eval_expr(car(args));
+        value[1] = eval_expr(car(cdr(args)));
     }
-    return cons(eval(car(m), env), eval_list(cdr(m), env));
 }
 
 
 /*! \internal
  * \brief Eval cond arguments (short-circuit).
  *
- * \return Result of chosen expression. \c 'nil if no condition
- * was true.
+ * \return The chosen expression, which is left for the caller to
+ * evaluate. Null if no condition was true.
  *
  * \note Define a cond with no true cases to return nil as though cond
  * had a default \c 't like so: (cond (p1 e1) ... (pn en) ('t '()))
  * TRoL glosses over this case.
  */
-static sexp eval_cond(sexp e, sexp env) {
-    if(c_bool(null(e))) {
-        return ATOM_NIL();
+static sexp eval_cond(sexp e) {
+    for (; !c_bool(null(e)); e = cdr(e)) {
+        if(c_bool(eq(ATOM_T(),eval_expr(car(car(e)))))) {
+            return car(cdr(car(e)));
+        }
     }
-    if(c_bool(eq(ATOM_T(),eval(car(car(e)), env)))) {
-        return eval(car(cdr(car(e))), env);
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Interpret a lisp expression for eval_expr().
+ *
+ * Expressions in tail position, the chosen branch of a cond, the
+ * body of a lambda and the function of a call, are evaluated by
+ * looping rather than recursing. Their bindings are left to the
+ * caller to undo.
+ *
+ * Under dynamic scope a function called in tail position still
+ * sees the variables of its caller, so those bindings are kept.
+ * Only a parameter that is bound again, as in a loop, replaces its
+ * earlier binding, and then the old value is dead. So a tail
+ * recursive loop runs in constant space.
+ */
+static sexp eval_tail(sexp expr, struct activation* act) {
+    for (;;) {
+        if(SEXP_TYPE(expr) == REF) {
+            STAT_ADD(STAT_FORMS + OP_NONE, 1);
+            return frame_ref(expr);
+        }
+        if(c_bool(atom(expr))) {
+            STAT_ADD(STAT_FORMS + OP_NONE, 1);
+            return lookup(expr);
+        }
+        sexp fn = lookup_fn(car(expr));
+        sexp args = cdr(expr);
+        if(!fn) {
+            return ATOM_NIL();
+        }
+        if(c_bool(atom(fn))) {
+            STAT_ADD(STAT_FORMS + atom_opcode(fn), 1);
+            switch(atom_opcode(fn)) {
+            case OP_QUOTE:
+                return car(args);
+            case OP_ATOM:
+                return atom(eval_expr(car(args)));
+            case OP_EQ: {
+                sexp v[2];
+                eval_two(args, v);
+                return eq(v[0], v[1]);
+            }
+            case OP_CAR:
+                return car(eval_expr(car(args)));
+            case OP_CDR:
+                return cdr(eval_expr(car(args)));
+            case OP_CONS: {
+                sexp v[2];
+                eval_two(args, v);
+                return cons(v[0], v[1]);
+            }
+            case OP_COND:
+                expr = eval_cond(args);
+                if(!expr) {
+                    return ATOM_NIL();
+                }
+                continue;
+            default:
+                return ATOM_NIL();
+            }
+        }
+        switch(atom_opcode(car(fn))) {
+        case OP_LABEL:
+            STAT_ADD(STAT_FORMS + OP_LABEL, 1);
+            /* Compare to TRoL */
+            rebind(act->mark, car(cdr(fn)), car(cdr(cdr(fn))));
+            /* the name may shadow a slot of the current frame */
+            act_enter(act, frame_mark(), 0, 0);
+            expr = cons(car(cdr(cdr(fn))), args);
+            continue;
+        case OP_LAMBDA: {
+            STAT_ADD(STAT_FORMS + OP_LAMBDA, 1);
+            size_t top = eval_args(args);
+            const struct closure* f = closure_of(fn);
+            if(!f) {
+                act_enter(act, top, 0, 0);
+                return ATOM_NIL();
+            }
+            if(memo_wants(f, fn, top)) {
+                /* a miss gets the result of this activation */
+                sexp r = memo_get(fn, top);
+                if(r) {
+                    frame_drop(top, frame_mark());
+                    return r;
+                }
+            }
+            act_enter(act, top, f->params, f->arity);
+            expr = f->body;
+            continue;
+        }
+        default:
+            return ATOM_NIL();
+        }
     }
-    return eval_cond(cdr(e), env);
+}
+
+
+/*! \brief Interpret a lisp expression in the current bindings.
+ *
+ * Variables are looked up with lookup(), or fetched from the frame
+ * if resolve() has tied them to one. A lambda binds its parameters
+ * with frame_enter() for the duration of its body, which is
+ * equivalent to prepending them to the env association list.
+ *
+ * Other engines use this for forms they do not handle themselves.
+ *
+ * \param expr Lisp expression, normally passed through resolve().
+ * \return Result of evaluation.
+ */
+sexp eval_expr(sexp expr) {
+    size_t memos = memo_mark();
+    struct activation act;
+    STAT_ENTER();
+    act_begin(&act);
+    sexp r = eval_tail(expr, &act);
+    act_end(&act);
+    STAT_LEAVE();
+    memo_done(memos, r);
+    return r;
 }
 
 
@@ -155,55 +452,78 @@ static sexp eval_cond(sexp e, sexp env) {
  * \note TRoL adds the entire label expression to the env,
  * I don't know why. This implementation only adds the lambda
  * part.
+ *
+ * \note The variables in \a env are bound with bind_alist() for the
+ * duration of the call rather than passed around, see env.c.
+ * \a expr is passed through resolve() first.
  */
 sexp eval(sexp expr, sexp env) {
-    if(c_bool(atom(expr))) {
-        return assoc(expr,env);
+    size_t mark = bind_mark();
+    bind_alist(env);
+    struct frame prev = frame_enter(frame_mark(), 0, 0, mark);
+    sexp r = eval_expr(resolve(expr));
+    unbind(mark);
+    frame_leave(prev);
+    return r;
+}
+
+
+/*! \internal
+ * \brief Test for a form headed by the atom \a head.
+ */
+static bool top_form(sexp expr, sexp head) {
+    return !c_bool(atom(expr)) && c_bool(eq(car(expr), head));
+}
+
+
+/*! \brief Interpret a top level form.
+ *
+ * Same as \a run (\a expr, \a env), except for a form
+ * (define name expr): it evaluates expr with \a run and makes the
+ * result the global value of name, see define(). A lambda or label
+ * expression is not evaluated, it becomes the value as it is, so
+ * (define f (lambda ...)) works like (label f (lambda ...)). The
+ * definition is seen by every later form, after its own bindings,
+ * so a library of functions only needs to be read once. Anywhere
+ * else define is an ordinary name, which a program may bind.
+ *
+ * A form (time expr) is the same as expr, but also reports the wall
+ * time it took, with what it counted, see stats_time(). Only the
+ * top level understands time; anywhere else it is an ordinary name,
+ * as define is.
+ *
+ * \param run The engine.
+ * \param expr Lisp expression.
+ * \param env Dictionary of variables in scope.
+ * \return Result of evaluation, name for a definition.
+ */
+sexp eval_top(engine run, sexp expr, sexp env) {
+    if (top_form(expr, ATOM_TIME()) && !c_bool(atom(cdr(expr)))) {
+        struct lisp_stats before;
+        struct timespec start;
+        struct timespec end;
+        STAT_ADD(STAT_TIMES, 1);
+        stats_get(&before);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sexp r = eval_top(run, car(cdr(expr)), env);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats_time(end.tv_sec - start.tv_sec
+            + 1e-9 * (end.tv_nsec - start.tv_nsec), &before);
+        return r;
     }
-    if(c_bool(atom(car(expr)))) {
-        if(c_bool(eq(car(expr),ATOM_QUOTE()))) {
-            return car(cdr(expr));
-        }
-        if(c_bool(eq(car(expr),ATOM_ATOM()))) {
-            return atom(eval(car(cdr(expr)),env));
-        }
-        if(c_bool(eq(car(expr),ATOM_EQ()))) {
-            return eq(
-                eval(car(cdr(expr)),env),
-                eval(car(cdr(cdr(expr))),env) );
+    if (top_form(expr, ATOM_DEFINE())
+            && !c_bool(atom(cdr(expr))) && !c_bool(atom(cdr(cdr(expr))))
+            && SEXP_TYPE(car(cdr(expr))) == ATOM) {
+        sexp name = car(cdr(expr));
+        sexp value = car(cdr(cdr(expr)));
+        /* a function is bound as it is, as label does */
+        if (c_bool(atom(value)) || (atom_opcode(car(value)) != OP_LAMBDA
+                && atom_opcode(car(value)) != OP_LABEL)) {
+            value = run(value, env);
         }
-        if(c_bool(eq(car(expr),ATOM_CAR()))) {
-            return car(eval(car(cdr(expr)),env));
-        }
-        if(c_bool(eq(car(expr),ATOM_CDR()))) {
-            return cdr(eval(car(cdr(expr)),env));
-        }
-        if(c_bool(eq(car(expr),ATOM_CONS()))) {
-            return cons(
-                eval(car(cdr(expr)),env),
-                eval(car(cdr(cdr(expr))),env));
-        }
-        if(c_bool(eq(car(expr),ATOM_COND()))) {
-            return eval_cond(cdr(expr),env);
-        }
-        return eval(cons(assoc(car(expr), env), cdr(expr)), env);
-    }
-    if(c_bool(eq(car(car(expr)),ATOM_LABEL()))) {
-        /* Compare to TRoL */
-        sexp entry = cons(car(cdr(car(expr))),
-                car(cdr(cdr(car(expr)))));
-        return eval(
-            cons(car(cdr(cdr(car(expr)))),cdr(expr)),
-            cons(entry,env));
-    }
-    if(c_bool(eq(car(car(expr)),ATOM_LAMBDA()))) {
-        return eval(
-            car(cdr(cdr(car(expr)))),
-            append(
-                pair(
-                    car(cdr(car(expr))),
-                    eval_list(cdr(expr), env)),
-                env));
+        define(name, value);
+        STAT_ADD(STAT_DEFINES, 1);
+        return name;
     }
-    return ATOM_NIL();
+    return run(expr, env);
 }
@@ -24,6 +24,12 @@
 #include "cons.h"
 
 
+/*! \brief An interpreter, such as eval() or eval_cek().
+ */
+typedef sexp (*engine)(sexp expr, sexp env);
+
 sexp eval(sexp expr, sexp env);
+sexp eval_expr(sexp expr);
+sexp eval_top(engine run, sexp expr, sexp env);
 
 #endif
\ No newline at end of file
@@ -20,13 +20,194 @@
  * \brief Interactive lisp interpreter.
  */
 
+#include "cek.h"
+#include "cons_impl.h"
 #include "constants.h"
+#include "env.h"
 #include "eval.h"
+#include "memo.h"
 #include "parser.h"
+#include "pool.h"
+#include "reader.h"
+#include "stats.h"
+#include "vm.h"
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+
+/*! \internal
+ * \brief Forms run at once per thread by run_jobs().
+ */
+#define JOBS_BATCH 16
+
+
+/*! \internal
+ * \brief Test for (quit).
+ */
+static bool is_quit(sexp e) {
+    return !c_bool(atom(e)) && c_bool(eq(car(e), symbol("quit", 4)))
+        && c_bool(eq(cdr(e), ATOM_NIL()));
+}
+
+
+/*! \internal
+ * \brief Evaluate and print every form \a in reads.
+ *
+ * \param name The program name, for errors.
+ * \param in The source.
+ * \param out Where the results go.
+ * \param run The engine.
+ * \param env The variables, updated as collection moves them.
+ * \param interactive Whether to prompt, and flush after each form.
+ * \return \c false if (quit) was read.
+ */
+static bool run_forms(const char* name, struct reader* in,
+                      struct sink* out, engine run, sexp* env,
+                      bool interactive) {
+    const char* prompt = "> ";
+    bool more = true;
+
+    if (interactive) {
+        sink_write(out, prompt, strlen(prompt));
+        sink_flush(out); fflush(0);
+    }
+    region_begin();
+    while (true) {
+        sexp e = reader_next(in);
+        if (!e) { break; }
+        if (is_quit(e)) {
+            more = false;
+            break;
+        }
+        sexp r = eval_top(run, e, *env);
+        print_list(out, r);
+        sink_write(out, "\n", 1);
+        /* everything but env died with the form */
+        *env = region_end(*env);
+        region_begin();
+        if (interactive) {
+            sink_write(out, prompt, strlen(prompt));
+            sink_flush(out); fflush(0);
+        }
+    }
+    *env = region_end(*env);
+    if (in->error) {
+        sink_flush(out); fflush(0);
+        fprintf(stderr, "%s: %s\n", name, in->error);
+    }
+    return more;
+}
+
+
+/*! \internal
+ * \brief A top level form run by the pool.
+ */
+struct form_task {
+    struct task task;
+    sexp expr;
+    engine run;
+    sexp env;
+    /*! The printed result. */
+    struct sink out;
+};
+
+
+/*! \internal
+ * \brief Run a form_task.
+ *
+ * Nothing forks while run_jobs() is in charge, so no thread takes a
+ * form while it is in the middle of another, and every form starts
+ * from no bindings wherever it runs.
+ */
+static void form_run(struct task* task, bool stolen) {
+    struct form_task* f = (struct form_task*)task;
+    (void)stolen;
+    sexp r = f->run(f->expr, f->env);
+    print_list(&f->out, r);
+    sink_write(&f->out, "\n", 1);
+}
+
+
+/*! \internal
+ * \brief Evaluate and print every form \a in reads, on the pool.
+ *
+ * Same as run_forms() without a prompt, but the forms are read in
+ * batches, and the forms of a batch are forked onto the pool at
+ * once. Each result is printed to a buffer of its own, and the
+ * buffers are written out in the order the forms were read once the
+ * whole batch is done. A definition, or (quit), ends the batch
+ * early, and is run by itself, since the forms after it may depend
+ * on it. So does (time expr), so it is not charged for other forms.
+ *
+ * A batch is one region, so its garbage is collected when it is
+ * done, while the other threads are idle.
+ *
+ * \param name The program name, for errors.
+ * \param in The source.
+ * \param out Where the results go.
+ * \param run The engine.
+ * \param env The variables, updated as collection moves them.
+ * \return \c false if (quit) was read.
+ */
+static bool run_jobs(const char* name, struct reader* in,
+                     struct sink* out, engine run, sexp* env) {
+    size_t max = JOBS_BATCH * pool_size();
+    struct form_task* f = malloc(max * sizeof *f);
+    bool more = true;
+    bool eof = false;
+    size_t i = 0;
+
+    while (more && !eof) {
+        size_t n = 0;
+        sexp barrier = 0;
+        region_begin();
+        while (n < max) {
+            sexp e = reader_next(in);
+            if (!e) {
+                eof = true;
+                break;
+            }
+            if (is_quit(e) || (!c_bool(atom(e))
+                    && (c_bool(eq(car(e), ATOM_DEFINE()))
+                        || c_bool(eq(car(e), ATOM_TIME()))))) {
+                barrier = e;
+                break;
+            }
+            f[n].task.run = form_run;
+            f[n].expr = e;
+            f[n].run = run;
+            f[n].env = *env;
+            sink_buffer(&f[n].out);
+            pool_fork(&f[n].task);
+            ++n;
+        }
+        /* joins go in the reverse order of the forks */
+        for (i = n; i > 0; --i) {
+            pool_join(&f[i - 1].task);
+        }
+        for (i = 0; i < n; ++i) {
+            sink_write(out, f[i].out.buf, f[i].out.len);
+            sink_close(&f[i].out);
+        }
+        if (barrier && is_quit(barrier)) {
+            more = false;
+        } else if (barrier) {
+            print_list(out, eval_top(run, barrier, *env));
+            sink_write(out, "\n", 1);
+        }
+        *env = region_end(*env);
+    }
+    free(f);
+    if (in->error) {
+        sink_flush(out); fflush(0);
+        fprintf(stderr, "%s: %s\n", name, in->error);
+    }
+    return more;
+}
 
 
 /*!
@@ -85,37 +266,167 @@
  * Lisp may also be read from a file, for example:
  *
  * \code
- * ./lisp < ../test/sample.lisp
+ * ./lisp ../test/sample.lisp
  * \endcode
  *
+ * Files named on the command line are mapped into memory and run in
+ * order, see reader_map(). Expressions may span lines and be of any
+ * length, see reader.c. There is no prompt unless standard input is
+ * a terminal, and output is only flushed after each result when it
+ * is. Results are printed in full, however long, see print_list().
+ *
+ * The option --engine=cek selects eval_cek(), which can recurse as
+ * deep as memory allows, instead of eval(). The option --engine=vm
+ * selects eval_vm(), which compiles to bytecode. The option
+ * --memo=N makes eval() remember up to N results of pure label
+ * functions, see memo.c. The option --hashcons shares equal cells,
+ * see hash_cons(). Only eval() memoizes, so --memo cannot be used
+ * with another engine. The option --threads=N lets eval() evaluate
+ * arguments on N threads, see pool.c. It cannot be combined with
+ * --memo or --hashcons, whose tables are not shared safely.
+ *
+ * The option --jobs=N runs the top level forms of files, or of
+ * standard input when it is not a terminal, N at a time rather than
+ * the arguments of calls, see run_jobs(). The results are printed
+ * in the order of the forms all the same. It has the same
+ * restrictions as --threads, and the two cannot be combined.
+ *
+ * A top level (define name expr) gives name the value of expr in
+ * every later form, see eval_top(). The option --dump=FILE writes
+ * the definitions to a heap image once the input has been run, and
+ * --image=FILE starts from the definitions in such an image rather
+ * than from nothing, see image_dump() and image_load().
+ *
+ * The option --stats prints a summary of what was evaluated and
+ * allocated to stderr at exit, see stats_print(). A top level
+ * (time expr) prints the same for one form. The counts are only
+ * kept when built with LISP_STATS, see stats.c; otherwise only
+ * times and collections are printed.
+ *
  * \param argc Argument count.
  * \param argv Vector of argument strings.
  * \return Process error code.
  *
- * \sa parse(), eval(), print_list_notation()
+ * \sa parse(), eval(), print_list()
  */
 int main(int argc, char* argv[]) {
-    sexp env = ATOM_NIL();
-    char in_str[1000] = "";
-    char out_str[1000] = "";
-    const char* prompt = "> ";
-    const char* quit = "(quit)\n";
-    const char* p = &in_str[0];
+    engine run = eval;
+    bool memo = false;
+    unsigned long threads = 1;
+    unsigned long jobs = 1;
+    bool shared = false;
+    const char* image = 0;
+    const char* dump = 0;
+    bool stats = false;
+    int files = 0;
+    int i = 0;
+    for (i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--engine=eval")) {
+            run = eval;
+        } else if (0 == strcmp(argv[i], "--engine=cek")) {
+            run = eval_cek;
+        } else if (0 == strcmp(argv[i], "--engine=vm")) {
+            run = eval_vm;
+        } else if (0 == strncmp(argv[i], "--memo=", 7)) {
+            memo_limit(strtoul(argv[i] + 7, 0, 10));
+            memo = true;
+            shared = true;
+        } else if (0 == strcmp(argv[i], "--hashcons")) {
+            hash_cons(true);
+            shared = true;
+        } else if (0 == strncmp(argv[i], "--threads=", 10)) {
+            threads = strtoul(argv[i] + 10, 0, 10);
+        } else if (0 == strncmp(argv[i], "--jobs=", 7)) {
+            jobs = strtoul(argv[i] + 7, 0, 10);
+        } else if (0 == strncmp(argv[i], "--image=", 8)) {
+            image = argv[i] + 8;
+        } else if (0 == strncmp(argv[i], "--dump=", 7)) {
+            dump = argv[i] + 7;
+        } else if (0 == strcmp(argv[i], "--stats")) {
+            stats = true;
+        } else if (0 != strncmp(argv[i], "--", 2)) {
+            ++files;
+        } else {
+            fprintf(stderr, "usage: %s [--engine=eval|cek|vm] [--memo=N]"
+                " [--hashcons] [--threads=N] [--jobs=N] [--image=FILE]"
+                " [--dump=FILE] [--stats]"
+                " [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((threads > 1 || jobs > 1) && shared) {
+        fprintf(stderr, "%s: --threads and --jobs cannot be used with"
+            " --memo or --hashcons\n", argv[0]);
+        return 1;
+    }
+    if (memo && run != eval) {
+        fprintf(stderr, "%s: --memo can only be used with --engine=eval\n",
+            argv[0]);
+        return 1;
+    }
+    if (threads > 1 && jobs > 1) {
+        fprintf(stderr, "%s: --threads cannot be used with --jobs\n",
+            argv[0]);
+        return 1;
+    }
+    if (jobs > 1) {
+        pool_start(jobs);
+        pool_limit(0);
+    } else {
+        pool_start(threads);
+    }
 
-    printf("%s", prompt); fflush(0);
-    while (true) {
-        const char* s = fgets(p, sizeof(in_str)/sizeof(char)-(p-&in_str[0]), stdin);
-	if (!s) { break; }
-	p = &in_str[0];
-        if (0 == strcmp(p, quit)) { break; }
-        sexp e = parse(&p);
-        if (e) {
-	    p = &in_str[0];
-            sexp r = eval(e, env);
-            print_list_notation(out_str, sizeof(out_str)/sizeof(char), r);
-            printf("%s\n", out_str); fflush(0);
-            printf("%s", prompt); fflush(0);
+    sexp env = ATOM_NIL();
+    if (image) {
+        sexp defs = image_load(image);
+        if (!defs) {
+            fprintf(stderr, "%s: cannot load image %s\n", argv[0], image);
+            return 1;
+        }
+        for (; !c_bool(atom(defs)); defs = cdr(defs)) {
+            define(car(car(defs)), cdr(car(defs)));
+        }
+    }
+    struct reader in;
+    struct sink out;
+    sink_file(&out, stdout);
+    if (files) {
+        for (i = 1; i < argc; ++i) {
+            if (0 == strncmp(argv[i], "--", 2)) { continue; }
+            if (!reader_map(&in, argv[i])) {
+                sink_close(&out);
+                fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+                return 1;
+            }
+            bool more = jobs > 1
+                ? run_jobs(argv[0], &in, &out, run, &env)
+                : run_forms(argv[0], &in, &out, run, &env, false);
+            reader_close(&in);
+            if (!more) { break; }
         }
+    } else {
+        reader_file(&in, stdin);
+        if (jobs > 1 && !isatty(fileno(stdin))) {
+            run_jobs(argv[0], &in, &out, run, &env);
+        } else {
+            run_forms(argv[0], &in, &out, run, &env,
+                isatty(fileno(stdin)));
+        }
+        reader_close(&in);
+    }
+    sink_close(&out);
+    /* the results go out before the summary on stderr */
+    fflush(stdout);
+    if (stats) {
+        struct sink err;
+        sink_file(&err, stderr);
+        stats_print(&err);
+        sink_close(&err);
+    }
+
+    if (dump && !image_dump(dump, globals_alist())) {
+        fprintf(stderr, "%s: cannot write image %s\n", argv[0], dump);
+        return 1;
     }
     return 0;
 }
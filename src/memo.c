@@ -0,0 +1,374 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file memo.c
+ *
+ * \brief Memoization of label functions.
+ *
+ * There is no mutation in this lisp, so a function whose result can
+ * only depend on its arguments may be answered from a table of
+ * earlier calls. closure_of() finds the lambdas that qualify: their
+ * bodies refer to nothing but their parameters, names they bind
+ * themselves, and the label name they are called by. Scoping is
+ * dynamic, so that last one is checked at every call, see
+ * memo_wants().
+ *
+ * Arguments are compared by identity, which makes a lookup cheap
+ * and is exact for atoms. The table holds at most a set number of
+ * entries, and drops the least recently used one to make room. It
+ * is off until memo_limit() is called, and emptied before each
+ * collection since its keys move. Each context has a table of its
+ * own, see lisp_ctx_data().
+ */
+
+#include "memo.h"
+
+#include "cons_impl.h"
+#include "env.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief A memoized call.
+ *
+ * Entries are chained in a hash bucket by \c chain and kept in order
+ * of use by \c newer and \c older. Links are entry numbers plus
+ * one, 0 ends a list.
+ */
+struct entry {
+    sexp lambda;
+    sexp value;
+    sexp* args;
+    size_t n;
+    size_t hash;
+    size_t chain;
+    size_t newer;
+    size_t older;
+};
+
+
+/*! \internal
+ * \brief A call being evaluated, whose entry is made by memo_done().
+ */
+struct pending {
+    sexp lambda;
+    sexp* args;
+    size_t n;
+    size_t hash;
+};
+
+
+/*! \internal
+ * \brief The table.
+ *
+ * bucket has limit entries, a power of two. newest and oldest are
+ * the ends of the use order.
+ */
+struct memo {
+    size_t limit;
+    struct entry* entry;
+    size_t* bucket;
+    size_t buckets;
+    size_t n;
+    size_t newest;
+    size_t oldest;
+    struct pending* pending;
+    size_t pendings;
+    size_t pending_cap;
+    struct memo_stats stats;
+};
+
+
+/*! \internal
+ * \brief The table of contexts that have not called memo_limit().
+ *
+ * Memoization is off in it, so it is never written.
+ */
+static struct memo off;
+
+
+/*! \internal
+ * \brief Get the table of the current context.
+ */
+static struct memo* table() {
+    struct memo* m = *lisp_ctx_data(CTX_MEMO);
+    return m ? m : &off;
+}
+
+
+/*! \internal
+ * \brief Hash of the call of \a lambda with the arguments in the
+ * slots from \a top.
+ */
+static size_t memo_hash(sexp lambda, size_t top) {
+    size_t h = (uintptr_t)lambda >> 4;
+    size_t i = top;
+    for (; i < frame_mark(); ++i) {
+        h = h * 31 + ((uintptr_t)frame_value(i) >> 3);
+    }
+    return h;
+}
+
+
+/*! \internal
+ * \brief Unlink entry \a e from the use order.
+ */
+static void memo_unlink(size_t e) {
+    struct memo* m = table();
+    struct entry* p = &m->entry[e - 1];
+    if (p->newer) { m->entry[p->newer - 1].older = p->older; }
+    else { m->newest = p->older; }
+    if (p->older) { m->entry[p->older - 1].newer = p->newer; }
+    else { m->oldest = p->newer; }
+}
+
+
+/*! \internal
+ * \brief Make entry \a e the most recently used.
+ */
+static void memo_touch(size_t e) {
+    struct memo* m = table();
+    struct entry* p = &m->entry[e - 1];
+    p->newer = 0;
+    p->older = m->newest;
+    if (m->newest) { m->entry[m->newest - 1].newer = e; }
+    m->newest = e;
+    if (!m->oldest) { m->oldest = e; }
+}
+
+
+/*! \internal
+ * \brief Forget every entry, and every call waiting for its result.
+ */
+static void memo_clear() {
+    struct memo* m = table();
+    size_t i = 0;
+    for (i = 0; i < m->n; ++i) {
+        free(m->entry[i].args);
+    }
+    for (i = 0; i < m->pendings; ++i) {
+        m->pending[i].lambda = 0;
+    }
+    for (i = 0; i < m->buckets; ++i) {
+        m->bucket[i] = 0;
+    }
+    m->n = 0;
+    m->newest = 0;
+    m->oldest = 0;
+}
+
+
+/*! \internal
+ * \brief Free the table of the context being destroyed.
+ */
+static void memo_free() {
+    struct memo* m = table();
+    memo_clear();
+    free(m->entry);
+    free(m->bucket);
+    free(m->pending);
+    free(m);
+}
+
+
+/*! \brief Turn memoization on or off in the current context.
+ *
+ * The table starts empty, with its statistics zeroed.
+ *
+ * \param limit The most entries to keep, 0 for off.
+ */
+void memo_limit(size_t limit) {
+    struct memo** data = (struct memo**)lisp_ctx_data(CTX_MEMO);
+    if (!*data) {
+        *data = calloc(1, sizeof **data);
+        gc_hook(memo_clear);
+        lisp_ctx_hook(memo_free);
+    }
+    struct memo* m = *data;
+    memo_clear();
+    free(m->entry);
+    free(m->bucket);
+    m->limit = limit;
+    m->stats = (struct memo_stats){0, 0, 0, 0};
+    m->buckets = limit ? 1 : 0;
+    while (m->buckets < limit) {
+        m->buckets *= 2;
+    }
+    m->entry = limit ? malloc(limit * sizeof *m->entry) : 0;
+    m->bucket = limit ? calloc(m->buckets, sizeof *m->bucket) : 0;
+}
+
+
+/*! \brief Test whether a call should go through the table.
+ *
+ * \param f The closure of \a lambda.
+ * \param lambda The lambda being called.
+ * \param top The first argument slot.
+ * \return \c true if memoization is on, \a f is pure, every
+ * parameter gets an argument, and \a lambda is bound to the name
+ * it refers to itself by.
+ */
+bool memo_wants(const struct closure* f, sexp lambda, size_t top) {
+    struct memo* m = table();
+    return m->limit && f->pure && f->self
+        && frame_mark() - top >= f->arity && lookup(f->self) == lambda;
+}
+
+
+/*! \brief Look up a call.
+ *
+ * On a miss the call is remembered until its result is passed to
+ * memo_done().
+ *
+ * \param lambda The lambda being called.
+ * \param top The first argument slot, the arguments are the slots
+ * from there to frame_mark().
+ * \return The result of an earlier identical call, null if none.
+ */
+sexp memo_get(sexp lambda, size_t top) {
+    struct memo* m = table();
+    size_t n = frame_mark() - top;
+    size_t hash = memo_hash(lambda, top);
+    size_t e = m->bucket[hash & (m->buckets - 1)];
+    size_t i = 0;
+    for (; e; e = m->entry[e - 1].chain) {
+        struct entry* p = &m->entry[e - 1];
+        if (p->hash != hash || p->lambda != lambda || p->n != n) {
+            continue;
+        }
+        for (i = 0; i < n && p->args[i] == frame_value(top + i); ++i) {
+        }
+        if (i == n) {
+            memo_unlink(e);
+            memo_touch(e);
+            ++m->stats.hits;
+            return p->value;
+        }
+    }
+    ++m->stats.misses;
+    if (m->pendings == m->pending_cap) {
+        m->pending_cap = m->pending_cap ? 2 * m->pending_cap : 64;
+        m->pending = realloc(m->pending,
+            m->pending_cap * sizeof *m->pending);
+    }
+    struct pending* c = &m->pending[m->pendings++];
+    c->lambda = lambda;
+    c->n = n;
+    c->hash = hash;
+    c->args = malloc(n * sizeof *c->args);
+    for (i = 0; i < n; ++i) {
+        c->args[i] = frame_value(top + i);
+    }
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Remove entry \a e, moving the last entry into its place.
+ */
+static void memo_remove(size_t e) {
+    struct memo* m = table();
+    struct entry* p = &m->entry[e - 1];
+    size_t* link = &m->bucket[p->hash & (m->buckets - 1)];
+    while (*link != e) { link = &m->entry[*link - 1].chain; }
+    *link = p->chain;
+    memo_unlink(e);
+    free(p->args);
+
+    size_t last = m->n--;
+    if (last == e) {
+        return;
+    }
+    struct entry* q = &m->entry[last - 1];
+    link = &m->bucket[q->hash & (m->buckets - 1)];
+    while (*link != last) { link = &m->entry[*link - 1].chain; }
+    *link = e;
+    if (q->newer) { m->entry[q->newer - 1].older = e; }
+    else { m->newest = e; }
+    if (q->older) { m->entry[q->older - 1].newer = e; }
+    else { m->oldest = e; }
+    *p = *q;
+}
+
+
+/*! \internal
+ * \brief Enter the result of the innermost call missed by memo_get().
+ */
+static void memo_put(sexp value) {
+    struct memo* m = table();
+    struct pending c = m->pending[--m->pendings];
+    if (!c.lambda) {
+        free(c.args);
+        return;
+    }
+    if (m->n == m->limit) {
+        memo_remove(m->oldest);
+        ++m->stats.evictions;
+    }
+    size_t e = ++m->n;
+    struct entry* p = &m->entry[e - 1];
+    p->lambda = c.lambda;
+    p->value = value;
+    p->args = c.args;
+    p->n = c.n;
+    p->hash = c.hash;
+    size_t* bucket = &m->bucket[c.hash & (m->buckets - 1)];
+    p->chain = *bucket;
+    *bucket = e;
+    memo_touch(e);
+}
+
+
+/*! \brief Get the number of calls waiting for their result.
+ *
+ * \return A mark to pass to memo_done().
+ */
+size_t memo_mark() {
+    struct memo* m = table();
+    return m->pendings;
+}
+
+
+/*! \brief Enter the results of calls missed by memo_get().
+ *
+ * Every call missed since \a mark gets \a value as its result. A
+ * call in tail position has the same result as the caller, so an
+ * evaluation that made a chain of tail calls enters them all at
+ * once, at the end.
+ *
+ * \param mark A mark from memo_mark().
+ * \param value The result.
+ */
+void memo_done(size_t mark, sexp value) {
+    struct memo* m = table();
+    while (m->pendings > mark) {
+        memo_put(value);
+    }
+}
+
+
+/*! \brief Get memo table statistics.
+ *
+ * \param stats Where to put the numbers.
+ */
+void memo_stats(struct memo_stats* stats) {
+    struct memo* m = table();
+    *stats = m->stats;
+    stats->size = m->n;
+}
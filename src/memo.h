@@ -0,0 +1,49 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMO_H
+#define MEMO_H
+
+/*! \file memo.h
+ */
+
+#include "cons.h"
+#include "closure.h"
+
+#include <stddef.h>
+
+/*! \brief Memo table statistics, see memo_stats().
+ */
+struct memo_stats {
+    /*! Calls answered from the table. */
+    unsigned long hits;
+    /*! Calls that were evaluated and entered. */
+    unsigned long misses;
+    /*! Entries dropped to stay within the limit. */
+    unsigned long evictions;
+    /*! Entries in the table. */
+    size_t size;
+};
+
+void memo_limit(size_t limit) ;
+bool memo_wants(const struct closure* f, sexp lambda, size_t top) ;
+sexp memo_get(sexp lambda, size_t top) ;
+size_t memo_mark() ;
+void memo_done(size_t mark, sexp value) ;
+void memo_stats(struct memo_stats* stats) ;
+
+#endif
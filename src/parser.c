@@ -20,82 +20,209 @@
  * \brief Reading and printing expressions.
  *
  * This module defines methods for converting a C string to an ::sexp,
- * and converting an ::sexp to a C string. Printing and reading dot
- * notation and list notation are supported.
+ * and converting an ::sexp to text. Printing and reading dot
+ * notation and list notation are supported. Text is printed to a
+ * sink: a stream, a growable buffer, or a fixed buffer.
  */
 
 #include "parser.h"
 
+#include "cons_impl.h"
 #include "constants.h"
+#include "scan.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 static sexp parse_atom(const char** p);
-static sexp parse_cons(const char** p);
-static sexp parse_list(const char** p);
-static sexp parse_list_elem(const char** p);
-static sexp parse_quote(const char** p);
 static void parse_ws(const char** p);
-static int print_list_notation_rest(char* str, size_t len, sexp p);
 
 
-/*! \brief Print an expression in dot notation.
+/*! \internal
+ * \brief Size of the buffer of a sink on a stream.
+ */
+#define SINK_BUFFER 65536
+
+
+/*! \brief Write to a stream.
  *
- * Dot notation uses a dot between the members of a cons pair. A cons
- * is written with parentheses around it. For example: (a . (b . c)).
+ * Output is collected in a buffer of the sink's own, and passed on
+ * by sink_flush().
  *
- * \param str Buffer.
- * \param len Storage capacity of \a str.
- * \param expr Arbitrary lisp expression.
- * \return Same as snprintf().
+ * \param s The sink.
+ * \param file The stream.
  */
-int print_dot_notation(char* str, size_t len, sexp expr) {
-    size_t r = 0;
-    if (expr) {
-        if (c_bool(atom(expr)) && c_str(expr)) {
-            return snprintf(str, len, "%s", c_str(expr));
+void sink_file(struct sink* s, FILE* file) {
+    s->file = file;
+    s->cap = SINK_BUFFER;
+    s->buf = malloc(s->cap);
+    s->len = 0;
+    s->grow = false;
+}
+
+
+/*! \brief Write to a growable buffer.
+ *
+ * The text is in \c buf, '\\0' terminated, and \c len long.
+ *
+ * \param s The sink.
+ */
+void sink_buffer(struct sink* s) {
+    s->file = 0;
+    s->cap = 256;
+    s->buf = malloc(s->cap);
+    s->buf[0] = '\0';
+    s->len = 0;
+    s->grow = true;
+}
+
+
+/*! \internal
+ * \brief Write to the fixed buffer \a str of \a len bytes.
+ *
+ * What does not fit is counted in \c len but dropped, as by
+ * snprintf().
+ */
+static void sink_fixed(struct sink* s, char* str, size_t len) {
+    s->file = 0;
+    s->buf = str;
+    s->cap = len;
+    s->len = 0;
+    s->grow = false;
+}
+
+
+/*! \brief Pass the buffered output of a stream sink to its stream.
+ *
+ * \param s The sink.
+ */
+void sink_flush(struct sink* s) {
+    if (s->file && s->len) {
+        fwrite(s->buf, 1, s->len, s->file);
+        s->len = 0;
+    }
+}
+
+
+/*! \brief Flush \a s and free its buffer.
+ *
+ * \param s The sink.
+ */
+void sink_close(struct sink* s) {
+    sink_flush(s);
+    free(s->buf);
+    s->buf = 0;
+}
+
+
+/*! \brief Write \a n bytes of \a str.
+ *
+ * \param s The sink.
+ * \param str Text.
+ * \param n Length of \a str.
+ */
+void sink_write(struct sink* s, const char* str, size_t n) {
+    if (s->len + n >= s->cap) {
+        if (s->file) {
+            sink_flush(s);
+            if (n >= s->cap) {
+                fwrite(str, 1, n, s->file);
+                return;
+            }
+        } else if (s->grow) {
+            while (s->len + n >= s->cap) {
+                s->cap *= 2;
+            }
+            s->buf = realloc(s->buf, s->cap);
         } else {
-            if ( r >= len ) { return r; }
-            r += snprintf(str+r, len-r, "(");
-            if ( r >= len ) { return r; }
-            r += print_dot_notation(str+r, len-r, car(expr));
-            if ( r >= len ) { return r; }
-            r += snprintf(str+r, len-r, " . ");
-            if ( r >= len ) { return r; }
-            r += print_dot_notation(str+r, len-r, cdr(expr));
-            if ( r >= len ) { return r; }
-            r += snprintf(str+r, len-r, ")");
+            /* keep what fits, count the rest */
+            if (s->len + 1 < s->cap) {
+                memcpy(s->buf + s->len, str, s->cap - 1 - s->len);
+                s->buf[s->cap - 1] = '\0';
+            }
+            s->len += n;
+            return;
         }
     }
-    return r;
+    memcpy(s->buf + s->len, str, n);
+    s->len += n;
+    if (!s->file) {
+        s->buf[s->len] = '\0';
+    }
 }
 
 
 /*! \internal
- * \brief Print the tail of a list.
+ * \brief Write the name of an atom.
  */
-static int print_list_notation_rest(char* str, size_t len, sexp p) {
-    size_t r = 0;
-    /* cdr */
-    if (p) {
-        if (c_bool(atom(p))) {
-            if (!c_bool(eq(p,ATOM_NIL()))) {
-                if ( r >= len ) { return r; }
-                r += snprintf(str+r, len-r, " . ");
-                if ( r >= len ) { return r; }
-                r += print_list_notation(str+r, len-r, p);
-            }
+static void sink_atom(struct sink* s, sexp atom) {
+    const struct atom_impl* a = ATOM_OF(REF_STRIP(atom));
+    sink_write(s, a->name, a->len);
+}
+
+
+/*! \internal
+ * \brief What the printers have left to do, innermost last.
+ */
+struct todo {
+    struct {
+        /*! Print an expression, the tail of a list, or a string. */
+        enum { T_EXPR, T_REST, T_TEXT } kind;
+        sexp expr;
+        const char* text;
+    }* v;
+    size_t n;
+    size_t cap;
+};
+
+
+/*! \internal
+ * \brief Push a step onto \a t.
+ */
+static void todo_push(struct todo* t, int kind, sexp expr,
+                      const char* text) {
+    if (t->n == t->cap) {
+        t->cap = t->cap ? 2 * t->cap : 64;
+        t->v = realloc(t->v, t->cap * sizeof *t->v);
+    }
+    t->v[t->n].kind = kind;
+    t->v[t->n].expr = expr;
+    t->v[t->n].text = text;
+    ++t->n;
+}
+
+
+/*! \brief Print an expression in dot notation.
+ *
+ * Dot notation uses a dot between the members of a cons pair. A cons
+ * is written with parentheses around it. For example: (a . (b . c)).
+ *
+ * \param s The sink.
+ * \param expr Arbitrary lisp expression.
+ */
+void print_dot(struct sink* s, sexp expr) {
+    struct todo t = { 0, 0, 0 };
+    todo_push(&t, T_EXPR, expr, 0);
+    while (t.n) {
+        --t.n;
+        expr = t.v[t.n].expr;
+        if (t.v[t.n].kind == T_TEXT) {
+            sink_write(s, t.v[t.n].text, strlen(t.v[t.n].text));
+        } else if (!expr) {
+            continue;
+        } else if (c_bool(atom(expr))) {
+            sink_atom(s, expr);
         } else {
-            if ( r >= len ) { return r; }
-            r += snprintf(str+r, len-r, " ");
-            if ( r >= len ) { return r; }
-            r += print_list_notation(str+r, len-r, car(p));
-            if ( r >= len ) { return r; }
-            r += print_list_notation_rest(str+r, len-r, cdr(p));
+            sink_write(s, "(", 1);
+            todo_push(&t, T_TEXT, 0, ")");
+            todo_push(&t, T_EXPR, cdr(expr), 0);
+            todo_push(&t, T_TEXT, 0, " . ");
+            todo_push(&t, T_EXPR, car(expr), 0);
         }
     }
-    return r;
+    free(t.v);
 }
 
 
@@ -106,63 +233,94 @@ static int print_list_notation_rest(char* str, size_t len, sexp p) {
  * as (a b c) for (a . (b . (c . nil))). If the \c 'nil in the
  * previous example were a \c 'd, it would be written (a b (c . d)).
  *
- * \param str Buffer.
- * \param len Storage capacity of \a str.
+ * The walk keeps its own stack, so the depth of \a expr is only
+ * limited by memory.
+ *
+ * \param s The sink.
  * \param expr Arbitrary lisp expression.
- * \return Same as snprintf().
  */
-int print_list_notation(char* str, size_t len, sexp expr) {
-    size_t r = 0;
-    if (expr) {
-        if (c_bool(atom(expr))) {
-            if (c_str(expr)) {
-                if ( r >= len ) { return r; }
-                r += snprintf(str+r, len-r, "%s", c_str(expr));
-            }
-            return r;
-        } else {
-            /* parens */
-            if (!c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    || (c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    && c_bool(atom(cdr(expr))))) {
-                if ( r >= len ) { return r; }
-                r += snprintf(str+r, len-r, "(");
+void print_list(struct sink* s, sexp expr) {
+    struct todo t = { 0, 0, 0 };
+    todo_push(&t, T_EXPR, expr, 0);
+    while (t.n) {
+        --t.n;
+        expr = t.v[t.n].expr;
+        switch (t.v[t.n].kind) {
+        case T_TEXT:
+            sink_write(s, t.v[t.n].text, strlen(t.v[t.n].text));
+            break;
+        case T_EXPR:
+            if (!expr) {
+                break;
             }
-
-            /* car */
-            if (!c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    || (c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    && c_bool(atom(cdr(expr))))) {
-                if ( r >= len ) { return r; }
-                r += print_list_notation(str+r, len-r, car(expr));
+            if (c_bool(atom(expr))) {
+                sink_atom(s, expr);
+            } else if (c_bool(eq(ATOM_QUOTE(), car(expr)))
+                    && !c_bool(atom(cdr(expr)))) {
+                sink_write(s, "'", 1);
+                todo_push(&t, T_REST, cdr(cdr(expr)), 0);
+                todo_push(&t, T_EXPR, car(cdr(expr)), 0);
             } else {
-                if ( r >= len ) { return r; }
-                r += snprintf(str+r, len-r, "'");
-                sexp qp = cdr(expr);
-                if ( r >= len ) { return r; }
-                r += print_list_notation(str+r, len-r, car(qp));
-                if ( r >= len ) { return r; }
-                r += print_list_notation_rest(str+r, len-r, cdr(qp));
+                sink_write(s, "(", 1);
+                todo_push(&t, T_TEXT, 0, ")");
+                todo_push(&t, T_REST, cdr(expr), 0);
+                todo_push(&t, T_EXPR, car(expr), 0);
             }
-
-            /* cdr */
-            if (!c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    || (c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    && c_bool(atom(cdr(expr))))) {
-                if ( r >= len ) { return r; }
-                r += print_list_notation_rest(str+r, len-r, cdr(expr));
+            break;
+        case T_REST:
+            if (!expr) {
+                break;
             }
-
-            /* parens */
-            if (!c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    || (c_bool(eq(ATOM_QUOTE(),car(expr)))
-                    && c_bool(atom(cdr(expr))))) {
-                if ( r >= len ) { return r; }
-                r += snprintf(str+r, len-r, ")");
+            if (c_bool(atom(expr))) {
+                if (!c_bool(eq(expr, ATOM_NIL()))) {
+                    sink_write(s, " . ", 3);
+                    sink_atom(s, expr);
+                }
+            } else {
+                sink_write(s, " ", 1);
+                todo_push(&t, T_REST, cdr(expr), 0);
+                todo_push(&t, T_EXPR, car(expr), 0);
             }
+            break;
         }
     }
-    return r;
+    free(t.v);
+}
+
+
+/*! \brief Print an expression in dot notation to a buffer.
+ *
+ * See print_dot().
+ *
+ * \param str Buffer.
+ * \param len Storage capacity of \a str.
+ * \param expr Arbitrary lisp expression.
+ * \return Same as snprintf().
+ */
+int print_dot_notation(char* str, size_t len, sexp expr) {
+    struct sink s;
+    sink_fixed(&s, str, len);
+    if (len) { str[0] = '\0'; }
+    print_dot(&s, expr);
+    return s.len;
+}
+
+
+/*! \brief Print an expression in list notation to a buffer.
+ *
+ * See print_list().
+ *
+ * \param str Buffer.
+ * \param len Storage capacity of \a str.
+ * \param expr Arbitrary lisp expression.
+ * \return Same as snprintf().
+ */
+int print_list_notation(char* str, size_t len, sexp expr) {
+    struct sink s;
+    sink_fixed(&s, str, len);
+    if (len) { str[0] = '\0'; }
+    print_list(&s, expr);
+    return s.len;
 }
 
 
@@ -170,9 +328,7 @@ int print_list_notation(char* str, size_t len, sexp expr) {
  * \brief Eat whitespace.
  */
 static void parse_ws(const char** p) {
-    /* skip whitespace */
-    while ( **p == ' ' || **p == '\t' || **p == '\r'
-            || **p == '\n' ) { ++(*p); }
+    *p = scan_space(*p);
 }
 
 
@@ -183,88 +339,62 @@ static sexp parse_atom(const char** p) {
     /* atom or . */
     const char* s = *p;
     /* skip valid symbol characters */
-    while (**p != ' ' && **p != '\t' && **p != '\r' && **p != '\n'
-            && **p != '(' && **p != ')' && **p != '\0') { ++(*p); }
+    *p = scan_atom(*p);
     if (0 == (*p)-s) { return 0; }
     return symbol(s, (*p)-s);
 }
 
 
 /*! \internal
- * \brief Parse ' (quote) list notation shorthand.
- */
-static sexp parse_quote(const char** p) {
-    ++(*p);
-    const sexp e = parse(p);
-    if (0 == e) { return 0; }
-    return cons(ATOM_QUOTE(),cons(e,ATOM_NIL()));
-}
-
-
-/*! \internel
- * \brief Parse a dot pair.
+ * \brief The lists and quotes parse() is inside of, innermost last.
  *
- * For example: (a . b)
+ * The elements read so far of every open list are kept, in order, in
+ * one array; a list is consed up from its end when it is closed.
  */
-static sexp parse_cons(const char** p) {
-    ++(*p); /* '(' */
-    const sexp car = parse(p);
-    if (0 == car) { return 0; }
-    parse(p); /* '.' */
-    const sexp t = parse(p);
-    if (0 == t) { return 0; }
-    const sexp r = cons(car,t);
-    parse_ws(p);
-    if (**p == ')') { ++(*p); }
-    return r;
-}
+struct nest {
+    struct {
+        /*! An open list, or a ' waiting for its expression. */
+        enum { N_LIST, N_QUOTE } kind;
+        /*! Where the list's elements start in \c elem. */
+        size_t start;
+        /*! A . has been read; the next expression is the tail. */
+        bool dot;
+        /*! The tail after a ., or 0. */
+        sexp tail;
+    }* v;
+    size_t n;
+    size_t cap;
+    sexp* elem;
+    size_t elems;
+    size_t elem_cap;
+};
 
 
 /*! \internal
- * \brief Parse part of a list notation list.
+ * \brief Open a list or quote.
  */
-static sexp parse_list_elem(const char** p) {
-    const sexp t = parse(p);
-    if (0 == t) { return 0; }
-    if (c_bool(eq(ATOM_DOT(),t))) {
-        return t;
-    }
-    parse_ws(p);
-    if (**p == ')' || *p == '\0') {
-        return cons(t, ATOM_NIL());
-    }
-    const sexp r = parse_list_elem(p);
-    if (0 == r) { return 0; }
-    if (c_bool(eq(ATOM_DOT(),r))) {
-        return r;
+static void nest_push(struct nest* t, int kind) {
+    if (t->n == t->cap) {
+        t->cap = t->cap ? 2 * t->cap : 64;
+        t->v = realloc(t->v, t->cap * sizeof *t->v);
     }
-    return cons(t,r);
+    t->v[t->n].kind = kind;
+    t->v[t->n].start = t->elems;
+    t->v[t->n].dot = false;
+    t->v[t->n].tail = 0;
+    ++t->n;
 }
 
 
 /*! \internal
- * \brief Parse a list notation list or dotted pair.
+ * \brief Append an element to the innermost open list.
  */
-static sexp parse_list(const char** p) {
-    const char* bookmark = *p; /* in case this turns out to be a cons */
-
-    sexp r = ATOM_NIL();
-
-    ++(*p); /* '(' */
-    parse_ws(p);
-
-    if (**p != ')' && *p != '\0') {
-        r = parse_list_elem(p);
-	if (0 == r) { return 0; }
-        parse_ws(p);
-        if (c_bool(eq(ATOM_DOT(),r))) {
-            *p = bookmark;
-            return parse_cons(p);
-        }
+static void nest_elem(struct nest* t, sexp expr) {
+    if (t->elems == t->elem_cap) {
+        t->elem_cap = t->elem_cap ? 2 * t->elem_cap : 256;
+        t->elem = realloc(t->elem, t->elem_cap * sizeof *t->elem);
     }
-
-    if (**p == ')') { ++(*p); }
-    return r;
+    t->elem[t->elems++] = expr;
 }
 
 
@@ -273,23 +403,81 @@ static sexp parse_list(const char** p) {
  * Parse a string into a lisp expression. Handles list and dot
  * notation. Handles quote shorthand.
  *
+ * The text is read in one pass with an explicit stack, so neither
+ * the length nor the depth of a list is limited by the C stack.
+ * Anything after the tail of a dotted pair, as c in (a . b c), is
+ * skipped.
+ *
  * \param iter_ref Address of a pointer to start of buffer.
  * *iter_ref points to the character after the last successfully
  * parsed character at return time.
- * \return Lisp expression.
+ * \return Lisp expression, or 0 at the end of input or if the
+ * expression is incomplete.
  */
 sexp parse(const char** iter_ref) {
-    parse_ws(iter_ref);
-
-    /* end of input */
-    if (**iter_ref == '\0') { return 0; }
-
-    /* quote */
-    if (**iter_ref == '\'') { return parse_quote(iter_ref); }
+    struct nest t = { 0, 0, 0, 0, 0, 0 };
+    sexp r = 0;
+
+    for (;;) {
+        parse_ws(iter_ref);
+        const char c = **iter_ref;
+        sexp e;
+
+        if (c == '\0') {
+            /* end of input, maybe inside a list */
+            break;
+        } else if (c == '\'') {
+            ++(*iter_ref);
+            nest_push(&t, N_QUOTE);
+            continue;
+        } else if (c == '(') {
+            ++(*iter_ref);
+            nest_push(&t, N_LIST);
+            continue;
+        } else if (c == ')') {
+            if (0 == t.n || t.v[t.n-1].kind != N_LIST) { break; }
+            ++(*iter_ref);
+            --t.n;
+            sexp tail = t.v[t.n].tail;
+            if (0 == tail) {
+                if (t.v[t.n].dot) {
+                    /* (a .) keeps the dot as an element */
+                    nest_elem(&t, ATOM_DOT());
+                }
+                tail = ATOM_NIL();
+            }
+            e = tail;
+            while (t.elems > t.v[t.n].start) {
+                e = cons(t.elem[--t.elems], e);
+            }
+        } else {
+            e = parse_atom(iter_ref);
+            if (t.n && t.v[t.n-1].kind == N_LIST && !t.v[t.n-1].dot
+                    && t.elems > t.v[t.n-1].start
+                    && c_bool(eq(ATOM_DOT(), e))) {
+                t.v[t.n-1].dot = true;
+                continue;
+            }
+        }
 
-    /* cons or list */
-    if (**iter_ref == '(') { return parse_list(iter_ref); }
+        /* e is complete: wrap it in any quotes, then hand it to the
+         * list it is in, or return it */
+        while (t.n && t.v[t.n-1].kind == N_QUOTE) {
+            --t.n;
+            e = cons(ATOM_QUOTE(), cons(e, ATOM_NIL()));
+        }
+        if (0 == t.n) {
+            r = e;
+            break;
+        }
+        if (!t.v[t.n-1].dot) {
+            nest_elem(&t, e);
+        } else if (0 == t.v[t.n-1].tail) {
+            t.v[t.n-1].tail = e;
+        }
+    }
 
-    /* atom or . */
-    return parse_atom(iter_ref);
+    free(t.v);
+    free(t.elem);
+    return r;
 }
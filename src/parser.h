@@ -23,9 +23,31 @@
 
 #include "cons.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
+/*! \brief Where printed text goes, see sink_file() and sink_buffer().
+ */
+struct sink {
+    /*! The stream, or null for a buffer. */
+    FILE* file;
+    /*! The text not yet flushed, or the whole text. */
+    char* buf;
+    /*! Bytes written to \c buf. */
+    size_t len;
+    /*! Size of \c buf. */
+    size_t cap;
+    /*! Whether \c buf grows when full. */
+    bool grow;
+};
 
+void sink_file(struct sink* s, FILE* file) ;
+void sink_buffer(struct sink* s) ;
+void sink_write(struct sink* s, const char* str, size_t n) ;
+void sink_flush(struct sink* s) ;
+void sink_close(struct sink* s) ;
+void print_dot(struct sink* s, sexp p) ;
+void print_list(struct sink* s, sexp p) ;
 int print_dot_notation(char* str, size_t len, sexp p) ;
 int print_list_notation(char* str, size_t len, sexp p) ;
 sexp parse(const char** p);
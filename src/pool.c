@@ -0,0 +1,296 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*! \file pool.c
+ *
+ * \brief Work-stealing thread pool.
+ *
+ * Every thread, the one that calls pool_start() included, owns a
+ * deque of tasks. A thread pushes the tasks it forks at the back
+ * and pops them from there when it joins them, so the most recent,
+ * and smallest, work stays at home. An idle thread steals from the
+ * front of another's deque, where the oldest, and largest, pieces of
+ * work are. A thread waiting for a stolen task steals in turn rather
+ * than block.
+ *
+ * The deques are short, since callers stop forking below
+ * pool_depth(), so each is guarded by a plain mutex. Threads with
+ * nothing to steal sleep until a task is forked or, in pool_join(),
+ * until the task they wait for is done.
+ */
+
+#include "pool.h"
+
+#include "cons_impl.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief The tasks of one thread, a ring buffer.
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct task** v;
+    /*! Index of the oldest task, which thieves take. */
+    size_t head;
+    /*! One past the newest task, which the owner takes. */
+    size_t tail;
+    size_t cap;
+};
+
+
+/*! \internal
+ * \brief The pool.
+ */
+static struct {
+    unsigned threads;
+    unsigned depth;
+    struct deque* deque;
+    /*! Tasks waiting in any deque. */
+    atomic_size_t queued;
+    pthread_mutex_t idle;
+    pthread_cond_t wake;
+    /*! Threads that have their nursery, see pool_start(). */
+    unsigned started;
+    pthread_cond_t ready;
+} pool = { 1, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, PTHREAD_COND_INITIALIZER };
+
+
+/*! \internal
+ * \brief Index of the calling thread's deque.
+ */
+static _Thread_local unsigned self;
+
+
+/*! \internal
+ * \brief Take the oldest task from deque \a d, null if none.
+ */
+static struct task* steal_from(struct deque* d) {
+    struct task* t = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head != d->tail) {
+        t = d->v[d->head++ % d->cap];
+        atomic_fetch_sub(&pool.queued, 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+
+/*! \internal
+ * \brief Steal a task from another thread, null if none.
+ */
+static struct task* steal(unsigned* seed) {
+    unsigned n = pool.threads;
+    unsigned start = (*seed = *seed * 1103515245u + 12345u) >> 16;
+    unsigned i = 0;
+    for (i = 0; i < n; ++i) {
+        unsigned victim = (start + i) % n;
+        if (victim == self) {
+            continue;
+        }
+        struct task* t = steal_from(&pool.deque[victim]);
+        if (t) {
+            return t;
+        }
+    }
+    return 0;
+}
+
+
+/*! \internal
+ * \brief Run a stolen task and mark it done.
+ */
+static void run_stolen(struct task* t) {
+    t->run(t, true);
+    pthread_mutex_lock(&pool.idle);
+    atomic_store_explicit(&t->done, true, memory_order_release);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.idle);
+}
+
+
+/*! \internal
+ * \brief Body of a pool thread.
+ */
+static void* worker(void* arg) {
+    self = (unsigned)(uintptr_t)arg;
+    unsigned seed = self;
+    pthread_mutex_lock(&pool.idle);
+    gc_thread();
+    ++pool.started;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.idle);
+    for (;;) {
+        struct task* t = steal(&seed);
+        if (t) {
+            run_stolen(t);
+            continue;
+        }
+        pthread_mutex_lock(&pool.idle);
+        while (!atomic_load(&pool.queued)) {
+            pthread_cond_wait(&pool.wake, &pool.idle);
+        }
+        pthread_mutex_unlock(&pool.idle);
+    }
+    return 0;
+}
+
+
+/*! \brief Start the pool.
+ *
+ * Call once, before any task is forked. The calling thread becomes
+ * one of the \a threads, and helps with the work while it waits for
+ * a task it has forked.
+ *
+ * Each new thread gets a nursery of its own from gc_thread(), and
+ * this returns once they all have one, so that no collection can
+ * miss a nursery being added. The memo table and the hash-cons table are not safe to share, so do
+ * not fork while memo_limit() or hash_cons() is on.
+ *
+ * \param threads The number of threads, at least 1.
+ */
+void pool_start(unsigned threads) {
+    unsigned i = 0;
+    pool.threads = threads ? threads : 1;
+    /* enough tasks that every thread has a few to steal */
+    pool.depth = 0;
+    for (i = 1; i < pool.threads; i *= 2) {
+        ++pool.depth;
+    }
+    pool.depth = pool.threads > 1 ? pool.depth + 3 : 0;
+    pool.deque = calloc(pool.threads, sizeof *pool.deque);
+    for (i = 0; i < pool.threads; ++i) {
+        pthread_mutex_init(&pool.deque[i].lock, 0);
+    }
+    for (i = 1; i < pool.threads; ++i) {
+        pthread_t thread;
+        pthread_create(&thread, 0, worker, (void*)(uintptr_t)i);
+        pthread_detach(thread);
+    }
+    pthread_mutex_lock(&pool.idle);
+    while (pool.started + 1 < pool.threads) {
+        pthread_cond_wait(&pool.ready, &pool.idle);
+    }
+    pthread_mutex_unlock(&pool.idle);
+}
+
+
+/*! \brief Get the number of threads.
+ *
+ * \return 1 until pool_start() is called.
+ */
+unsigned pool_size() {
+    return pool.threads;
+}
+
+
+/*! \brief Get the fork depth cutoff.
+ *
+ * Forking below this many forks makes tasks too small to be worth
+ * moving to another thread. Callers evaluate them in place instead.
+ *
+ * \return The depth, 0 when there is a single thread.
+ */
+unsigned pool_depth() {
+    return pool.depth;
+}
+
+
+/*! \brief Set the fork depth cutoff.
+ *
+ * A caller that forks large pieces of work of its own, such as
+ * whole top level forms, can turn the forks inside them off with 0.
+ *
+ * \param depth The depth pool_depth() returns from now on.
+ */
+void pool_limit(unsigned depth) {
+    pool.depth = depth;
+}
+
+
+/*! \brief Make a task available to other threads.
+ *
+ * The task may run at once on another thread, or when the caller
+ * joins it. Either way pool_join() must be called, in the reverse
+ * order of the forks.
+ *
+ * \param task The task, with \c run set.
+ */
+void pool_fork(struct task* task) {
+    struct deque* d = &pool.deque[self];
+    atomic_init(&task->done, false);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        size_t cap = d->cap ? 2 * d->cap : 64;
+        struct task** v = malloc(cap * sizeof *v);
+        size_t i = 0;
+        for (i = d->head; i != d->tail; ++i) {
+            v[i % cap] = d->v[i % d->cap];
+        }
+        free(d->v);
+        d->v = v;
+        d->cap = cap;
+    }
+    d->v[d->tail++ % d->cap] = task;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&pool.idle);
+    atomic_fetch_add(&pool.queued, 1);
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.idle);
+}
+
+
+/*! \brief Wait for a forked task.
+ *
+ * A task no one has stolen is run here. Otherwise the caller steals
+ * other work until the thief is done, and sleeps while there is none.
+ *
+ * \param task A task passed to pool_fork() by this thread.
+ */
+void pool_join(struct task* task) {
+    struct deque* d = &pool.deque[self];
+    bool mine = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head && d->v[(d->tail - 1) % d->cap] == task) {
+        --d->tail;
+        atomic_fetch_sub(&pool.queued, 1);
+        mine = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (mine) {
+        task->run(task, false);
+        return;
+    }
+    unsigned seed = self + 1;
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        struct task* t = steal(&seed);
+        if (t) {
+            run_stolen(t);
+            continue;
+        }
+        pthread_mutex_lock(&pool.idle);
+        while (!atomic_load_explicit(&task->done, memory_order_acquire)
+            && !atomic_load(&pool.queued)) {
+            pthread_cond_wait(&pool.wake, &pool.idle);
+        }
+        pthread_mutex_unlock(&pool.idle);
+    }
+}
@@ -0,0 +1,49 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+/*! \file pool.h
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*! \brief A unit of work for the pool, see pool_fork().
+ *
+ * Embed it at the start of a struct holding the work's arguments
+ * and result.
+ */
+struct task {
+    /*! \brief Do the work.
+     *
+     * \c stolen is \c true when another thread runs the task, and
+     * \c false when the thread that forked it does.
+     */
+    void (*run)(struct task* task, bool stolen);
+    /*! Set once a stolen task has run. */
+    atomic_bool done;
+};
+
+void pool_start(unsigned threads) ;
+unsigned pool_size() ;
+unsigned pool_depth() ;
+void pool_limit(unsigned depth) ;
+void pool_fork(struct task* task) ;
+void pool_join(struct task* task) ;
+
+#endif
@@ -0,0 +1,315 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*! \file reader.c
+ *
+ * \brief Reading expressions from a stream.
+ *
+ * parse() wants a whole expression in one string. This module finds
+ * where each top level expression ends in a stream read a chunk at a
+ * time, and parses it when it is complete. It only keeps the text
+ * of the expression being read and one chunk of input, so memory
+ * grows with the largest expression rather than with the stream.
+ *
+ * Finding the end needs little state, which is kept between chunks:
+ * the number of open parentheses, and whether a top level atom has
+ * been started. A quote is part of the expression that follows it.
+ *
+ * An expression that lies within one chunk is parsed where it is,
+ * only one that spans chunks is copied. A mapped file is a single
+ * chunk, so nothing is copied, see reader_map().
+ */
+
+#include "reader.h"
+
+#include "parser.h"
+#include "scan.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*! \internal
+ * \brief Bytes read from the source at a time.
+ */
+#define READER_CHUNK 65536
+
+
+/*! \internal
+ * \brief Set up \a r for any source.
+ */
+static void reader_init(struct reader* r, FILE* in, int fd) {
+    r->file = in;
+    r->fd = fd;
+    r->chunk = 0;
+    r->pos = 0;
+    r->end = 0;
+    r->chunk_cap = 0;
+    r->map = 0;
+    r->map_len = 0;
+    r->start = 0;
+    r->form = 0;
+    r->len = 0;
+    r->cap = 0;
+    r->open = false;
+    r->depth = 0;
+    r->atom = false;
+    r->eof = false;
+    r->error = 0;
+}
+
+
+/*! \brief Read from a stream.
+ *
+ * The stream is read a line at a time, so that a form typed at a
+ * terminal is evaluated as soon as it is complete.
+ *
+ * \param r The reader.
+ * \param in The stream.
+ */
+void reader_file(struct reader* r, FILE* in) {
+    reader_init(r, in, -1);
+    r->chunk_cap = READER_CHUNK;
+    r->chunk = malloc(r->chunk_cap + 1);
+}
+
+
+/*! \brief Read from a file descriptor.
+ *
+ * \param r The reader.
+ * \param fd An open file descriptor.
+ */
+void reader_fd(struct reader* r, int fd) {
+    reader_init(r, 0, fd);
+    r->chunk_cap = READER_CHUNK;
+    r->chunk = malloc(r->chunk_cap + 1);
+}
+
+
+/*! \brief Read a whole file through a memory mapping.
+ *
+ * Expressions are parsed straight from the mapping, and pages are
+ * read in by the kernel as the parser reaches them. When the file
+ * fills its last page exactly, the page after it is mapped to
+ * zeros, so the text always ends with a '\\0'.
+ *
+ * \param r The reader.
+ * \param path The file name.
+ * \return \c false if the file cannot be opened or mapped.
+ */
+bool reader_map(struct reader* r, const char* path) {
+    reader_init(r, 0, -1);
+    r->eof = true;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) { close(fd); }
+        return false;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (size_t)st.st_size;
+    size_t map_len = (len / page + 1) * page;
+    char* m = mmap(0, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    if (m != MAP_FAILED && len
+            && mmap(m, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)
+            == MAP_FAILED) {
+        munmap(m, map_len);
+        m = MAP_FAILED;
+    }
+    close(fd);
+    if (m == MAP_FAILED) {
+        return false;
+    }
+    madvise(m, map_len, MADV_SEQUENTIAL);
+    r->map = m;
+    r->map_len = map_len;
+    r->chunk = m;
+    r->end = len;
+    return true;
+}
+
+
+/*! \brief Free the buffers of \a r.
+ *
+ * A mapping is unmapped, a stream or descriptor is left open.
+ *
+ * \param r The reader.
+ */
+void reader_close(struct reader* r) {
+    if (r->map) {
+        munmap(r->map, r->map_len);
+    } else {
+        free(r->chunk);
+    }
+    free(r->form);
+    r->chunk = 0;
+    r->map = 0;
+    r->form = 0;
+}
+
+
+/*! \internal
+ * \brief Read the next chunk.
+ *
+ * \return \c false at the end of the source.
+ */
+static bool reader_fill(struct reader* r) {
+    size_t n = 0;
+    if (r->map) {
+        n = 0;
+    } else if (r->file) {
+        if (fgets(r->chunk, r->chunk_cap + 1, r->file)) {
+            n = strlen(r->chunk);
+        }
+    } else {
+        ssize_t got = read(r->fd, r->chunk, r->chunk_cap);
+        n = got > 0 ? (size_t)got : 0;
+        r->chunk[n] = '\0';
+    }
+    r->pos = 0;
+    r->start = 0;
+    r->end = n;
+    r->eof = !n;
+    return n;
+}
+
+
+/*! \internal
+ * \brief Append the chunk from the start of the form up to \a end
+ * to the saved text of the form.
+ */
+static void reader_save(struct reader* r, size_t end) {
+    size_t n = end - r->start;
+    if (r->len + n + 1 > r->cap) {
+        while (r->len + n + 1 > r->cap) {
+            r->cap = r->cap ? 2 * r->cap : 256;
+        }
+        r->form = realloc(r->form, r->cap);
+    }
+    memcpy(r->form + r->len, r->chunk + r->start, n);
+    r->len += n;
+    r->form[r->len] = '\0';
+}
+
+
+/*! \internal
+ * \brief Test for a character that ends an atom.
+ */
+static bool delimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n'
+        || c == '(' || c == ')' || c == '\0';
+}
+
+
+/*! \internal
+ * \brief Scan the chunk up to the end of a form.
+ *
+ * \return \c true if a form is complete, \c false if the chunk ran
+ * out first.
+ */
+static bool reader_scan(struct reader* r) {
+    while (r->pos < r->end) {
+        char c = r->chunk[r->pos];
+        if (r->atom) {
+            if (delimiter(c)) {
+                /* the delimiter belongs to what follows */
+                r->atom = false;
+                return true;
+            }
+        } else if (r->depth) {
+            /* inside a list only the parentheses matter */
+            const char* q = scan_paren(r->chunk + r->pos,
+                                       r->chunk + r->end);
+            r->pos = q - r->chunk;
+            if (r->pos == r->end) {
+                break;
+            }
+            if (*q == '(') {
+                ++r->depth;
+            } else if (!--r->depth) {
+                ++r->pos;
+                return true;
+            }
+        } else if (c == '(' || c == '\'' || !delimiter(c)) {
+            if (!r->open) {
+                r->open = true;
+                r->start = r->pos;
+            }
+            r->depth = c == '(';
+            r->atom = c != '(' && c != '\'';
+        }
+        /* white space and a stray ')' between forms are skipped */
+        ++r->pos;
+    }
+    return false;
+}
+
+
+/*! \brief Read the next top level expression.
+ *
+ * An expression may span any number of lines and chunks. At the end
+ * of the source an atom is complete, but an expression with open
+ * parentheses or a quote with nothing after it is not: it is
+ * dropped and \c error is set.
+ *
+ * \param r The reader.
+ * \return The expression, null at the end of the source.
+ */
+sexp reader_next(struct reader* r) {
+    r->error = 0;
+    for (;;) {
+        bool done = reader_scan(r);
+        if (!done && !r->eof) {
+            if (r->open) {
+                /* keep the part of the form in this chunk */
+                reader_save(r, r->end);
+            }
+            if (reader_fill(r)) {
+                continue;
+            }
+        }
+        if (!done && r->atom) {
+            /* the end of the source ends an atom */
+            r->atom = false;
+            done = true;
+        }
+        if (!done) {
+            if (r->open) {
+                r->error = "unexpected end of input";
+            }
+            r->open = false;
+            r->len = 0;
+            r->depth = 0;
+            return 0;
+        }
+        const char* p = r->chunk + r->start;
+        if (r->len) {
+            reader_save(r, r->pos);
+            p = r->form;
+        }
+        r->open = false;
+        r->len = 0;
+        sexp e = parse(&p);
+        if (e) {
+            return e;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef READER_H
+#define READER_H
+
+/*! \file reader.h
+ */
+
+#include "cons.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*! \brief An incremental reader, see reader_next().
+ *
+ * The members are private to reader.c.
+ */
+struct reader {
+    /*! Source, a stream, a file descriptor or a mapped file. */
+    FILE* file;
+    int fd;
+    /*! Input read but not yet scanned, followed by a '\\0'. */
+    char* chunk;
+    size_t pos;
+    size_t end;
+    size_t chunk_cap;
+    /*! The mapping, when chunk is a whole mapped file. */
+    void* map;
+    size_t map_len;
+    /*! Start in chunk of the form being read. */
+    size_t start;
+    /*! Text of the part of the form in earlier chunks. */
+    char* form;
+    size_t len;
+    size_t cap;
+    /*! A form has been started. */
+    bool open;
+    /*! Open parentheses in the form. */
+    size_t depth;
+    /*! Inside a top level atom. */
+    bool atom;
+    /*! The source is exhausted. */
+    bool eof;
+    /*! Why the last reader_next() returned null early, or null. */
+    const char* error;
+};
+
+void reader_file(struct reader* r, FILE* in) ;
+void reader_fd(struct reader* r, int fd) ;
+bool reader_map(struct reader* r, const char* path) ;
+sexp reader_next(struct reader* r) ;
+void reader_close(struct reader* r) ;
+
+#endif
@@ -0,0 +1,283 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file resolve.c
+ *
+ * \brief Variable resolution pass.
+ *
+ * Run over a form before eval() to tie each variable that names a
+ * parameter of the lambda it appears in to that parameter's frame
+ * slot. eval() can then fetch it with frame_ref() instead of
+ * looking it up, see env.c.
+ *
+ * Scoping is dynamic, so this is only done where it cannot change
+ * the result. Between the call of a lambda and the evaluation of
+ * its body nothing else is bound, so in the body a parameter of
+ * that lambda always has the value of its slot. That does not hold
+ * for the parameters of an enclosing lambda: the body of a nested
+ * lambda can run from any caller, for example recursively through
+ * a label, with the name rebound in between. Those are left for
+ * lookup().
+ *
+ * The pass only ever replaces atoms in places eval() will treat as
+ * variables. Quoted data, function names and malformed forms are
+ * copied as is, and unchanged subtrees are shared.
+ */
+
+#include "resolve.h"
+
+#include "cons_impl.h"
+#include "constants.h"
+
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief Work left for resolve_expr().
+ *
+ * Each step leaves one result on \c value. The steps that rebuild a
+ * cell take the results of the steps pushed after them.
+ */
+struct work {
+    struct {
+        enum {
+            /*! Resolve expression \c x. */
+            W_EXPR,
+            /*! Resolve each element of list \c x as an expression. */
+            W_LIST,
+            /*! Resolve the clauses of cond in \c x. */
+            W_CLAUSES,
+            /*! Leave \c x as it is. */
+            W_SAME,
+            /*! Make cell \c x from the last two results. */
+            W_CONS,
+            /*! Put the last result in as element \c n of list \c x. */
+            W_NTH
+        } kind;
+        sexp x;
+        /*! The parameters variables resolve against. */
+        sexp params;
+        unsigned n;
+    }* v;
+    size_t n;
+    size_t cap;
+    sexp* value;
+    size_t values;
+    size_t value_cap;
+};
+
+
+/*! \internal
+ * \brief Push a step onto \a w.
+ */
+static void work_push(struct work* w, int kind, sexp x, sexp params,
+                      unsigned n) {
+    if (w->n == w->cap) {
+        w->cap = w->cap ? 2 * w->cap : 64;
+        w->v = realloc(w->v, w->cap * sizeof *w->v);
+    }
+    w->v[w->n].kind = kind;
+    w->v[w->n].x = x;
+    w->v[w->n].params = params;
+    w->v[w->n].n = n;
+    ++w->n;
+}
+
+
+/*! \internal
+ * \brief Leave a result on \a w.
+ */
+static void work_value(struct work* w, sexp x) {
+    if (w->values == w->value_cap) {
+        w->value_cap = w->value_cap ? 2 * w->value_cap : 64;
+        w->value = realloc(w->value, w->value_cap * sizeof *w->value);
+    }
+    w->value[w->values++] = x;
+}
+
+
+/*! \internal
+ * \brief Resolve variable \a key.
+ *
+ * \return A REF to the first slot named \a key in \a params,
+ * \a key itself if there is none.
+ */
+static sexp resolve_var(sexp key, sexp params) {
+    unsigned i = 0;
+    for (; !c_bool(atom(params)); params = cdr(params), ++i) {
+        if (c_bool(eq(car(params), key))) {
+            return ref(key, i);
+        }
+    }
+    return key;
+}
+
+
+/*! \internal
+ * \brief Test for a well formed (lambda params body) expression.
+ */
+static bool is_lambda(sexp expr) {
+    return !c_bool(atom(expr))
+        && atom_opcode(car(expr)) == OP_LAMBDA
+        && !c_bool(atom(cdr(expr)))
+        && !c_bool(atom(cdr(cdr(expr))));
+}
+
+
+/*! \internal
+ * \brief \a list with element \a n replaced by \a x.
+ *
+ * \return \a list itself if the element is \a x already.
+ */
+static sexp with_nth(sexp list, unsigned n, sexp x) {
+    if (!n) {
+        return x == car(list) ? list : cons(x, cdr(list));
+    }
+    sexp d = with_nth(cdr(list), n - 1, x);
+    return d == cdr(list) ? list : cons(car(list), d);
+}
+
+
+/*! \internal
+ * \brief Push the steps that resolve the body of a lambda against
+ * its own parameters.
+ */
+static void push_lambda(struct work* w, sexp lambda) {
+    work_push(w, W_NTH, lambda, 0, 2);
+    work_push(w, W_EXPR, car(cdr(cdr(lambda))), car(cdr(lambda)), 0);
+}
+
+
+/*! \internal
+ * \brief Push the steps that resolve compound \a expr in the body of
+ * a lambda with \a params.
+ */
+static void push_call(struct work* w, sexp expr, sexp params) {
+    sexp head = car(expr);
+    sexp args = cdr(expr);
+    if (c_bool(atom(head))) {
+        switch (atom_opcode(head)) {
+        case OP_QUOTE:
+        case OP_LAMBDA:
+        case OP_LABEL:
+            work_push(w, W_SAME, expr, 0, 0);
+            return;
+        case OP_COND:
+            work_push(w, W_CONS, expr, 0, 0);
+            work_push(w, W_CLAUSES, args, params, 0);
+            break;
+        default:
+            work_push(w, W_CONS, expr, 0, 0);
+            work_push(w, W_LIST, args, params, 0);
+            break;
+        }
+        work_push(w, W_SAME, head, 0, 0);
+    } else if (is_lambda(head)) {
+        work_push(w, W_CONS, expr, 0, 0);
+        work_push(w, W_LIST, args, params, 0);
+        push_lambda(w, head);
+    } else if (atom_opcode(car(head)) == OP_LABEL
+            && !c_bool(atom(cdr(head)))
+            && !c_bool(atom(cdr(cdr(head))))
+            && is_lambda(car(cdr(cdr(head))))) {
+        work_push(w, W_CONS, expr, 0, 0);
+        /* the arguments are evaluated with the label name bound */
+        work_push(w, W_LIST, args, ATOM_NIL(), 0);
+        work_push(w, W_NTH, head, 0, 2);
+        push_lambda(w, car(cdr(cdr(head))));
+    } else {
+        work_push(w, W_SAME, expr, 0, 0);
+    }
+}
+
+
+/*! \internal
+ * \brief Resolve \a expr in the body of a lambda with \a params.
+ *
+ * The walk keeps its own stack, so neither the length nor the depth
+ * of \a expr is limited by the C stack.
+ */
+static sexp resolve_expr(sexp expr, sexp params) {
+    struct work w = { 0, 0, 0, 0, 0, 0 };
+    work_push(&w, W_EXPR, expr, params, 0);
+    while (w.n) {
+        --w.n;
+        int kind = w.v[w.n].kind;
+        sexp x = w.v[w.n].x;
+        params = w.v[w.n].params;
+        unsigned n = w.v[w.n].n;
+        switch (kind) {
+        case W_EXPR:
+            if (!c_bool(atom(x))) {
+                push_call(&w, x, params);
+            } else {
+                work_value(&w, SEXP_TYPE(x) == ATOM
+                    ? resolve_var(x, params) : x);
+            }
+            break;
+        case W_LIST:
+        case W_CLAUSES:
+            if (c_bool(atom(x))) {
+                work_value(&w, x);
+                break;
+            }
+            work_push(&w, W_CONS, x, 0, 0);
+            work_push(&w, kind, cdr(x), params, 0);
+            work_push(&w, kind == W_LIST ? W_EXPR : W_LIST, car(x), params, 0);
+            break;
+        case W_SAME:
+            work_value(&w, x);
+            break;
+        case W_CONS: {
+            sexp d = w.value[--w.values];
+            sexp a = w.value[--w.values];
+            work_value(&w, a == car(x) && d == cdr(x) ? x : cons(a, d));
+            break;
+        }
+        case W_NTH:
+            w.value[w.values - 1] = with_nth(x, n, w.value[w.values - 1]);
+            break;
+        }
+    }
+    sexp r = w.value[0];
+    free(w.v);
+    free(w.value);
+    return r;
+}
+
+
+/*! \brief Resolve the variables of a form.
+ *
+ * \param expr Lisp expression.
+ * \return \a expr with variables tied to frame slots where eval()
+ * can safely fetch them from there.
+ */
+sexp resolve(sexp expr) {
+    return resolve_expr(expr, ATOM_NIL());
+}
+
+
+/*! \brief Resolve the body of a lambda.
+ *
+ * \param params The parameters of the lambda.
+ * \param body The body of the lambda.
+ * \return \a body with its references to \a params tied to frame
+ * slots, see resolve().
+ */
+sexp resolve_body(sexp params, sexp body) {
+    return resolve_expr(body, params);
+}
@@ -0,0 +1,363 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*! \file scan.c
+ *
+ * \brief Find delimiters in source text many bytes at a time.
+ *
+ * Each scan has a plain byte at a time version, and on x86 an SSE2
+ * and an AVX2 one that classify 16 or 32 bytes per step. The best
+ * one the processor supports is picked on first use; scan_kernel()
+ * picks one by name.
+ *
+ * The vector versions load whole aligned blocks. An aligned block
+ * never crosses a page, so reading the bytes around the text is
+ * safe, though they are outside it; the sanitizer is told so.
+ */
+
+#include "scan.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#define SCAN_BLOCKS __attribute__((no_sanitize_address))
+#endif
+
+
+/*! \internal
+ * \brief Whether \a c is white space.
+ */
+static bool space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+/*! \internal
+ * \brief Whether \a c ends an atom.
+ */
+static bool delimiter(char c) {
+    return space(c) || c == '(' || c == ')' || c == '\0';
+}
+
+
+/*! \internal
+ * \brief Skip white space a byte at a time.
+ */
+static const char* scalar_space(const char* s) {
+    while (space(*s)) { ++s; }
+    return s;
+}
+
+
+/*! \internal
+ * \brief Find the end of an atom a byte at a time.
+ */
+static const char* scalar_atom(const char* s) {
+    while (!delimiter(*s)) { ++s; }
+    return s;
+}
+
+
+/*! \internal
+ * \brief Find a parenthesis a byte at a time.
+ */
+static const char* scalar_paren(const char* s, const char* end) {
+    while (s < end && *s != '(' && *s != ')') { ++s; }
+    return s;
+}
+
+
+#ifdef SCAN_X86
+
+/*! \internal
+ * \brief Bit i set where byte i of \a v is white space.
+ */
+static inline __attribute__((always_inline)) unsigned sse2_spaces(__m128i v) {
+    __m128i m = _mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return _mm_movemask_epi8(m);
+}
+
+
+/*! \internal
+ * \brief Bit i set where byte i of \a v is a parenthesis.
+ */
+static inline __attribute__((always_inline)) unsigned sse2_parens(__m128i v) {
+    return _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))));
+}
+
+
+/*! \internal
+ * \brief Bit i set where byte i of \a v ends an atom.
+ */
+static inline __attribute__((always_inline)) unsigned sse2_delimiters(__m128i v) {
+    return sse2_spaces(v) | sse2_parens(v) | _mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+}
+
+
+/*! \internal
+ * \brief scalar_space(), 16 bytes at a time.
+ */
+SCAN_BLOCKS static const char* sse2_space(const char* s) {
+    const size_t skip = (uintptr_t)s & 15;
+    const __m128i* b = (const __m128i*)(s - skip);
+    unsigned m = ~sse2_spaces(_mm_load_si128(b)) & 0xffffu & (~0u << skip);
+    while (!m) {
+        m = ~sse2_spaces(_mm_load_si128(++b)) & 0xffffu;
+    }
+    return (const char*)b + __builtin_ctz(m);
+}
+
+
+/*! \internal
+ * \brief scalar_atom(), 16 bytes at a time.
+ */
+SCAN_BLOCKS static const char* sse2_atom(const char* s) {
+    const size_t skip = (uintptr_t)s & 15;
+    const __m128i* b = (const __m128i*)(s - skip);
+    unsigned m = sse2_delimiters(_mm_load_si128(b)) & (0xffffu << skip);
+    while (!m) {
+        m = sse2_delimiters(_mm_load_si128(++b));
+    }
+    return (const char*)b + __builtin_ctz(m);
+}
+
+
+/*! \internal
+ * \brief scalar_paren(), 16 bytes at a time.
+ */
+SCAN_BLOCKS static const char* sse2_paren(const char* s, const char* end) {
+    if (s >= end) { return end; }
+    const size_t skip = (uintptr_t)s & 15;
+    const __m128i* b = (const __m128i*)(s - skip);
+    unsigned m = sse2_parens(_mm_load_si128(b)) & (0xffffu << skip);
+    while (!m) {
+        if ((const char*)++b >= end) { return end; }
+        m = sse2_parens(_mm_load_si128(b));
+    }
+    s = (const char*)b + __builtin_ctz(m);
+    return s < end ? s : end;
+}
+
+
+/*! \internal
+ * \brief sse2_spaces() for 32 bytes.
+ */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) unsigned avx2_spaces(__m256i v) {
+    __m256i m = _mm256_or_si256(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return _mm256_movemask_epi8(m);
+}
+
+
+/*! \internal
+ * \brief sse2_parens() for 32 bytes.
+ */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) unsigned avx2_parens(__m256i v) {
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))));
+}
+
+
+/*! \internal
+ * \brief sse2_delimiters() for 32 bytes.
+ */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) unsigned avx2_delimiters(__m256i v) {
+    return avx2_spaces(v) | avx2_parens(v) | _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+
+/*! \internal
+ * \brief scalar_space(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+SCAN_BLOCKS static const char* avx2_space(const char* s) {
+    const size_t skip = (uintptr_t)s & 31;
+    const __m256i* b = (const __m256i*)(s - skip);
+    unsigned m = ~avx2_spaces(_mm256_load_si256(b)) & (~0u << skip);
+    while (!m) {
+        m = ~avx2_spaces(_mm256_load_si256(++b));
+    }
+    return (const char*)b + __builtin_ctz(m);
+}
+
+
+/*! \internal
+ * \brief scalar_atom(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+SCAN_BLOCKS static const char* avx2_atom(const char* s) {
+    const size_t skip = (uintptr_t)s & 31;
+    const __m256i* b = (const __m256i*)(s - skip);
+    unsigned m = avx2_delimiters(_mm256_load_si256(b)) & (~0u << skip);
+    while (!m) {
+        m = avx2_delimiters(_mm256_load_si256(++b));
+    }
+    return (const char*)b + __builtin_ctz(m);
+}
+
+
+/*! \internal
+ * \brief scalar_paren(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+SCAN_BLOCKS static const char* avx2_paren(const char* s, const char* end) {
+    if (s >= end) { return end; }
+    const size_t skip = (uintptr_t)s & 31;
+    const __m256i* b = (const __m256i*)(s - skip);
+    unsigned m = avx2_parens(_mm256_load_si256(b)) & (~0u << skip);
+    while (!m) {
+        if ((const char*)++b >= end) { return end; }
+        m = avx2_parens(_mm256_load_si256(b));
+    }
+    s = (const char*)b + __builtin_ctz(m);
+    return s < end ? s : end;
+}
+
+#endif
+
+
+/*! \internal
+ * \brief A set of scans.
+ */
+struct kernel {
+    const char* name;
+    const char* (*space)(const char* s);
+    const char* (*atom)(const char* s);
+    const char* (*paren)(const char* s, const char* end);
+};
+
+
+/*! \internal
+ * \brief Every set of scans, best first.
+ */
+static const struct kernel kernels[] = {
+#ifdef SCAN_X86
+    { "avx2", avx2_space, avx2_atom, avx2_paren },
+    { "sse2", sse2_space, sse2_atom, sse2_paren },
+#endif
+    { "scalar", scalar_space, scalar_atom, scalar_paren },
+};
+
+
+/*! \internal
+ * \brief Whether the processor can run \a k.
+ */
+static bool supported(const struct kernel* k) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (0 == strcmp(k->name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (0 == strcmp(k->name, "sse2")) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return true;
+}
+
+
+/*! \internal
+ * \brief The scans in use, the best supported one until picked.
+ */
+static const struct kernel* kernel;
+
+
+/*! \internal
+ * \brief The scans in use.
+ */
+static const struct kernel* current() {
+    if (!kernel) {
+        const struct kernel* k = kernels;
+        while (!supported(k)) { ++k; }
+        kernel = k;
+    }
+    return kernel;
+}
+
+
+/*! \brief Skip white space.
+ *
+ * \param s '\\0' terminated text.
+ * \return The first byte of \a s that is not white space.
+ */
+const char* scan_space(const char* s) {
+    return current()->space(s);
+}
+
+
+/*! \brief Find the end of an atom.
+ *
+ * \param s '\\0' terminated text.
+ * \return The first white space, parenthesis or '\\0' in \a s.
+ */
+const char* scan_atom(const char* s) {
+    return current()->atom(s);
+}
+
+
+/*! \brief Find the next parenthesis.
+ *
+ * \param s Text, which need not be terminated.
+ * \param end One past the end of \a s.
+ * \return The first '(' or ')' in \a s, or \a end if there is none.
+ */
+const char* scan_paren(const char* s, const char* end) {
+    return current()->paren(s, end);
+}
+
+
+/*! \brief Use the scans called \a name.
+ *
+ * \param name "avx2", "sse2" or "scalar".
+ * \return \c false, changing nothing, if the scans are unknown or
+ * this processor cannot run them.
+ */
+bool scan_kernel(const char* name) {
+    for (size_t i = 0; i < sizeof kernels / sizeof *kernels; ++i) {
+        if (0 == strcmp(kernels[i].name, name)) {
+            if (!supported(&kernels[i])) { return false; }
+            kernel = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*! \brief Name of the scans in use.
+ */
+const char* scan_kernel_name() {
+    return current()->name;
+}
@@ -0,0 +1,31 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef SCAN_H
+#define SCAN_H
+
+/*! \file scan.h
+ */
+
+#include <stdbool.h>
+
+const char* scan_space(const char* s) ;
+const char* scan_atom(const char* s) ;
+const char* scan_paren(const char* s, const char* end) ;
+bool scan_kernel(const char* name) ;
+const char* scan_kernel_name() ;
+
+#endif
@@ -0,0 +1,260 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file stats.c
+ *
+ * \brief Event counters.
+ *
+ * The engines, cons(), symbol() and assoc() count what they do with
+ * STAT_ADD(), so a slow form can be told from a fast one by more
+ * than its time: how many forms of each kind it interpreted, how
+ * much it allocated, how long the lists it searched were and how
+ * deep it recursed.
+ *
+ * The counters are only compiled in when LISP_STATS is defined, for
+ * example with "make CPPFLAGS=-DLISP_STATS". Otherwise the macros in
+ * stats.h expand to nothing and every count reads as zero.
+ *
+ * Each thread counts in its own block, made on its first count, so
+ * threads never write to the same cache line. stats_get() adds the
+ * blocks up. Blocks outlive their threads, so nothing counted is
+ * lost.
+ */
+
+#include "stats.h"
+
+#include "cons_impl.h"
+#include "memo.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*! \internal
+ * \brief Names of the ::opcode values, for stats_print().
+ */
+static const char* const form_name[OP_COUNT] = {
+    "variable", "quote", "atom", "eq", "car", "cdr", "cons", "cond",
+    "lambda", "label"
+};
+
+
+/*! \internal
+ * \brief Where stats_time() reports, null for stderr.
+ */
+static struct sink* output;
+
+
+/*! \internal
+ * \brief printf() to a sink.
+ */
+static void say(struct sink* out, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof line, format, args);
+    va_end(args);
+    if (n > 0) {
+        sink_write(out, line, (size_t)n < sizeof line ? (size_t)n
+            : sizeof line - 1);
+    }
+}
+
+
+#ifdef LISP_STATS
+
+/*! \internal
+ * \brief The counters of one thread.
+ */
+struct block {
+    atomic_ulong n[STAT_COUNT];
+    struct block* next;
+};
+
+
+/*! \internal
+ * \brief Every block, newest first.
+ */
+static struct block* blocks;
+
+
+/*! \internal
+ * \brief Guards \c blocks.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*! \brief The counters of the calling thread, or null before its
+ * first count.
+ */
+_Thread_local atomic_ulong* stats_mine;
+
+
+/*! \brief How deep the calling thread is in eval_expr().
+ */
+_Thread_local unsigned long stats_depth;
+
+
+/*! \brief Give the calling thread its counters.
+ *
+ * Called by STAT_ADD() on the first count.
+ *
+ * \return The new counters, also in \c stats_mine.
+ */
+atomic_ulong* stats_thread() {
+    /* a line of its own, so no other thread's writes disturb it */
+    size_t size = (sizeof(struct block) + 63) & ~(size_t)63;
+    struct block* b = aligned_alloc(64, size);
+    memset(b, 0, size);
+    pthread_mutex_lock(&lock);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&lock);
+    stats_mine = b->n;
+    return stats_mine;
+}
+
+#endif
+
+
+/*! \brief Read the counters of every thread.
+ *
+ * The counts are summed, except STAT_DEPTH, which is the deepest of
+ * any thread. Counts made by other threads while this runs may or
+ * may not be included.
+ *
+ * \param stats Receives the counts, all zero without LISP_STATS.
+ */
+void stats_get(struct lisp_stats* stats) {
+    size_t i = 0;
+    for (i = 0; i < STAT_COUNT; ++i) {
+        stats->n[i] = 0;
+    }
+#ifdef LISP_STATS
+    pthread_mutex_lock(&lock);
+    struct block* b = blocks;
+    for (; b; b = b->next) {
+        for (i = 0; i < STAT_COUNT; ++i) {
+            unsigned long n = atomic_load_explicit(&b->n[i],
+                memory_order_relaxed);
+            if (i != STAT_DEPTH) {
+                stats->n[i] += n;
+            } else if (n > stats->n[i]) {
+                stats->n[i] = n;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
+
+/*! \brief Print a summary of the counters and the collector.
+ *
+ * Every line starts with ";", so the summary can follow the output
+ * of a program without being taken for a result. The memo table is
+ * reported when it has been used, see memo_stats().
+ *
+ * \param out Where to print it.
+ */
+void stats_print(struct sink* out) {
+#ifdef LISP_STATS
+    struct lisp_stats s;
+    stats_get(&s);
+    say(out, "; evals %lu, max depth %lu\n", s.n[STAT_EVALS],
+        s.n[STAT_DEPTH]);
+    say(out, ";");
+    size_t i = 0;
+    for (i = 0; i < OP_COUNT; ++i) {
+        if (s.n[STAT_FORMS + i]) {
+            say(out, " %s %lu", form_name[i], s.n[STAT_FORMS + i]);
+        }
+    }
+    if (s.n[STAT_DEFINES]) {
+        say(out, " define %lu", s.n[STAT_DEFINES]);
+    }
+    if (s.n[STAT_TIMES]) {
+        say(out, " time %lu", s.n[STAT_TIMES]);
+    }
+    say(out, "\n");
+    say(out, "; conses %lu (%lu bytes), symbols %lu (%lu bytes)\n",
+        s.n[STAT_CONSES], s.n[STAT_CONS_BYTES], s.n[STAT_SYMBOLS],
+        s.n[STAT_SYMBOL_BYTES]);
+    say(out, "; assoc steps %lu\n", s.n[STAT_ASSOC_STEPS]);
+#else
+    (void)form_name;
+    say(out, "; counters compiled out, build with -DLISP_STATS\n");
+#endif
+    struct gc_stats g;
+    gc_stats(&g);
+    say(out, "; collections %lu minor, %lu major, %.3f ms paused\n",
+        g.minors, g.majors, 1e3 * g.pause_total);
+    struct memo_stats m;
+    memo_stats(&m);
+    if (m.hits || m.misses) {
+        say(out, "; memo hits %lu, misses %lu, evictions %lu, size %zu\n",
+            m.hits, m.misses, m.evictions, m.size);
+    }
+}
+
+
+/*! \brief Send the reports of stats_time() to \a out.
+ *
+ * \param out A sink, or null for stderr, the default.
+ */
+void stats_output(struct sink* out) {
+    output = out;
+}
+
+
+/*! \brief Report what a form took, for (time expr).
+ *
+ * The report goes where stats_output() says.
+ *
+ * \param seconds Wall time taken.
+ * \param before The counters from stats_get() before the form.
+ */
+void stats_time(double seconds, const struct lisp_stats* before) {
+    struct sink err;
+    struct sink* out = output;
+    if (!out) {
+        sink_file(&err, stderr);
+        out = &err;
+    }
+    say(out, "; time %.3f ms", 1e3 * seconds);
+#ifdef LISP_STATS
+    struct lisp_stats s;
+    stats_get(&s);
+    say(out, ", evals %lu, conses %lu (%lu bytes), symbols %lu"
+        " (%lu bytes), assoc steps %lu",
+        s.n[STAT_EVALS] - before->n[STAT_EVALS],
+        s.n[STAT_CONSES] - before->n[STAT_CONSES],
+        s.n[STAT_CONS_BYTES] - before->n[STAT_CONS_BYTES],
+        s.n[STAT_SYMBOLS] - before->n[STAT_SYMBOLS],
+        s.n[STAT_SYMBOL_BYTES] - before->n[STAT_SYMBOL_BYTES],
+        s.n[STAT_ASSOC_STEPS] - before->n[STAT_ASSOC_STEPS]);
+#else
+    (void)before;
+#endif
+    say(out, "\n");
+    if (out == &err) {
+        sink_close(&err);
+    }
+}
@@ -0,0 +1,123 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+/*! \file stats.h
+ */
+
+#include "constants.h"
+#include "parser.h"
+
+#include <stdatomic.h>
+
+/*! \brief The counters, see stats_get().
+ */
+enum stat_counter {
+    /*! Forms interpreted, one per ::opcode of their head. OP_NONE
+     * counts variables. */
+    STAT_FORMS,
+    /*! Cons cells allocated. */
+    STAT_CONSES = STAT_FORMS + OP_COUNT,
+    /*! Bytes of those cells. */
+    STAT_CONS_BYTES,
+    /*! Atoms created by symbol(). */
+    STAT_SYMBOLS,
+    /*! Bytes of those atoms, names included. */
+    STAT_SYMBOL_BYTES,
+    /*! Entries assoc() looked at. */
+    STAT_ASSOC_STEPS,
+    /*! Top level definitions, see eval_top(). */
+    STAT_DEFINES,
+    /*! Top level (time expr) forms, see eval_top(). */
+    STAT_TIMES,
+    /*! Subexpressions evaluated in a nested activation: calls of
+     * eval_expr(), continuations pushed by eval_cek() and calls made
+     * by eval_vm(). */
+    STAT_EVALS,
+    /*! Deepest nesting of those activations on any thread. */
+    STAT_DEPTH,
+    STAT_COUNT
+};
+
+/*! \brief A snapshot of the counters, see stats_get().
+ */
+struct lisp_stats {
+    unsigned long n[STAT_COUNT];
+};
+
+void stats_get(struct lisp_stats* stats) ;
+void stats_print(struct sink* out) ;
+void stats_output(struct sink* out) ;
+void stats_time(double seconds, const struct lisp_stats* before) ;
+
+#ifdef LISP_STATS
+
+extern _Thread_local atomic_ulong* stats_mine;
+extern _Thread_local unsigned long stats_depth;
+atomic_ulong* stats_thread() ;
+
+/*! \brief The counters of the calling thread.
+ */
+#define STAT_BLOCK() (stats_mine ? stats_mine : stats_thread())
+
+/*! \brief Add \a k to counter \a i of the calling thread.
+ *
+ * Only the owner writes its counters, so a relaxed load and store
+ * does, with no locked instruction.
+ */
+#define STAT_ADD(i, k) do { \
+        atomic_ulong* c_ = STAT_BLOCK(); \
+        atomic_store_explicit(c_ + (i), (k) \
+            + atomic_load_explicit(c_ + (i), memory_order_relaxed), \
+            memory_order_relaxed); \
+    } while (0)
+
+/*! \brief Note that the calling thread is \a d activations deep.
+ */
+#define STAT_REACH(d) do { \
+        atomic_ulong* c_ = STAT_BLOCK(); \
+        unsigned long d_ = (d); \
+        if (d_ > atomic_load_explicit(c_ + STAT_DEPTH, \
+                memory_order_relaxed)) { \
+            atomic_store_explicit(c_ + STAT_DEPTH, d_, \
+                memory_order_relaxed); \
+        } \
+    } while (0)
+
+/*! \brief Count a call of eval_expr(), and how deep it is.
+ */
+#define STAT_ENTER() do { \
+        STAT_ADD(STAT_EVALS, 1); \
+        STAT_REACH(++stats_depth); \
+    } while (0)
+
+/*! \brief Leave the eval_expr() counted by STAT_ENTER().
+ */
+#define STAT_LEAVE() (--stats_depth)
+
+#else
+
+#define STAT_ADD(i, k) ((void)(i), (void)(k))
+#define STAT_REACH(d) ((void)0)
+#define STAT_ENTER() ((void)0)
+#define STAT_LEAVE() ((void)0)
+
+#endif
+
+#endif
@@ -22,11 +22,53 @@
  * These functions can be written in terms of the lisp understood
  * by eval() and they make writing eval() simpler. They are used
  * for handling the environment and function arguments.
+ *
+ * They are written as loops rather than recursion, so they work on
+ * lists of any length.
  */
 
 #include "utils.h"
 
 #include "constants.h"
+#include "stats.h"
+
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief A growable array of ::sexp, used where recursion would
+ * be as deep as a list is long.
+ */
+struct vec {
+    sexp* v;
+    size_t n;
+    size_t cap;
+};
+
+
+/*! \internal
+ * \brief Append \a expr to \a vec.
+ */
+static void vec_push(struct vec* vec, sexp expr) {
+    if (vec->n == vec->cap) {
+        vec->cap = vec->cap ? 2 * vec->cap : 64;
+        vec->v = realloc(vec->v, vec->cap * sizeof *vec->v);
+    }
+    vec->v[vec->n++] = expr;
+}
+
+
+/*! \internal
+ * \brief Cons the elements of \a vec onto \a tail, last first, and
+ * free \a vec.
+ */
+static sexp vec_list(struct vec* vec, sexp tail) {
+    while (vec->n) {
+        tail = cons(vec->v[--vec->n], tail);
+    }
+    free(vec->v);
+    return tail;
+}
 
 
 /*! \brief Test for \c 'nil.
@@ -52,15 +94,19 @@ sexp null(sexp expr) {
  * elements of \a list_b.
  */
 sexp append(sexp list_a, sexp list_b) {
-    if (c_bool(null(list_a))) { return list_b; }
-    return cons(car(list_a), append(cdr(list_a), list_b));
+    struct vec a = { 0, 0, 0 };
+    for (; !c_bool(null(list_a)); list_a = cdr(list_a)) {
+        vec_push(&a, car(list_a));
+    }
+    return vec_list(&a, list_b);
 }
 
 
 /*! \brief Compare two lisp expressions.
  *
  * Expressions \a expr_a and \a expr_b are equal if they have the
- * same structure.
+ * same structure. Shared subtrees are not walked, so with
+ * hash_cons() on, equal expressions are found equal at once.
  *
  * \param expr_a A symbolic lisp expression.
  * \param expr_b A symbolic lisp expression.
@@ -71,18 +117,27 @@ sexp append(sexp list_a, sexp list_b) {
  * useful for testing.
  */
 sexp equal(sexp expr_a, sexp expr_b) {
-    if (c_bool(atom(expr_a))){
-        if (c_bool(atom(expr_b))) {
-            return eq(expr_a,expr_b);
+    /* pairs of cdrs still to compare */
+    struct vec todo = { 0, 0, 0 };
+    bool same = true;
+    while (same) {
+        if (expr_a == expr_b || c_bool(atom(expr_a))
+                || c_bool(atom(expr_b))) {
+            same = expr_a == expr_b || c_bool(eq(expr_a, expr_b));
+            if (!todo.n) {
+                break;
+            }
+            expr_b = todo.v[--todo.n];
+            expr_a = todo.v[--todo.n];
+            continue;
         }
-        return ATOM_NIL();
-    }
-    if (c_bool(atom(expr_b))) {
-        return ATOM_NIL();
+        vec_push(&todo, cdr(expr_a));
+        vec_push(&todo, cdr(expr_b));
+        expr_a = car(expr_a);
+        expr_b = car(expr_b);
     }
-    return c_bool(equal(car(expr_a),car(expr_b))) &&
-        c_bool(equal(cdr(expr_a),cdr(expr_b)))
-        ? ATOM_T() : ATOM_NIL();
+    free(todo.v);
+    return same ? ATOM_T() : ATOM_NIL();
 }
 
 
@@ -102,16 +157,13 @@ sexp equal(sexp expr_a, sexp expr_b) {
  * \return A list of (key . value) pairs.
  */
 sexp pair(sexp list_a, sexp list_b) {
-    if (c_bool(null(list_a)) && c_bool(null(list_b))) {
-        return ATOM_NIL();
+    struct vec m = { 0, 0, 0 };
+    for (; !c_bool(atom(list_a)) && !c_bool(atom(list_b));
+           list_a = cdr(list_a), list_b = cdr(list_b)) {
+        vec_push(&m, cons(car(list_a), car(list_b)));
     }
-    if (!c_bool(atom(list_a)) && !c_bool(atom(list_b))) {
-        return cons(
-            cons(car(list_a),car(list_b)),
-            pair(cdr(list_a),cdr(list_b)));
-    }
-    /* TRoL has this implied */
-    return ATOM_NIL();
+    /* TRoL has the unequal lengths case implied */
+    return vec_list(&m, ATOM_NIL());
 }
 
 
@@ -123,9 +175,14 @@ sexp pair(sexp list_a, sexp list_b) {
  * otherwise.
  */
 sexp assoc(sexp key, sexp map) {
+    sexp r = key;
+    unsigned long steps = 0;
     /* TRoL missing the '() case */
-    if (c_bool(eq(map, ATOM_NIL()))) { return key; }
-    /* return car(cdr(car ? */
-    if (c_bool(eq(car(car(map)), key))) { return cdr(car(map)); }
-    return assoc(key, cdr(map));
+    for (; !c_bool(eq(map, ATOM_NIL())); map = cdr(map)) {
+        ++steps;
+        /* return car(cdr(car ? */
+        if (c_bool(eq(car(car(map)), key))) { r = cdr(car(map)); break; }
+    }
+    STAT_ADD(STAT_ASSOC_STEPS, steps);
+    return r;
 }
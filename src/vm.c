@@ -0,0 +1,607 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file vm.c
+ *
+ * \brief Bytecode compiler and virtual machine.
+ *
+ * eval() finds out what an expression is every time it evaluates
+ * it. This engine compiles each lambda body once, the first time
+ * the lambda is called, into instructions for a stack machine, and
+ * runs those instead. The compiled code is cached by the identity
+ * of the lambda expression, which cannot change because cons cells
+ * are immutable and the collector does not run during evaluation.
+ *
+ * Variables, bindings and frames are those of env.c, so scoping is
+ * exactly that of eval(). Forms that eval() would treat in unusual
+ * ways, such as a call of a variable whose value is a built-in
+ * function, or malformed special forms, are handed to eval_expr().
+ */
+
+#include "vm.h"
+
+#include "closure.h"
+#include "cons_impl.h"
+#include "constants.h"
+#include "env.h"
+#include "eval.h"
+#include "resolve.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/*! \internal
+ * \brief Instructions.
+ *
+ * Operands follow the instruction in the code. k is the index of a
+ * constant, a is the address of an instruction, n is a count.
+ */
+typedef enum {
+    I_CONST,    /*!< k: push constant k */
+    I_QUOTE,    /*!< k: same, for a quote form */
+    I_COND,     /*!< count a cond, only emitted with LISP_STATS */
+    I_VAR,      /*!< k: push the value of variable k */
+    I_REF,      /*!< k: push the value of REF k, see frame_ref() */
+    I_ATOM,     /*!< replace the top with atom(top) */
+    I_CAR,      /*!< replace the top with car(top) */
+    I_CDR,      /*!< replace the top with cdr(top) */
+    I_EQ,       /*!< replace the top two with eq() of them */
+    I_CONS,     /*!< replace the top two with cons() of them */
+    I_JUMP,     /*!< a: continue at a */
+    I_JNT,      /*!< a: pop, continue at a unless it was t */
+    I_FN,       /*!< k a: push the lambda called by call k, or
+                     evaluate call k with eval_expr() and go to a */
+    I_CALL,     /*!< n: call the lambda below the top n */
+    I_TCALL,    /*!< n: same, in tail position */
+    I_LABEL,    /*!< k: bind the name of label k */
+    I_EVAL,     /*!< n: run code n in a new activation */
+    I_TREE,     /*!< k: push eval_expr() of constant k */
+    I_RET       /*!< return the top */
+} instr;
+
+
+/*! \internal
+ * \brief Compiled code.
+ */
+struct code {
+    int* op;
+    size_t n;
+    size_t cap;
+    sexp* k;
+    size_t nk;
+    size_t kcap;
+};
+
+
+/*! \internal
+ * \brief A call in progress.
+ */
+struct record {
+    const struct code* code;
+    size_t pc;
+    /*! Depth of the value stack at the call. */
+    size_t sp;
+    struct activation act;
+};
+
+
+/*! \internal
+ * \brief The code of the current eval_vm() and the machine state.
+ *
+ * lambda is an open addressing hash table from lambda expression
+ * to the index of its code, with lambdas entries. Each thread has
+ * its own, so forms can be run on several at once.
+ */
+static _Thread_local struct {
+    struct code** codes;
+    size_t ncodes;
+    size_t codes_cap;
+    sexp* lambda;
+    unsigned* index;
+    size_t lambdas;
+    size_t lambda_cap;
+    sexp* v;
+    size_t sp;
+    size_t v_cap;
+    struct record* r;
+    size_t rp;
+    size_t r_cap;
+} vm;
+
+
+/*! \internal
+ * \brief Make room for \a n more elements in a growable array.
+ */
+static void* grow(void* p, size_t* cap, size_t used, size_t n, size_t size) {
+    if (used + n > *cap) {
+        while (used + n > *cap) {
+            *cap = *cap ? 2 * *cap : 256;
+        }
+        p = realloc(p, *cap * size);
+    }
+    return p;
+}
+
+
+/*! \internal
+ * \brief Start a new, empty code block.
+ *
+ * \return The index of the block.
+ */
+static unsigned code_new() {
+    vm.codes = grow(vm.codes, &vm.codes_cap, vm.ncodes, 1, sizeof *vm.codes);
+    vm.codes[vm.ncodes] = calloc(1, sizeof(struct code));
+    return vm.ncodes++;
+}
+
+
+/*! \internal
+ * \brief Append \a op to code \a c.
+ *
+ * \return The address of \a op.
+ */
+static size_t emit(struct code* c, int op) {
+    c->op = grow(c->op, &c->cap, c->n, 1, sizeof *c->op);
+    c->op[c->n] = op;
+    return c->n++;
+}
+
+
+/*! \internal
+ * \brief Add constant \a expr to code \a c.
+ *
+ * \return The index of the constant.
+ */
+static int konst(struct code* c, sexp expr) {
+    c->k = grow(c->k, &c->kcap, c->nk, 1, sizeof *c->k);
+    c->k[c->nk] = expr;
+    return c->nk++;
+}
+
+
+/*! \internal
+ * \brief Test for a list of at least \a n elements.
+ */
+static bool has(sexp list, unsigned n) {
+    for (; n; --n, list = cdr(list)) {
+        if (c_bool(atom(list))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*! \internal
+ * \brief Test for a (lambda params body) expression.
+ */
+static bool is_lambda(sexp expr) {
+    return !c_bool(atom(expr)) && atom_opcode(car(expr)) == OP_LAMBDA
+        && has(expr, 3);
+}
+
+
+/*! \internal
+ * \brief Test for a cond whose clauses all have a branch.
+ */
+static bool is_cond(sexp clauses) {
+    for (; !c_bool(null(clauses)); clauses = cdr(clauses)) {
+        if (c_bool(atom(clauses)) || !has(car(clauses), 2)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void compile(unsigned c, sexp expr, bool tail) ;
+
+
+/*! \internal
+ * \brief Compile the arguments of a call.
+ *
+ * \return The number of arguments.
+ */
+static int compile_args(unsigned c, sexp args) {
+    int n = 0;
+    for (; !c_bool(atom(args)); args = cdr(args), ++n) {
+        compile(c, car(args), false);
+    }
+    return n;
+}
+
+
+/*! \internal
+ * \brief Compile the call of a lambda, whose value is on the stack.
+ */
+static void compile_call(unsigned c, sexp args, bool tail) {
+    int n = compile_args(c, args);
+    emit(vm.codes[c], tail ? I_TCALL : I_CALL);
+    emit(vm.codes[c], n);
+}
+
+
+/*! \internal
+ * \brief Compile a cond.
+ */
+static void compile_cond(unsigned c, sexp clauses, bool tail) {
+    /* the addresses of the jumps to the end, chained through them */
+    size_t end = 0;
+#ifdef LISP_STATS
+    emit(vm.codes[c], I_COND);
+#endif
+    for (; !c_bool(null(clauses)); clauses = cdr(clauses)) {
+        compile(c, car(car(clauses)), false);
+        emit(vm.codes[c], I_JNT);
+        size_t next = emit(vm.codes[c], 0);
+        compile(c, car(cdr(car(clauses))), tail);
+        if (!tail) {
+            emit(vm.codes[c], I_JUMP);
+            end = emit(vm.codes[c], (int)end);
+        }
+        vm.codes[c]->op[next] = (int)vm.codes[c]->n;
+    }
+    struct code* code = vm.codes[c];
+    emit(code, I_CONST);
+    emit(code, konst(code, ATOM_NIL()));
+    if (tail) {
+        emit(code, I_RET);
+    }
+    while (end) {
+        size_t prev = (size_t)code->op[end];
+        code->op[end] = (int)code->n;
+        end = prev;
+    }
+}
+
+
+/*! \internal
+ * \brief Compile \a expr into code \a c.
+ *
+ * The code leaves the value of \a expr on the stack. In tail
+ * position it returns it instead.
+ */
+static void compile(unsigned c, sexp expr, bool tail) {
+    struct code* code = vm.codes[c];
+    if (SEXP_TYPE(expr) == REF || c_bool(atom(expr))) {
+        emit(code, SEXP_TYPE(expr) == REF ? I_REF : I_VAR);
+        emit(code, konst(code, expr));
+    } else {
+        sexp head = car(expr);
+        sexp args = cdr(expr);
+        int op = -1;
+        unsigned operands = 1;
+        if (c_bool(atom(head))) {
+            switch (atom_opcode(head)) {
+            case OP_QUOTE:
+                if (has(args, 1)) {
+                    emit(code, I_QUOTE);
+                    emit(code, konst(code, car(args)));
+                    op = I_QUOTE;
+                    operands = 0;
+                }
+                break;
+            case OP_ATOM: op = I_ATOM; break;
+            case OP_CAR: op = I_CAR; break;
+            case OP_CDR: op = I_CDR; break;
+            case OP_EQ: op = I_EQ; operands = 2; break;
+            case OP_CONS: op = I_CONS; operands = 2; break;
+            case OP_COND:
+                if (is_cond(args)) {
+                    compile_cond(c, args, tail);
+                    return;
+                }
+                break;
+            default: {
+                /* a named function, its value is only known later */
+                emit(code, I_FN);
+                emit(code, konst(code, expr));
+                size_t skip = emit(code, 0);
+                compile_call(c, args, tail);
+                vm.codes[c]->op[skip] = (int)vm.codes[c]->n;
+                if (tail) {
+                    emit(vm.codes[c], I_RET);
+                }
+                return;
+            }
+            }
+            if (op >= 0 && operands && has(args, operands)) {
+                compile(c, car(args), false);
+                if (operands == 2) {
+                    compile(c, car(cdr(args)), false);
+                }
+                emit(vm.codes[c], op);
+            } else if (operands) {
+                op = -1;
+            }
+        } else if (is_lambda(head)) {
+            emit(code, I_CONST);
+            emit(code, konst(code, head));
+            compile_call(c, args, tail);
+            return;
+        } else if (atom_opcode(car(head)) == OP_LABEL && has(head, 3)
+                && is_lambda(car(cdr(cdr(head))))) {
+            if (!tail) {
+                /* the label name is only bound in its own activation */
+                unsigned sub = code_new();
+                compile(sub, expr, true);
+                emit(vm.codes[c], I_EVAL);
+                emit(vm.codes[c], (int)sub);
+                return;
+            }
+            emit(code, I_LABEL);
+            emit(code, konst(code, head));
+            emit(code, I_CONST);
+            emit(code, konst(code, car(cdr(cdr(head)))));
+            compile_call(c, args, true);
+            return;
+        }
+        if (op < 0) {
+            emit(vm.codes[c], I_TREE);
+            emit(vm.codes[c], konst(vm.codes[c], expr));
+        }
+    }
+    if (tail) {
+        emit(vm.codes[c], I_RET);
+    }
+}
+
+
+/*! \internal
+ * \brief Get the code of the body of \a lambda, compiling it if
+ * this is the first call.
+ */
+static const struct code* lambda_code(sexp lambda) {
+    if (2 * (vm.lambdas + 1) > vm.lambda_cap) {
+        sexp* lambda_old = vm.lambda;
+        unsigned* index_old = vm.index;
+        size_t cap_old = vm.lambda_cap;
+        vm.lambda_cap = cap_old ? 2 * cap_old : 256;
+        vm.lambda = calloc(vm.lambda_cap, sizeof *vm.lambda);
+        vm.index = calloc(vm.lambda_cap, sizeof *vm.index);
+        size_t i = 0;
+        for (i = 0; i < cap_old; ++i) {
+            if (lambda_old[i]) {
+                size_t j = ((uintptr_t)lambda_old[i] >> 4) & (vm.lambda_cap - 1);
+                while (vm.lambda[j]) { j = (j + 1) & (vm.lambda_cap - 1); }
+                vm.lambda[j] = lambda_old[i];
+                vm.index[j] = index_old[i];
+            }
+        }
+        free(lambda_old);
+        free(index_old);
+    }
+    size_t j = ((uintptr_t)lambda >> 4) & (vm.lambda_cap - 1);
+    while (vm.lambda[j] && vm.lambda[j] != lambda) {
+        j = (j + 1) & (vm.lambda_cap - 1);
+    }
+    if (!vm.lambda[j]) {
+        unsigned c = code_new();
+        compile(c, closure_of(lambda)->body, true);
+        vm.lambda[j] = lambda;
+        vm.index[j] = c;
+        ++vm.lambdas;
+    }
+    return vm.codes[vm.index[j]];
+}
+
+
+/*! \internal
+ * \brief Push \a expr on the value stack.
+ */
+static void push(sexp expr) {
+    if (vm.sp == vm.v_cap) {
+        vm.v = grow(vm.v, &vm.v_cap, vm.sp, 1, sizeof *vm.v);
+    }
+    vm.v[vm.sp++] = expr;
+}
+
+
+/*! \internal
+ * \brief Start running \a code in a new activation.
+ */
+static struct record* call(const struct code* code) {
+    vm.r = grow(vm.r, &vm.r_cap, vm.rp, 1, sizeof *vm.r);
+    struct record* r = &vm.r[vm.rp++];
+    r->code = code;
+    r->pc = 0;
+    r->sp = vm.sp;
+    act_begin(&r->act);
+    STAT_ADD(STAT_EVALS, 1);
+    STAT_REACH(vm.rp);
+    return r;
+}
+
+
+/*! \internal
+ * \brief Move the top \a n values to the frame slots.
+ *
+ * \return The first slot.
+ */
+static size_t args(int n) {
+    size_t top = frame_mark();
+    size_t i = vm.sp - n;
+    for (; i < vm.sp; ++i) {
+        frame_arg(vm.v[i]);
+    }
+    vm.sp -= n;
+    return top;
+}
+
+
+/*! \internal
+ * \brief Run \a code until it returns.
+ */
+static sexp run(const struct code* code) {
+    size_t bottom = vm.rp;
+    struct record* r = call(code);
+    for (;;) {
+        const int* op = &r->code->op[r->pc];
+        sexp const* k = r->code->k;
+        r->pc += 1;
+        switch ((instr)op[0]) {
+        case I_QUOTE:
+            STAT_ADD(STAT_FORMS + OP_QUOTE, 1);
+            /* fall through */
+        case I_CONST:
+            push(k[op[1]]);
+            r->pc += 1;
+            break;
+        case I_COND:
+            STAT_ADD(STAT_FORMS + OP_COND, 1);
+            break;
+        case I_VAR:
+            STAT_ADD(STAT_FORMS + OP_NONE, 1);
+            push(lookup(k[op[1]]));
+            r->pc += 1;
+            break;
+        case I_REF:
+            STAT_ADD(STAT_FORMS + OP_NONE, 1);
+            push(frame_ref(k[op[1]]));
+            r->pc += 1;
+            break;
+        case I_ATOM:
+            STAT_ADD(STAT_FORMS + OP_ATOM, 1);
+            vm.v[vm.sp - 1] = atom(vm.v[vm.sp - 1]);
+            break;
+        case I_CAR:
+            STAT_ADD(STAT_FORMS + OP_CAR, 1);
+            vm.v[vm.sp - 1] = car(vm.v[vm.sp - 1]);
+            break;
+        case I_CDR:
+            STAT_ADD(STAT_FORMS + OP_CDR, 1);
+            vm.v[vm.sp - 1] = cdr(vm.v[vm.sp - 1]);
+            break;
+        case I_EQ:
+            STAT_ADD(STAT_FORMS + OP_EQ, 1);
+            --vm.sp;
+            vm.v[vm.sp - 1] = eq(vm.v[vm.sp - 1], vm.v[vm.sp]);
+            break;
+        case I_CONS:
+            STAT_ADD(STAT_FORMS + OP_CONS, 1);
+            --vm.sp;
+            vm.v[vm.sp - 1] = cons(vm.v[vm.sp - 1], vm.v[vm.sp]);
+            break;
+        case I_JUMP:
+            r->pc = op[1];
+            break;
+        case I_JNT:
+            r->pc = c_bool(eq(ATOM_T(), vm.v[--vm.sp])) ? r->pc + 1 : (size_t)op[1];
+            break;
+        case I_FN: {
+            sexp fn = lookup_fn(car(k[op[1]]));
+            if (fn && is_lambda(fn)) {
+                push(fn);
+                r->pc += 2;
+            } else {
+                push(fn ? eval_expr(cons(fn, cdr(k[op[1]]))) : ATOM_NIL());
+                r->pc = op[2];
+            }
+            break;
+        }
+        case I_CALL: {
+            STAT_ADD(STAT_FORMS + OP_LAMBDA, 1);
+            sexp fn = vm.v[vm.sp - op[1] - 1];
+            const struct code* code = lambda_code(fn);
+            const struct closure* f = closure_of(fn);
+            r->pc += 1;
+            r = call(code);
+            act_enter(&r->act, args(op[1]), f->params, f->arity);
+            --vm.sp;
+            r->sp = vm.sp;
+            break;
+        }
+        case I_TCALL: {
+            STAT_ADD(STAT_FORMS + OP_LAMBDA, 1);
+            sexp fn = vm.v[vm.sp - op[1] - 1];
+            r->code = lambda_code(fn);
+            const struct closure* f = closure_of(fn);
+            act_enter(&r->act, args(op[1]), f->params, f->arity);
+            vm.sp = r->sp;
+            r->pc = 0;
+            break;
+        }
+        case I_LABEL: {
+            STAT_ADD(STAT_FORMS + OP_LABEL, 1);
+            sexp label = k[op[1]];
+            rebind(r->act.mark, car(cdr(label)), car(cdr(cdr(label))));
+            /* see eval_tail() */
+            act_enter(&r->act, frame_mark(), 0, 0);
+            r->pc += 1;
+            break;
+        }
+        case I_EVAL:
+            r->pc += 1;
+            r = call(vm.codes[op[1]]);
+            break;
+        case I_TREE:
+            push(eval_expr(k[op[1]]));
+            r->pc += 1;
+            break;
+        case I_RET: {
+            sexp v = vm.v[vm.sp - 1];
+            act_end(&r->act);
+            vm.sp = r->sp;
+            --vm.rp;
+            if (vm.rp == bottom) {
+                return v;
+            }
+            r = &vm.r[vm.rp - 1];
+            push(v);
+            break;
+        }
+        }
+    }
+}
+
+
+/*! \brief Interpret a lisp expression by compiling it.
+ *
+ * Same as eval(), but lambda bodies are compiled to bytecode on
+ * their first call and run by a virtual machine.
+ *
+ * \param expr Lisp expression.
+ * \param env Dictionary of variables in scope.
+ * \return Result of evaluation.
+ */
+sexp eval_vm(sexp expr, sexp env) {
+    size_t mark = bind_mark();
+    bind_alist(env);
+    struct frame prev = frame_enter(frame_mark(), 0, 0, mark);
+    unsigned c = code_new();
+    compile(c, resolve(expr), true);
+    sexp r = run(vm.codes[c]);
+    unbind(mark);
+    frame_leave(prev);
+
+    /* the collector may move the lambdas before the next call */
+    size_t i = 0;
+    for (i = 0; i < vm.ncodes; ++i) {
+        free(vm.codes[i]->op);
+        free(vm.codes[i]->k);
+        free(vm.codes[i]);
+    }
+    vm.ncodes = 0;
+    for (i = 0; i < vm.lambda_cap; ++i) {
+        vm.lambda[i] = 0;
+    }
+    vm.lambdas = 0;
+    return r;
+}
@@ -19,6 +19,7 @@
 
 
 #include "cons.h"
+#include "constants.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -28,12 +29,16 @@ void test_symbol();
 void test_cons();
 void test_atom();
 void test_eq();
+void test_intern();
+void test_opcode();
 
 int main(int argc, char* argv[]) {
     test_symbol();
     test_cons();
     test_atom();
     test_eq();
+    test_intern();
+    test_opcode();
 
     printf("\n");
 
@@ -82,3 +87,25 @@ void test_eq() {
     TEST(false == c_bool(eq(pcar,pcdr)));
     TEST(false == c_bool(eq(pcons,pcar)));
 }
+
+void test_intern() {
+    const char* const strcar = "car";
+    const char* const strbuf = "carcdr";
+    sexp pcar = symbol(strcar, strlen(strcar));
+    sexp pcar2 = symbol(strbuf, 3);
+
+    TEST(pcar == pcar2);
+    TEST(pcar == ATOM_CAR());
+    TEST(symbol("t", 1) == ATOM_T());
+    TEST(symbol("nil", 3) == ATOM_NIL());
+    TEST(0 == strcmp(c_str(symbol(strbuf, 6)), strbuf));
+    TEST(c_bool(symbol("t", 1)));
+}
+
+void test_opcode() {
+    TEST(OP_COND == atom_opcode(symbol("cond", 4)));
+    TEST(OP_QUOTE == atom_opcode(ATOM_QUOTE()));
+    TEST(OP_NONE == atom_opcode(symbol("conde", 5)));
+    TEST(OP_NONE == atom_opcode(ATOM_T()));
+    TEST(OP_NONE == atom_opcode(cons(ATOM_CAR(), ATOM_NIL())));
+}
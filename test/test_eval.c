@@ -17,21 +17,51 @@
 
 #include "test.h"
 
+#include "cek.h"
+#include "closure.h"
 #include "cons.h"
+#include "cons_impl.h"
 #include "constants.h"
+#include "env.h"
 #include "eval.h"
+#include "memo.h"
 #include "parser.h"
+#include "pool.h"
+#include "stats.h"
 #include "utils.h"
+#include "vm.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 void test_eval();
+void test_tail();
+void test_deep();
+void test_closure();
+void test_memo();
+void test_define();
+void test_ctx();
+void test_stats();
+void test_pool();
+static sexp eval_memo(sexp expr, sexp env);
+
+/* every engine must pass test_eval() and test_tail() */
+static engine engines[] = { eval, eval_cek, eval_vm, eval_memo };
+static int n_engines = sizeof(engines)/sizeof(engine);
 
 int main(int argc, char* argv[]) {
     test_eval();
+    test_tail();
+    test_deep();
+    test_closure();
+    test_memo();
+    test_define();
+    test_ctx();
+    test_stats();
+    test_pool();
     printf("\n");
 
     return 0;
@@ -74,7 +104,23 @@ void test_eval() {
         "((lambda () 3))",
         "((lambda (a) a) 4)",
         "((label f (lambda () 42)))",
-        "f"
+        "f",
+        "((lambda (f x) (f)) '(lambda () x) 'dyn)",
+        "((lambda (x x) x) 'a 'b)",
+        "((lambda (x) (cons ((lambda (x) x) 'b) x)) 'a)",
+        "((lambda (key) key) 'shadow)",
+        "((lambda (x y) y) 'a)",
+        "((lambda (cons) (cons cons cons)) 'a)",
+        "((lambda (x) ((label x (lambda (y) y)) x)) 'a)",
+        "((label f (lambda (x) (cond ((eq x 'a) f) ('t x)))) 'a)",
+        "((lambda (b) ((lambda (h) (h 'p 'q)) (cons 'lambda (cons '(y x) (cons b '()))))) (car (cdr (cdr ((label f (lambda (x) (cond ((eq x 'a) f) ('t x)))) 'a)))))",
+        "((lambda (x) ((lambda (y) (cons x y)) 'b)) 'a)",
+        "((lambda (f) ((label f (lambda (x) x)) f)) 'v)",
+        "(nosuch 'a)",
+        "(cond ((eq 'a 'b) 'c))",
+        "((lambda (f) (f 'p 'q)) '(lambda (x x) x))",
+        "((lambda (f) (f 'b)) '(lambda (x) ((lambda (y) x) 'c)))",
+        "((lambda (f) (f 'b)) '(lambda))"
     };
 
     char* result[] = {
@@ -107,20 +153,422 @@ void test_eval() {
         "3",
         "4",
         "42",
-        "f"
+        "f",
+        "dyn",
+        "a",
+        "(b . a)",
+        "shadow",
+        "y",
+        "(a . a)",
+        "(lambda (y) y)",
+        "(lambda (x) (cond ((eq x 'a) f) ('t x)))",
+        "q",
+        "(a . b)",
+        "(lambda (x) x)",
+        "nil",
+        "nil",
+        "p",
+        "b",
+        "nil"
     };
 
     TEST(sizeof(test) == sizeof(result));
 
     int i = 0;
+    int j = 0;
+
+    for (j = 0; j < n_engines; ++j) {
+        for (i = 0; i < sizeof(test)/sizeof(char*); ++i) {
+            const char* p = test[i];
+
+            sexp e = parse(&p);
+            sexp r = engines[j](e,env);
+
+            print_list_notation(str, sizeof(str)/sizeof(char), r);
+            TEST(0 == strcmp(str, result[i]));
+        }
+    }
+}
+
+
+void test_tail() {
+    /* a loop this long overflows the C stack unless tail calls loop */
+    const int n = 1000000;
+    sexp l = cons(symbol("b", 1), ATOM_NIL());
+    int i = 0;
+    for (i = 1; i < n; ++i) {
+        l = cons(symbol("a", 1), l);
+    }
+    const char* k = "l";
+    sexp env = cons(cons(parse(&k), l), ATOM_NIL());
+
+    int j = 0;
+    for (j = 0; j < n_engines; ++j) {
+        const char* p = "((label last (lambda (l) (cond ((atom (cdr l)) (car l)) ('t (last (cdr l)))))) l)";
+        TEST(eq(engines[j](parse(&p), env), symbol("b", 1)) == ATOM_T());
+
+        /* the same loop, through two functions */
+        p = "((label even (lambda (l) (cond ((atom l) 'even) ('t ((lambda (l) (cond ((atom l) 'odd) ('t (even (cdr l))))) (cdr l)))))) l)";
+        TEST(eq(engines[j](parse(&p), env), symbol("even", 4)) == ATOM_T());
+    }
+}
+
+
+void test_deep() {
+    /* recursion this deep overflows the C stack in eval() */
+    const int n = 1000000;
+    sexp l = ATOM_NIL();
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        l = cons(symbol(i % 2 ? "a" : "b", 1), l);
+    }
+    const char* k = "l";
+    sexp env = cons(cons(parse(&k), l), ATOM_NIL());
+
+    const char* p = "((label copy (lambda (l) (cond ((atom l) l) ('t (cons (car l) (copy (cdr l))))))) l)";
+    sexp r = eval_cek(parse(&p), env);
+    TEST(r != l);
+    TEST(c_bool(equal(r, l)));
 
-    for (i = 0; i < sizeof(test)/sizeof(char*); ++i) {
-        const char* p = test[i];
+    /* and resolving a form this deep, (cdr (cdr ... l)) */
+    sexp f = car(car(env));
+    for (i = 0; i < n; ++i) {
+        f = cons(symbol("cdr", 3), cons(f, ATOM_NIL()));
+    }
+    TEST(eval_cek(f, env) == ATOM_NIL());
+
+    /* append and pair are loops too */
+    TEST(c_bool(equal(cdr(append(cons(ATOM_T(), ATOM_NIL()), l)), l)));
+    TEST(cdr(car(pair(l, l))) == symbol("a", 1));
+}
+
+
+void test_closure() {
+    const char* p = "(lambda (x y) (cons y x))";
+    sexp lambda = parse(&p);
+    const struct closure* f = closure_of(lambda);
+
+    TEST(f && f->lambda == lambda);
+    TEST(f->arity == 2);
+    TEST(f->params[1] == symbol("y", 1));
+    /* the body is resolved, but still prints the same */
+    TEST(f->body != car(cdr(cdr(lambda))));
+    TEST(c_bool(equal(f->body, car(cdr(cdr(lambda))))));
+    TEST(closure_of(lambda) == f);
+
+    p = "(lambda (x))";
+    TEST(closure_of(parse(&p)) == 0);
+
+    p = "(lambda (l) (cond ((atom l) l) ('t (f (cdr l)))))";
+    f = closure_of(parse(&p));
+    TEST(f->pure && f->self == symbol("f", 1));
+    /* a free variable and a free function are two free names */
+    p = "(lambda (l) (f (cons l y)))";
+    TEST(!closure_of(parse(&p))->pure);
+    p = "(lambda (l) (g (f l)))";
+    TEST(!closure_of(parse(&p))->pure);
+    /* so is calling a parameter */
+    p = "(lambda (g l) (g l))";
+    TEST(!closure_of(parse(&p))->pure);
+}
+
+
+/*! \brief eval() with a small memo table.
+ */
+static sexp eval_memo(sexp expr, sexp env) {
+    memo_limit(2);
+    sexp r = eval(expr, env);
+    memo_limit(0);
+    return r;
+}
+
+
+void test_memo() {
+    /* calls itself three times per element, 3^30 calls without memo */
+    const char* p =
+        "((label f (lambda (l) (cond ((atom l) 'a)"
+        "                            ((eq (f (cdr l)) (f (cdr l))) (f (cdr l)))"
+        "                            ('t 'b))))"
+        " '(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15"
+        "   16 17 18 19 20 21 22 23 24 25 26 27 28 29 30))";
+    sexp e = parse(&p);
+    struct memo_stats s;
+
+    memo_limit(100);
+    TEST(eq(eval(e, ATOM_NIL()), symbol("a", 1)) == ATOM_T());
+    memo_stats(&s);
+    TEST(s.misses == 31 && s.hits == 60 && s.evictions == 0);
+    TEST(s.size == 31);
+
+    /* the arguments are used right after the first call, so the
+     * least recently used entry can go */
+    memo_limit(1);
+    TEST(eq(eval(e, ATOM_NIL()), symbol("a", 1)) == ATOM_T());
+    memo_stats(&s);
+    TEST(s.misses == 31 && s.hits == 60 && s.evictions == 30);
+    TEST(s.size == 1);
+
+    /* y is free, so g is not pure */
+    memo_limit(100);
+    const char* k = "y";
+    sexp env = cons(cons(parse(&k), symbol("b", 1)), ATOM_NIL());
+    p = "((label g (lambda (l) (cond ((atom l) y) ('t (g (cdr l))))))"
+        " '(1 2 3))";
+    TEST(eq(eval(parse(&p), env), symbol("b", 1)) == ATOM_T());
+    memo_stats(&s);
+    TEST(s.misses == 0 && s.size == 0);
+
+    /* a tail call shares the caller's result */
+    p = "((label last (lambda (l) (cond ((atom (cdr l)) (car l))"
+        "                              ('t (last (cdr l))))))"
+        " '(1 2 3 c))";
+    TEST(eq(eval(parse(&p), ATOM_NIL()), symbol("c", 1)) == ATOM_T());
+    memo_stats(&s);
+    TEST(s.misses == 4 && s.size == 4);
+    memo_limit(0);
+}
+
+
+void test_define() {
+    int i = 0;
+    for (i = 0; i < n_engines; ++i) {
+        const char* p = "(define subst (lambda (x y z)"
+            " (cond ((atom z) (cond ((eq z y) x) ('t z)))"
+            "       ('t (cons (subst x y (car z)) (subst x y (cdr z)))))))";
+        sexp r = eval_top(engines[i], parse(&p), ATOM_NIL());
+        TEST(r == symbol("subst", 5));
+        p = "(define z (cdr '(a b (a b c) d)))";
+        TEST(eval_top(engines[i], parse(&p), ATOM_NIL()) == symbol("z", 1));
 
-        sexp e = parse(&p);
-        sexp r = eval(e,env);
+        /* definitions outlive the form, and collections */
+        region_begin();
+        region_end(ATOM_NIL());
+        gc_sexp(ATOM_NIL());
+        char str[100];
+        p = "(subst 'm 'b z)";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), ATOM_NIL()));
+        TEST(0 == strcmp(str, "(m (a m c) d)"));
 
-        print_list_notation(str, sizeof(str)/sizeof(char), r);
-        TEST(0 == strcmp(str, result[i]));
+        /* bindings come first */
+        p = "((lambda (z) (subst 'm 'b z)) '(b))";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), ATOM_NIL()));
+        TEST(0 == strcmp(str, "(m)"));
+        const char* k = "(z)";
+        const char* v = "((c b))";
+        sexp env = pair(parse(&k), parse(&v));
+        p = "(subst 'm 'b z)";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), env));
+        TEST(0 == strcmp(str, "(c m)"));
+
+        /* a definition replaces the last, and only counts at the top */
+        p = "(define z 'b)";
+        eval_top(engines[i], parse(&p), ATOM_NIL());
+        p = "(cons (define z 'c) z)";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), ATOM_NIL()));
+        TEST(0 == strcmp(str, "(nil . b)"));
+        p = "(define . z)";
+        TEST(c_bool(null(eval_top(engines[i], parse(&p), ATOM_NIL()))));
+
+        /* below the top level define is an ordinary name */
+        p = "((lambda (define) (define 'a)) '(lambda (x) (cons x x)))";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), ATOM_NIL()));
+        TEST(0 == strcmp(str, "(a . a)"));
+        p = "((label define (lambda (x) (cond ((atom x) x) ('t (define (car x)))))) '((q)))";
+        TEST(eval_top(engines[i], parse(&p), ATOM_NIL()) == symbol("q", 1));
+
+        /* a label form is bound as it is, like a lambda */
+        p = "(define first (label first (lambda (l) (cond ((atom (car l)) (car l)) ('t (first (car l)))))))";
+        eval_top(engines[i], parse(&p), ATOM_NIL());
+        p = "(first '(((r)) s))";
+        TEST(eval_top(engines[i], parse(&p), ATOM_NIL()) == symbol("r", 1));
+    }
+    TEST(c_bool(equal(car(car(globals_alist())), symbol("subst", 5))));
+}
+
+
+/* run a library and a query in a context of its own */
+static void* ctx_run(void* arg) {
+    struct lisp_ctx* c = lisp_ctx_new();
+    lisp_ctx_enter(c);
+    const char* p = "(define subst '(lambda (x y z)"
+        " (cond ((atom z) (cond ((eq z y) x) ('t z)))"
+        "       ('t (cons (subst x y (car z)) (subst x y (cdr z)))))))";
+    eval_top(eval, parse(&p), ATOM_NIL());
+    bool ok = true;
+    int i = 0;
+    for (i = 0; i < 200 && ok; ++i) {
+        char str[100];
+        region_begin();
+        p = "(subst 'm 'b '(a b (a b c) d))";
+        print_list_notation(str, sizeof str,
+            eval_top(eval, parse(&p), ATOM_NIL()));
+        ok = 0 == strcmp(str, "(a m (a m c) d)");
+        region_end(ATOM_NIL());
+    }
+    lisp_ctx_enter(0);
+    lisp_ctx_free(c);
+    *(bool*)arg = ok;
+    return 0;
+}
+
+
+void test_ctx() {
+    struct lisp_ctx* c = lisp_ctx_new();
+    sexp a = symbol("only-here", 9);
+    const char* p = "(define z 'outside)";
+    eval_top(eval, parse(&p), ATOM_NIL());
+
+    TEST(lisp_ctx_enter(c) == 0);
+    TEST(lisp_ctx_current() == c);
+    TEST(symbol("only-here", 9) != a);
+    TEST(symbol("quote", 5) == ATOM_QUOTE());
+    p = "z";
+    TEST(eval(parse(&p), ATOM_NIL()) == symbol("z", 1));
+    p = "(define z 'inside)";
+    eval_top(eval, parse(&p), ATOM_NIL());
+    p = "z";
+    TEST(eval(parse(&p), ATOM_NIL()) == symbol("inside", 6));
+    TEST(lisp_ctx_enter(0) == c);
+
+    p = "z";
+    TEST(eval(parse(&p), ATOM_NIL()) == symbol("outside", 7));
+    TEST(symbol("only-here", 9) == a);
+    lisp_ctx_free(c);
+
+    /* contexts on threads of their own share nothing */
+    pthread_t thread[4];
+    bool ok[4];
+    int i = 0;
+    for (i = 0; i < 4; ++i) {
+        pthread_create(&thread[i], 0, ctx_run, &ok[i]);
+    }
+    for (i = 0; i < 4; ++i) {
+        pthread_join(thread[i], 0);
+        TEST(ok[i]);
+    }
+}
+
+
+void test_stats() {
+    struct lisp_stats before;
+    struct lisp_stats after;
+    const char* p = "((label subst (lambda (x y z) (cond ((atom z) (cond ((eq z y) x) ('t z))) ('t (cons (subst x y (car z)) (subst x y (cdr z))))))) 'm 'b '(a b (a b c) d))";
+    sexp e = parse(&p);
+
+    /* every engine counts, the memo table would skip some forms */
+    int i = 0;
+    for (i = 0; i < 3; ++i) {
+        stats_get(&before);
+        engines[i](e, ATOM_NIL());
+        stats_get(&after);
+        /* one cons form per cell of the result */
+        TEST(after.n[STAT_FORMS + OP_CONS] - before.n[STAT_FORMS + OP_CONS] == 7);
+        TEST(after.n[STAT_FORMS + OP_LABEL] - before.n[STAT_FORMS + OP_LABEL] == 1);
+        TEST(after.n[STAT_FORMS + OP_COND] > before.n[STAT_FORMS + OP_COND]);
+        TEST(after.n[STAT_FORMS + OP_QUOTE] > before.n[STAT_FORMS + OP_QUOTE]);
+        TEST(after.n[STAT_CONSES] - before.n[STAT_CONSES] >= 7);
+        TEST(after.n[STAT_CONS_BYTES] - before.n[STAT_CONS_BYTES]
+            == (after.n[STAT_CONSES] - before.n[STAT_CONSES])
+                * sizeof(struct cons_impl));
+        TEST(after.n[STAT_EVALS] > before.n[STAT_EVALS]);
+        TEST(after.n[STAT_SYMBOLS] == before.n[STAT_SYMBOLS]);
+    }
+    TEST(after.n[STAT_DEPTH] >= 4);
+
+    before = after;
+    sexp k = symbol("never-seen", 10);
+    const char* a = "(x y z)";
+    const char* b = "(a b c)";
+    TEST(assoc(symbol("z", 1), pair(parse(&a), parse(&b))) == symbol("c", 1));
+    TEST(assoc(k, ATOM_NIL()) == k);
+    stats_get(&after);
+    TEST(after.n[STAT_ASSOC_STEPS] - before.n[STAT_ASSOC_STEPS] == 3);
+    TEST(after.n[STAT_SYMBOLS] - before.n[STAT_SYMBOLS] == 1);
+    TEST(after.n[STAT_SYMBOL_BYTES] - before.n[STAT_SYMBOL_BYTES] > 10);
+
+    /* time is only seen at the top, and is the form it times */
+    struct sink out;
+    sink_buffer(&out);
+    stats_output(&out);
+    p = "(time (cons 'a 'b))";
+    e = parse(&p);
+    char str[100];
+    print_list_notation(str, sizeof str, eval_top(eval, e, ATOM_NIL()));
+    TEST(0 == strcmp(str, "(a . b)"));
+    TEST(0 == strncmp(out.buf, "; time ", 7));
+    TEST(strstr(out.buf, ", conses 1 (") && strchr(out.buf, '\n'));
+    stats_output(0);
+    sink_close(&out);
+
+    /* below the top level time is an ordinary name */
+    for (i = 0; i < n_engines; ++i) {
+        print_list_notation(str, sizeof str, engines[i](e, ATOM_NIL()));
+        TEST(0 == strcmp(str, "nil"));
+        p = "((lambda (time) (time 'a)) '(lambda (x) (cons x x)))";
+        print_list_notation(str, sizeof str, eval_top(engines[i], parse(&p), ATOM_NIL()));
+        TEST(0 == strcmp(str, "(a . a)"));
+    }
+}
+
+
+/* a whole form run by the pool */
+struct form_task {
+    struct task task;
+    sexp expr;
+    engine run;
+    sexp env;
+    sexp value;
+};
+
+static void form_run(struct task* task, bool stolen) {
+    struct form_task* f = (struct form_task*)task;
+    (void)stolen;
+    f->value = f->run(f->expr, f->env);
+}
+
+
+/* a complete tree of the given depth, with leaves a and b */
+static sexp make_tree(int depth, sexp a, sexp b) {
+    if (!depth) {
+        return a;
+    }
+    return cons(make_tree(depth - 1, a, b), make_tree(depth - 1, b, a));
+}
+
+
+void test_pool() {
+    pool_start(4);
+    TEST(pool_size() == 4 && pool_depth() > 0);
+    /* the memo table is not shared safely, leave eval_memo out */
+    n_engines = 3;
+    test_eval();
+    test_tail();
+
+    sexp a = symbol("a", 1);
+    sexp b = symbol("b", 1);
+    const char* k = "z";
+    sexp env = cons(cons(parse(&k), make_tree(16, a, b)), ATOM_NIL());
+    const char* form = "((label subst (lambda (x y z) (cond ((atom z) (cond ((eq z y) x) ('t z))) ('t (cons (subst x y (car z)) (subst x y (cdr z))))))) 'm 'b z)";
+    const char* p = form;
+    sexp r = eval(parse(&p), env);
+    TEST(c_bool(equal(r, make_tree(16, a, symbol("m", 1)))));
+
+    /* whole forms on the pool, every engine on every thread at once */
+    struct form_task task[12];
+    int i = 0;
+    pool_limit(0);
+    for (i = 0; i < 12; ++i) {
+        p = form;
+        task[i].task.run = form_run;
+        task[i].expr = parse(&p);
+        task[i].run = engines[i % n_engines];
+        task[i].env = env;
+        pool_fork(&task[i].task);
+    }
+    for (i = 12; i > 0; --i) {
+        pool_join(&task[i - 1].task);
+    }
+    for (i = 0; i < 12; ++i) {
+        TEST(c_bool(equal(task[i].value, r)));
     }
 }
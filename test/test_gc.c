@@ -0,0 +1,297 @@
+/* Copyright 2008 Adam Burry
+ *
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+
+
+#include "cons_impl.h"
+#include "constants.h"
+#include "utils.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+
+void test_survive();
+void test_shared();
+void test_root();
+void test_garbage();
+void test_major();
+void test_region();
+void test_ref();
+void test_hash_cons();
+void test_image();
+
+int main(int argc, char* argv[]) {
+    test_survive();
+    test_shared();
+    test_root();
+    test_garbage();
+    test_major();
+    test_region();
+    test_ref();
+    test_hash_cons();
+    test_image();
+
+    struct gc_stats stats;
+    struct rusage usage;
+    gc_stats(&stats);
+    getrusage(RUSAGE_SELF, &usage);
+    printf("\ngc: %lu minor, %lu major, pause max %.3f ms, "
+        "mean %.3f ms, peak rss %ld kB",
+        stats.minors, stats.majors, 1000 * stats.pause_max,
+        1000 * stats.pause_total / (stats.minors + stats.majors),
+        usage.ru_maxrss);
+
+    printf("\n");
+
+    return 0;
+}
+
+/* build the list (0 1 ... n-1) of atoms a and b */
+static sexp make_list(int n) {
+    sexp r = ATOM_NIL();
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        r = cons(i % 2 ? symbol("a", 1) : symbol("b", 1), r);
+    }
+    return r;
+}
+
+void test_survive() {
+    sexp a = symbol("a", 1);
+    sexp b = symbol("b", 1);
+    sexp c = symbol("c", 1);
+    sexp l = cons(a, cons(cons(b, c), ATOM_NIL()));
+    sexp m = gc_sexp(l);
+
+    TEST(m != l);
+    TEST(car(m) == a);
+    TEST(car(car(cdr(m))) == b);
+    TEST(cdr(car(cdr(m))) == c);
+    TEST(c_bool(null(cdr(cdr(m)))));
+    TEST(a == gc_sexp(a));
+}
+
+void test_shared() {
+    sexp s = cons(symbol("a", 1), symbol("b", 1));
+    sexp m = gc_sexp(cons(s, s));
+
+    TEST(car(m) == cdr(m));
+    TEST(car(car(m)) == symbol("a", 1));
+}
+
+void test_root() {
+    static sexp g;
+    gc_root(&g);
+    g = make_list(100);
+    sexp copy = make_list(100);
+
+    gc_sexp(ATOM_NIL());
+    TEST(c_bool(equal(g, make_list(100))));
+    copy = gc_sexp(copy);
+    TEST(c_bool(equal(g, copy)));
+    g = ATOM_NIL();
+}
+
+void test_garbage() {
+    struct gc_stats before;
+    struct gc_stats after;
+    int i = 0;
+    gc_stats(&before);
+    for (i = 0; i < 200; ++i) {
+        make_list(10000);
+        gc_sexp(ATOM_NIL());
+    }
+    gc_stats(&after);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    TEST(after.minors - before.minors == 200);
+    TEST(after.conses - before.conses == 200 * 10000);
+    TEST(after.old == before.old);
+    /* 64 MB would have been allocated without collection */
+    TEST(usage.ru_maxrss < 16 * 1024);
+}
+
+void test_major() {
+    struct gc_stats before;
+    struct gc_stats after;
+    gc_stats(&before);
+    sexp l = gc_sexp(make_list(400000));
+    sexp p = l;
+    int n = 0;
+    for (p = l; !c_bool(atom(p)); p = cdr(p)) {
+        n += car(p) == symbol(n % 2 ? "b" : "a", 1);
+    }
+    TEST(n == 400000);
+    l = gc_sexp(make_list(1000));
+    l = gc_sexp(l);
+    gc_stats(&after);
+
+    TEST(after.majors > before.majors);
+    TEST(after.old < 200000);
+    TEST(c_bool(equal(l, make_list(1000))));
+}
+
+void test_region() {
+    static sexp g;
+    struct gc_stats before;
+    struct gc_stats after;
+    char name[16];
+    int i = 0;
+
+    gc_stats(&before);
+    for (i = 0; i < 1000; ++i) {
+        region_begin();
+        sprintf(name, "x%d", i);
+        cons(symbol(name, strlen(name)), make_list(10));
+        region_end(ATOM_NIL());
+    }
+    gc_stats(&after);
+    TEST(after.atoms == before.atoms);
+    TEST(after.old == before.old);
+
+    gc_root(&g);
+    region_begin();
+    sexp k = cons(symbol("keep-1", 6), symbol("keep-2", 6));
+    g = symbol("rooted", 6);
+    symbol("drop", 4);
+    k = region_end(k);
+    gc_stats(&after);
+
+    TEST(after.atoms == before.atoms + 3);
+    TEST(0 == strcmp(c_str(car(k)), "keep-1"));
+    TEST(car(k) == symbol("keep-1", 6));
+    TEST(cdr(k) == symbol("keep-2", 6));
+    TEST(g == symbol("rooted", 6));
+    TEST(c_bool(eq(car(k), symbol("keep-1", 6))));
+}
+
+void test_ref() {
+    sexp x = symbol("x", 1);
+    sexp r = ref(x, 2);
+    sexp m = gc_sexp(cons(r, cons(r, ATOM_NIL())));
+
+    TEST(c_bool(atom(car(m))));
+    TEST(car(m) != r);
+    TEST(car(m) == car(cdr(m)));
+    TEST(REF_ATOM(car(m)) == x);
+    TEST(REF_SLOT(car(m)) == 2);
+    TEST(c_bool(eq(car(m), x)));
+    TEST(0 == strcmp(c_str(car(m)), "x"));
+}
+
+void test_hash_cons() {
+    struct gc_stats before;
+    struct gc_stats after;
+    hash_cons(true);
+    gc_stats(&before);
+    sexp l = make_list(1000);
+    gc_stats(&after);
+
+    TEST(make_list(1000) == l);
+    TEST(cons(car(l), cdr(l)) == l);
+    TEST(after.pairs - before.pairs == 1000);
+
+    /* survivors are found again once moved, garbage is dropped */
+    make_list(2000);
+    l = gc_sexp(l);
+    gc_stats(&after);
+    TEST(make_list(1000) == l);
+    TEST(after.pairs == 1000);
+
+    /* and so are cells holding atoms interned again by region_end() */
+    region_begin();
+    sexp k = cons(symbol("hc", 2), l);
+    k = region_end(k);
+    TEST(cons(symbol("hc", 2), make_list(1000)) == k);
+
+    l = gc_sexp(make_list(400000));
+    l = gc_sexp(l);
+    TEST(make_list(400000) == l);
+    TEST(c_bool(equal(l, make_list(400000))));
+
+    hash_cons(false);
+    TEST(make_list(10) != make_list(10));
+    TEST(c_bool(equal(make_list(10), make_list(10))));
+}
+
+void test_image() {
+    static sexp l;
+    const char* path = "test_gc.img";
+    gc_root(&l);
+    sexp s = cons(symbol("a", 1), symbol("img-only", 8));
+    l = cons(s, cons(s, cons(ref(symbol("x", 1), 1), make_list(400000))));
+    TEST(image_dump(path, l));
+
+    sexp m = image_load(path);
+    TEST(m != 0);
+    TEST(m != l);
+    TEST(c_bool(equal(m, l)));
+    TEST(car(m) == car(cdr(m)));
+    TEST(car(car(m)) == symbol("a", 1));
+    TEST(cdr(car(m)) == symbol("img-only", 8));
+    TEST(car(cdr(cdr(m))) == symbol("x", 1));
+
+    /* the image is old, collections leave it where it is */
+    make_list(10000);
+    TEST(gc_sexp(m) == m);
+    TEST(c_bool(equal(m, l)));
+
+    TEST(image_dump(path, ATOM_NIL()));
+    TEST(image_load(path) == ATOM_NIL());
+    TEST(!image_load("test_gc.c"));
+    TEST(!image_load("no-such-file"));
+
+    /* a truncated or corrupt image is rejected */
+    TEST(image_dump(path, make_list(10)));
+    FILE* f = fopen(path, "r+b");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    uint64_t bad = 0x7ffffff0;
+    fseek(f, size - sizeof bad, SEEK_SET);
+    fwrite(&bad, sizeof bad, 1, f);
+    fclose(f);
+    TEST(!image_load(path));
+    TEST(0 == truncate(path, size - 64));
+    TEST(!image_load(path));
+
+    /* so is one with an atom whose hash does not match its name */
+    TEST(image_dump(path, symbol("img-hash", 8)));
+    f = fopen(path, "r+b");
+    char buf[4096];
+    size = fread(buf, 1, sizeof buf, f);
+    long at = 0;
+    while (at + 9 <= size && memcmp(buf + at, "img-hash", 9)) {
+        ++at;
+    }
+    TEST(at + 9 <= size);
+    at += offsetof(struct atom_impl, hash) - sizeof(struct atom_impl);
+    unsigned hash = 0;
+    memcpy(&hash, buf + at, sizeof hash);
+    ++hash;
+    fseek(f, at, SEEK_SET);
+    fwrite(&hash, sizeof hash, 1, f);
+    fclose(f);
+    TEST(!image_load(path));
+    remove(path);
+    l = ATOM_NIL();
+}
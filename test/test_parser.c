@@ -20,21 +20,38 @@
 
 #include "constants.h"
 #include "parser.h"
+#include "reader.h"
+#include "scan.h"
 #include "utils.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 void test_parse();
+void test_parse_large();
 void test_print();
 void test_print_list_notation();
+void test_print_sink();
+void test_reader();
+void test_reader_large();
+void test_reader_map();
+void test_scan();
 
 int main(int argc, char* argv[]) {
     test_parse();
+    test_parse_large();
     test_print();
     test_print_list_notation();
+    test_print_sink();
+    test_reader();
+    test_reader_large();
+    test_reader_map();
+    test_scan();
 
     printf("\n");
 
@@ -81,6 +98,57 @@ void test_parse() {
     str = "(a . b )";
     t = parse(&str);
     TEST(c_bool(equal(t,cons(symbol("a",1),symbol("b",1)))));
+
+    str = "(a b . c) d";
+    t = parse(&str);
+    TEST(c_bool(equal(t,cons(symbol("a",1),cons(symbol("b",1),symbol("c",1))))));
+    TEST(0 == strcmp(str, " d"));
+
+    str = "(a '(b) ''c)";
+    t = parse(&str);
+    char buf[64];
+    print_list_notation(buf, sizeof buf, t);
+    TEST(0 == strcmp(buf, "(a '(b) ''c)"));
+
+    str = "((a b)";
+    TEST(0 == parse(&str));
+
+    str = ")";
+    TEST(0 == parse(&str));
+}
+
+void test_parse_large() {
+    const size_t n = 1000000;
+
+    /* a long flat list */
+    char* text = malloc(2 * n + 3);
+    char* q = text;
+    *q++ = '(';
+    for (size_t i = 0; i < n; ++i) {
+        *q++ = 'a' + i % 26;
+        *q++ = ' ';
+    }
+    *q++ = ')';
+    *q = '\0';
+    const char* str = text;
+    sexp t = parse(&str);
+    TEST(*str == '\0');
+    TEST(c_bool(eq(car(t), symbol("a", 1))));
+    size_t len = 0;
+    for (sexp l = t; !c_bool(null(l)); l = cdr(l)) { ++len; }
+    TEST(len == n);
+
+    /* a deep one */
+    q = text;
+    for (size_t i = 0; i < n; ++i) { *q++ = '('; }
+    for (size_t i = 0; i < n; ++i) { *q++ = ')'; }
+    *q = '\0';
+    str = text;
+    t = parse(&str);
+    size_t depth = 0;
+    for (; !c_bool(null(t)); t = car(t)) { ++depth; }
+    TEST(depth == n - 1);
+    free(text);
 }
 
 void test_print() {
@@ -107,4 +175,196 @@ void test_print_list_notation() {
 
     int t2 = print_list_notation(buf, 5, t);
     TEST(5 <= t2);
+    TEST(0 == strncmp(buf, str, 4) && buf[4] == '\0');
+
+    p = "(a . b)";
+    print_list_notation(buf, sizeof(buf)/sizeof(char), parse(&p));
+    TEST(0 == strcmp(buf, "(a . b)"));
+    p = "(quote a b)";
+    print_list_notation(buf, sizeof(buf)/sizeof(char), parse(&p));
+    TEST(0 == strcmp(buf, "'a b"));
+}
+
+void test_print_sink() {
+    /* long and deep results print in full */
+    const int n = 1000000;
+    sexp a = symbol("a", 1);
+    sexp l = ATOM_NIL();
+    sexp d = a;
+    int i = 0;
+    for (i = 0; i < n; ++i) {
+        l = cons(a, l);
+        d = cons(d, ATOM_NIL());
+    }
+
+    struct sink s;
+    sink_buffer(&s);
+    print_list(&s, l);
+    TEST(s.len == 2 * n + 1 && s.buf[0] == '(' && s.buf[2 * n + 1] == '\0');
+    TEST(s.buf[2 * n] == ')' && s.buf[2 * n - 1] == 'a');
+    sink_close(&s);
+
+    sink_buffer(&s);
+    print_list(&s, d);
+    TEST(s.len == 2 * n + 1 && s.buf[n] == 'a' && s.buf[n - 1] == '(');
+    sink_close(&s);
+
+    sink_buffer(&s);
+    print_dot(&s, cons(a, cons(a, ATOM_NIL())));
+    TEST(0 == strcmp(s.buf, "(a . (a . nil))"));
+    sink_close(&s);
+
+    /* a stream gets the same text */
+    FILE* f = tmpfile();
+    sink_file(&s, f);
+    print_list(&s, l);
+    sink_close(&s);
+    TEST(ftell(f) == 2 * n + 1);
+    rewind(f);
+    TEST(fgetc(f) == '(' && fgetc(f) == 'a' && fgetc(f) == ' ');
+    fclose(f);
+}
+
+void test_reader() {
+    FILE* f = tmpfile();
+    fputs("(a\n  (b c)\n d) e 'f\n''(g . h)(i)j ) k", f);
+    rewind(f);
+    struct reader r;
+    reader_file(&r, f);
+    char buf[200];
+    const char* want[] = {
+        "(a (b c) d)", "e", "'f", "''(g . h)", "(i)", "j", "k"
+    };
+    int i = 0;
+    for (i = 0; i < sizeof(want)/sizeof(char*); ++i) {
+        sexp e = reader_next(&r);
+        TEST(e != 0);
+        print_list_notation(buf, sizeof(buf)/sizeof(char), e);
+        TEST(0 == strcmp(buf, want[i]));
+    }
+    TEST(reader_next(&r) == 0 && r.error == 0);
+    reader_close(&r);
+    fclose(f);
+
+    /* an unfinished form is not mistaken for a complete one */
+    f = tmpfile();
+    fputs("(a (b", f);
+    rewind(f);
+    reader_file(&r, f);
+    TEST(reader_next(&r) == 0 && r.error != 0);
+    reader_close(&r);
+    fclose(f);
+}
+
+void test_reader_large() {
+    /* a literal much bigger than a chunk, read from a descriptor */
+    const int n = 50000;
+    const char* name = "abcdefghijklmnopqrst";
+    FILE* f = tmpfile();
+    int i = 0;
+    fputs("(quote (", f);
+    for (i = 0; i < n; ++i) {
+        fprintf(f, "%s\n", name);
+    }
+    fputs(")) x", f);
+    fflush(f);
+    rewind(f);
+
+    struct reader r;
+    reader_fd(&r, fileno(f));
+    sexp e = reader_next(&r);
+    TEST(c_bool(eq(car(e), ATOM_QUOTE())));
+    int len = 0;
+    int same = 0;
+    for (e = car(cdr(e)); !c_bool(atom(e)); e = cdr(e)) {
+        ++len;
+        same += c_bool(eq(car(e), symbol(name, strlen(name))));
+    }
+    TEST(len == n && same == n);
+    TEST(c_bool(eq(reader_next(&r), symbol("x", 1))));
+    TEST(r.cap < 2 * 21 * n + 256);
+    reader_close(&r);
+    fclose(f);
+}
+
+void test_reader_map() {
+    char path[] = "/tmp/test_parserXXXXXX";
+    int fd = mkstemp(path);
+    const char* text = "(a b)\n'c (d\n e) f";
+    write(fd, text, strlen(text));
+    close(fd);
+
+    struct reader r;
+    char buf[200];
+    TEST(reader_map(&r, path));
+    const char* want[] = { "(a b)", "'c", "(d e)", "f" };
+    int i = 0;
+    for (i = 0; i < sizeof(want)/sizeof(char*); ++i) {
+        sexp e = reader_next(&r);
+        TEST(e != 0);
+        print_list_notation(buf, sizeof(buf)/sizeof(char), e);
+        TEST(0 == strcmp(buf, want[i]));
+    }
+    TEST(reader_next(&r) == 0 && r.error == 0);
+    reader_close(&r);
+
+    /* a file that fills its last page still ends with a '\0' */
+    fd = open(path, O_WRONLY | O_TRUNC);
+    long page = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < page - 1; ++i) {
+        write(fd, " ", 1);
+    }
+    write(fd, "g", 1);
+    close(fd);
+    TEST(reader_map(&r, path));
+    TEST(c_bool(eq(reader_next(&r), symbol("g", 1))));
+    TEST(reader_next(&r) == 0);
+    reader_close(&r);
+
+    unlink(path);
+    TEST(!reader_map(&r, path));
+}
+
+void test_scan() {
+    const char* kernels[] = { "avx2", "sse2", "scalar" };
+    const char alphabet[] = "ab( )\t\r\n'xyz";
+    char text[200];
+
+    /* runs of up to 40 of one kind of byte, so that runs cross
+     * vector blocks */
+    srand(19);
+    for (size_t i = 0; i < sizeof text - 1; ) {
+        const int kind = rand() % 3;
+        for (int n = 1 + rand() % 40; n && i < sizeof text - 1; --n) {
+            text[i++] = kind == 0 ? 'a' + rand() % 26
+                      : kind == 1 ? " \t\r\n"[rand() % 4]
+                      : alphabet[rand() % (sizeof alphabet - 1)];
+        }
+    }
+    text[sizeof text - 1] = '\0';
+
+    TEST(!scan_kernel("mmx"));
+    for (size_t k = 0; k < sizeof kernels / sizeof *kernels; ++k) {
+        if (!scan_kernel(kernels[k])) { continue; }
+        TEST(0 == strcmp(scan_kernel_name(), kernels[k]));
+        for (size_t i = 0; i < sizeof text - 1; ++i) {
+            const char* s = text + i;
+            const char* q = s;
+            while (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n') {
+                ++q;
+            }
+            assert(scan_space(s) == q);
+            q = s;
+            while (*q && !strchr(" \t\r\n()", *q)) { ++q; }
+            assert(scan_atom(s) == q);
+            for (size_t n = 0; i + n < sizeof text && n < 70; ++n) {
+                q = s;
+                while (q < s + n && *q != '(' && *q != ')') { ++q; }
+                assert(scan_paren(s, s + n) == q);
+            }
+        }
+        TEST(true);
+        test_parse();
+        test_parse_large();
+    }
 }